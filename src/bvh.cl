@@ -7,10 +7,609 @@
 
 //#define USE_BITSTACK
 
-#ifdef USE_BITSTACK
+#ifdef LEAF_ORDER_TRIS
+// Leaves reference contiguous positions, index list not needed
+#define LEAF_TRI(i) (&triPos[i])
+#ifdef TRI_WOOP
+#define LEAF_TRI_ID(i) (triPos[i].id)
+#else
+#define LEAF_TRI_ID(i) TRI_POS_ID(&triPos[i])
+#endif
+#else
+#define LEAF_TRI(i) (&triPos[indices[i]])
+#define LEAF_TRI_ID(i) ((int)indices[i])
+#endif
+
+// Per-ray traversal cost for the heatmap, always counted on the world-space ray
+#ifdef TRAVERSAL_STATS
+#define TRAVERSAL_NODE(r) ((r)->nodeVisits++)
+#define TRAVERSAL_TRI(r) ((r)->triTests++)
+#else
+#define TRAVERSAL_NODE(r)
+#define TRAVERSAL_TRI(r)
+#endif
+
+#ifdef TRAVERSAL_STATS
+// Counts are accumulated per pixel: [node visits, triangle tests]
+inline void recordTraversalStats(Ray *r, global uint *traversalStats, uint pixel)
+{
+    atomic_add(&traversalStats[2 * pixel + 0], r->nodeVisits);
+    atomic_add(&traversalStats[2 * pixel + 1], r->triTests);
+}
+#endif
+
+#if defined(USE_INSTANCING)
+// Two-level traversal, node buffer holds [top-level nodes | instance records | bottom-level nodes].
+// Rays are moved into instance space for the bottom-level trees, directions are not
+// renormalized so t is shared by both levels. Combined depth must fit the stack.
+// instanceRecord and normalToWorld are in utils.cl.
+
+inline void transformRay(Ray *world, Ray *local, global GPUInstance *inst)
+{
+    const float4 r0 = vload4(0, inst->worldToObject);
+    const float4 r1 = vload4(1, inst->worldToObject);
+    const float4 r2 = vload4(2, inst->worldToObject);
+    local->orig = (float3)(dot(r0.xyz, world->orig) + r0.w, dot(r1.xyz, world->orig) + r1.w, dot(r2.xyz, world->orig) + r2.w);
+    local->dir = (float3)(dot(r0.xyz, world->dir), dot(r1.xyz, world->dir), dot(r2.xyz, world->dir));
+}
+
+inline void bvh_intersect(Ray *r, Hit *hit, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    float2 hitUV = (float2)(0.0f);
+    uint hitInst = 0;
+    bool found = false;
+    float lnear, lfar, rnear, rfar; // AABB limits
+    uint closer, farther;
+
+    // Ray in the space of the current level
+    Ray ray = *r;
+    uint inst = 0;
+    int instBase = -2; // stack pointer at instance entry, -2 in the top level
+
+    // Stack state
+    uint stack[64]; // causes large stack frames (NVIDIA build log)
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
+
+    while (true)
+    {
+        // Bottom-level tree finished
+        if (stackptr == instBase)
+        {
+            ray = *r;
+            instBase = -2;
+        }
+        if (stackptr < 0)
+            break;
+
+        // Next node
+        int ni = stack[stackptr];
+        stackptr--;
+        const GPUNode n = nodes[ni];
+        TRAVERSAL_NODE(r);
+
+        if (n.nPrims != 0 && instBase == -2) // Instance leaf
+        {
+            inst = n.iStart;
+            transformRay(r, &ray, instanceRecord(nodes, inst));
+            instBase = stackptr;
+            stack[++stackptr] = n.leftChild;
+        }
+        else if (n.nPrims != 0) // Leaf node
+        {
+            float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
+            int imin = -1;
+            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+            {
+                float t, u, v;
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(&ray, LEAF_TRI(i), &t, &u, &v))
+                {
+                    if (t > 0.0f && t < tmin)
+                    {
+                        imin = i;
+                        tmin = t;
+                        umin = u;
+                        vmin = v;
+                    }
+                }
+            }
+            if (imin != -1 && tmin < hit->t)
+            {
+                hit->i = LEAF_TRI_ID(imin);
+                hit->t = tmin;
+                hitUV = (float2)(umin, vmin);
+                hitInst = inst;
+                found = true;
+            }
+        }
+        else // Internal node
+        {
+            bool leftWasHit = intersectAABB(&ray, &(nodes[n.leftChild].box), &lnear, &lfar, hit->t);
+            bool rightWasHit = intersectAABB(&ray, &(nodes[n.rightChild].box), &rnear, &rfar, hit->t);
+
+            if (leftWasHit && rightWasHit)
+            {
+                closer = n.leftChild;
+                farther = n.rightChild;
+
+                // Right child was closer -> swap
+                if (rnear < lnear) swap_m(closer, farther, uint);
+
+                // Farther node pushed first
+                stack[++stackptr] = farther;
+                stack[++stackptr] = closer;
+            }
+
+            else if (leftWasHit)
+            {
+                stack[++stackptr] = n.leftChild;
+            }
+
+            else if (rightWasHit)
+            {
+                stack[++stackptr] = n.rightChild;
+            }
+        }
+    }
+
+    // Instance kept for the world space normal, see interpolateHit
+    if (found)
+    {
+        hit->bary = hitUV;
+        hit->inst = hitInst;
+    }
+}
+
+inline bool bvh_occluded(Ray *r, float *maxDist, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    float lnear, lfar, rnear, rfar; // AABB limits
+    uint closer, farther;
+
+    Ray ray = *r;
+    int instBase = -2;
+
+    // Stack state
+    uint stack[64]; // causes large stack frames (NVIDIA build log)
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
+
+    while (true)
+    {
+        if (stackptr == instBase)
+        {
+            ray = *r;
+            instBase = -2;
+        }
+        if (stackptr < 0)
+            break;
+
+        // Next node
+        int ni = stack[stackptr];
+        stackptr--;
+        const GPUNode n = nodes[ni];
+        TRAVERSAL_NODE(r);
+
+        if (n.nPrims != 0 && instBase == -2) // Instance leaf
+        {
+            transformRay(r, &ray, instanceRecord(nodes, n.iStart));
+            instBase = stackptr;
+            stack[++stackptr] = n.leftChild;
+        }
+        else if (n.nPrims != 0) // Leaf node
+        {
+            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+            {
+                float t, u, v;
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(&ray, LEAF_TRI(i), &t, &u, &v) && t > 0.0f && t < *maxDist)
+                {
+                    return true;
+                }
+            }
+        }
+        else // Internal node
+        {
+            bool leftWasHit = intersectAABB(&ray, &(nodes[n.leftChild].box), &lnear, &lfar, *maxDist);
+            bool rightWasHit = intersectAABB(&ray, &(nodes[n.rightChild].box), &rnear, &rfar, *maxDist);
+
+            if (leftWasHit && rightWasHit)
+            {
+                closer = n.leftChild;
+                farther = n.rightChild;
+
+                // Right child was closer -> swap
+                if (rnear < lnear) swap_m(closer, farther, uint);
+
+                // Farther node pushed first
+                stack[++stackptr] = farther;
+                stack[++stackptr] = closer;
+            }
+
+            else if (leftWasHit)
+            {
+                stack[++stackptr] = n.leftChild;
+            }
+
+            else if (rightWasHit)
+            {
+                stack[++stackptr] = n.rightChild;
+            }
+        }
+    }
+
+    return false;
+}
+
+#elif defined(USE_WIDE_BVH)
+// Traversal of collapsed BVH4/BVH8, all child boxes of a node tested at once
+// Node buffer contains GPUWideNode, signature kept for the calling kernels
+
+#if BVH_WIDTH == 4
+typedef float4 floatW;
+typedef int4 intW;
+#define vloadW vload4
+#define vstoreW vstore4
+#elif BVH_WIDTH == 8
+typedef float8 floatW;
+typedef int8 intW;
+#define vloadW vload8
+#define vstoreW vstore8
+#else
+#error "BVH_WIDTH must be 4 or 8"
+#endif
+
+// Up to BVH_WIDTH - 1 deferred children per level, set from the
+// collapsed hierarchy's height at upload (fallback before any upload)
+#ifndef WIDE_STACK_SIZE
+#define WIDE_STACK_SIZE ((BVH_WIDTH - 1) * 24 + 1)
+#endif
+
+// Slab test against all children, writes entry distances and hit flags
+inline void intersectChildren(global GPUWideNode *n, float3 orig, float3 dinv, float tMax, float *tNear, int *hits)
+{
+    const floatW tx0 = (vloadW(0, n->bminx) - orig.x) * dinv.x;
+    const floatW tx1 = (vloadW(0, n->bmaxx) - orig.x) * dinv.x;
+    const floatW ty0 = (vloadW(0, n->bminy) - orig.y) * dinv.y;
+    const floatW ty1 = (vloadW(0, n->bmaxy) - orig.y) * dinv.y;
+    const floatW tz0 = (vloadW(0, n->bminz) - orig.z) * dinv.z;
+    const floatW tz1 = (vloadW(0, n->bmaxz) - orig.z) * dinv.z;
+
+    const floatW tmin = fmax(fmax(fmin(tx0, tx1), fmin(ty0, ty1)), fmin(tz0, tz1));
+    const floatW tmax = fmin(fmin(fmax(tx0, tx1), fmax(ty0, ty1)), fmax(tz0, tz1));
+    const intW valid = vloadW(0, n->child) != (intW)(-1);
+
+    vstoreW(tmin, 0, tNear);
+    vstoreW(valid & (tmax >= (floatW)(0.0f)) & (tmin <= tmax) & (tmin < (floatW)(tMax)), 0, hits);
+}
+
+// Returns true if a closer hit was found
+inline bool intersectLeaf(Ray *r, Hit *hit, global LeafTriangle *triPos, global uint *indices, uint iStart, uint nPrims, float2 *hitUV)
+{
+    float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
+    int imin = -1;
+    for (uint i = iStart; i < iStart + nPrims; i++)
+    {
+        float t, u, v;
+        TRAVERSAL_TRI(r);
+        if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v))
+        {
+            if (t > 0.0f && t < tmin)
+            {
+                imin = i;
+                tmin = t;
+                umin = u;
+                vmin = v;
+            }
+        }
+    }
+    if (imin != -1 && tmin < hit->t)
+    {
+        hit->i = LEAF_TRI_ID(imin);
+        hit->t = tmin;
+        *hitUV = (float2)(umin, vmin);
+        return true;
+    }
+    return false;
+}
+
+inline void bvh_intersect(Ray *r, Hit *hit, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    float2 hitUV = (float2)(0.0f);
+    bool found = false;
+    global GPUWideNode *wnodes = (global GPUWideNode*)nodes;
+    const float3 dinv = native_recip(r->dir);
+
+    // Stack entries: node index and entry distance
+    uint stack[WIDE_STACK_SIZE];
+    float stackT[WIDE_STACK_SIZE];
+    int stackptr = 0;
+    stack[0] = 0;
+    stackT[0] = 0.0f;
+
+    while (stackptr >= 0)
+    {
+        const uint ni = stack[stackptr];
+        const float tEntry = stackT[stackptr];
+        stackptr--;
+
+        // Closer hit found after push
+        if (tEntry >= hit->t)
+            continue;
+
+        global GPUWideNode *n = &wnodes[ni];
+        TRAVERSAL_NODE(r);
+        float tNear[BVH_WIDTH];
+        int hits[BVH_WIDTH];
+        intersectChildren(n, r->orig, dinv, hit->t, tNear, hits);
+
+        // Leaves first, inner children sorted by distance (insertion sort, nearest last)
+        uint inner[BVH_WIDTH];
+        float innerT[BVH_WIDTH];
+        int numInner = 0;
+        for (int c = 0; c < BVH_WIDTH; c++)
+        {
+            if (!hits[c])
+                continue;
+
+            if (n->nPrims[c] != 0)
+            {
+                found |= intersectLeaf(r, hit, triPos, indices, (uint)n->child[c], n->nPrims[c], &hitUV);
+                continue;
+            }
+
+            int k = numInner++;
+            while (k > 0 && innerT[k - 1] < tNear[c])
+            {
+                inner[k] = inner[k - 1];
+                innerT[k] = innerT[k - 1];
+                k--;
+            }
+            inner[k] = (uint)n->child[c];
+            innerT[k] = tNear[c];
+        }
+
+        // Farther nodes pushed first
+        for (int k = 0; k < numInner; k++)
+        {
+            if (innerT[k] < hit->t)
+            {
+                stack[++stackptr] = inner[k];
+                stackT[stackptr] = innerT[k];
+            }
+        }
+    }
+
+    // Compact hit record, shading attributes interpolated on use
+    if (found)
+        hit->bary = hitUV;
+}
+
+inline bool bvh_occluded(Ray *r, float *maxDist, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    global GPUWideNode *wnodes = (global GPUWideNode*)nodes;
+    const float3 dinv = native_recip(r->dir);
+
+    // Any hit terminates => no ordering needed
+    uint stack[WIDE_STACK_SIZE];
+    int stackptr = 0;
+    stack[0] = 0;
+
+    while (stackptr >= 0)
+    {
+        global GPUWideNode *n = &wnodes[stack[stackptr--]];
+        TRAVERSAL_NODE(r);
+        float tNear[BVH_WIDTH];
+        int hits[BVH_WIDTH];
+        intersectChildren(n, r->orig, dinv, *maxDist, tNear, hits);
+
+        for (int c = 0; c < BVH_WIDTH; c++)
+        {
+            if (!hits[c])
+                continue;
+
+            if (n->nPrims[c] == 0)
+            {
+                stack[++stackptr] = (uint)n->child[c];
+                continue;
+            }
+
+            const uint iStart = (uint)n->child[c];
+            for (uint i = iStart; i < iStart + n->nPrims[c]; i++)
+            {
+                float t, u, v;
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v) && t > 0.0f && t < *maxDist)
+                {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+#elif defined(USE_QUANTIZED_BVH)
+// Stack traversal of compressed nodes, child boxes decoded from the parent
+// No parent indices in the node => bitstack traversal not available
+// Node buffer contains GPUQuantizedNode, signature kept for the calling kernels
+
+// Tests both children of an interior node
+inline void intersectQuantizedChildren(Ray *r, global GPUQuantizedNode *n, float tMax, float *lnear, float *rnear, bool *leftHit, bool *rightHit)
+{
+    float lfar, rfar;
+    const float3 origin = vload3(0, n->origin);
+    const float3 scale = (float3)(ldexp(1.0f, (int)n->exponent[0]), ldexp(1.0f, (int)n->exponent[1]), ldexp(1.0f, (int)n->exponent[2]));
+    const float3 lmin = (float3)(n->childMin[0], n->childMin[1], n->childMin[2]);
+    const float3 lmax = (float3)(n->childMax[0], n->childMax[1], n->childMax[2]);
+    const float3 rmin = (float3)(n->childMin[3], n->childMin[4], n->childMin[5]);
+    const float3 rmax = (float3)(n->childMax[3], n->childMax[4], n->childMax[5]);
+    *leftHit = intersectAABBQuantized(r, origin, scale, lmin, lmax, lnear, &lfar, tMax);
+    *rightHit = intersectAABBQuantized(r, origin, scale, rmin, rmax, rnear, &rfar, tMax);
+}
+
+inline void bvh_intersect(Ray *r, Hit *hit, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    float2 hitUV = (float2)(0.0f);
+    bool found = false;
+    global GPUQuantizedNode *qnodes = (global GPUQuantizedNode*)nodes;
+    float lnear, rnear;
+    bool leftWasHit, rightWasHit;
+    uint closer, farther;
+
+    // Stack state
+    uint stack[64];
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
+
+    while (stackptr >= 0)
+    {
+        // Next node
+        int ni = stack[stackptr];
+        stackptr--;
+        global GPUQuantizedNode *n = &qnodes[ni];
+        TRAVERSAL_NODE(r);
+
+        if (n->nPrims != 0) // Leaf node
+        {
+            float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
+            int imin = -1;
+            for (uint i = n->iStart; i < n->iStart + n->nPrims; i++)
+            {
+                float t, u, v;
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v))
+                {
+                    if (t > 0.0f && t < tmin)
+                    {
+                        imin = i;
+                        tmin = t;
+                        umin = u;
+                        vmin = v;
+                    }
+                }
+            }
+            if (imin != -1 && tmin < hit->t)
+            {
+                hit->i = LEAF_TRI_ID(imin);
+                hit->t = tmin;
+                hitUV = (float2)(umin, vmin);
+                found = true;
+            }
+        }
+        else // Internal node
+        {
+            intersectQuantizedChildren(r, n, hit->t, &lnear, &rnear, &leftWasHit, &rightWasHit);
+
+            if (leftWasHit && rightWasHit)
+            {
+                closer = ni + 1;
+                farther = n->rightChild;
+
+                // Right child was closer -> swap
+                if (rnear < lnear) swap_m(closer, farther, uint);
+
+                // Farther node pushed first
+                stack[++stackptr] = farther;
+                stack[++stackptr] = closer;
+            }
+
+            else if (leftWasHit)
+            {
+                stack[++stackptr] = ni + 1;
+            }
+
+            else if (rightWasHit)
+            {
+                stack[++stackptr] = n->rightChild;
+            }
+        }
+    }
+
+    // Compact hit record, shading attributes interpolated on use
+    if (found)
+        hit->bary = hitUV;
+}
+
+inline bool bvh_occluded(Ray *r, float *maxDist, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    global GPUQuantizedNode *qnodes = (global GPUQuantizedNode*)nodes;
+    float lnear, rnear;
+    bool leftWasHit, rightWasHit;
+    uint closer, farther;
+
+    // Stack state
+    uint stack[64];
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
+
+    while (stackptr >= 0)
+    {
+        // Next node
+        int ni = stack[stackptr];
+        stackptr--;
+        global GPUQuantizedNode *n = &qnodes[ni];
+        TRAVERSAL_NODE(r);
+
+        if (n->nPrims != 0) // Leaf node
+        {
+            for (uint i = n->iStart; i < n->iStart + n->nPrims; i++)
+            {
+                float t, u, v;
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v) && t > 0.0f && t < *maxDist)
+                {
+                    return true;
+                }
+            }
+        }
+        else // Internal node
+        {
+            intersectQuantizedChildren(r, n, *maxDist, &lnear, &rnear, &leftWasHit, &rightWasHit);
+
+            if (leftWasHit && rightWasHit)
+            {
+                closer = ni + 1;
+                farther = n->rightChild;
+
+                // Right child was closer -> swap
+                if (rnear < lnear) swap_m(closer, farther, uint);
+
+                // Farther node pushed first
+                stack[++stackptr] = farther;
+                stack[++stackptr] = closer;
+            }
+
+            else if (leftWasHit)
+            {
+                stack[++stackptr] = ni + 1;
+            }
+
+            else if (rightWasHit)
+            {
+                stack[++stackptr] = n->rightChild;
+            }
+        }
+    }
+
+    return false;
+}
+
+#elif defined(USE_BITSTACK)
 // Traversal with bitstacks - https://github.com/martinradev/BVH-algo-lib/blob/master/shaders/trace.glsl
-inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline void bvh_intersect(Ray *r, Hit *hit, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
 {
+    float2 hitUV = (float2)(0.0f);
+    bool found = false;
     int top = 0;
     int lstack = 0;
     int rstack = 0;
@@ -19,6 +618,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
     {
         bool trackback = false;
         GPUNode n = nodes[top]; // updated in backtracing stage => not const
+        TRAVERSAL_NODE(r);
 
         if (n.nPrims != 0) // Leaf node
         {
@@ -27,7 +627,8 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
             {
                 float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v))
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v))
                 {
                     if (t > 0.0f && t < tmin)
                     {
@@ -40,12 +641,10 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
             if (imin != -1 && tmin < hit->t)
             {
-                hit->i = indices[imin];
-                hit->matId = tris[indices[imin]].matId;
+                hit->i = LEAF_TRI_ID(imin);
                 hit->t = tmin;
-                hit->P = r->orig + tmin * r->dir;
-                hit->N = normalize(lerp(umin, vmin, tris[indices[imin]].v0.n, tris[indices[imin]].v1.n, tris[indices[imin]].v2.n));
-                hit->uvTex = lerp(umin, vmin, tris[indices[imin]].v0.t, tris[indices[imin]].v1.t, tris[indices[imin]].v2.t).xy;
+                hitUV = (float2)(umin, vmin);
+                found = true;
             }
 
             trackback = true;
@@ -53,7 +652,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
         else {
             float dummy, t1, t2;
 
-            bool r1 = intersectAABB(r, &(nodes[top + 1].box), &t1, &dummy, hit->t);
+            bool r1 = intersectAABB(r, &(nodes[n.leftChild].box), &t1, &dummy, hit->t);
             bool r2 = intersectAABB(r, &(nodes[n.rightChild].box), &t2, &dummy, hit->t);
 
             if (r1 && r2)
@@ -61,7 +660,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 if (t1 <= t2)
                 {
                     // first left
-                    top = top + 1; // left child
+                    top = n.leftChild; // left child
                     lstack = (lstack | 1) << 1;
                     rstack <<= 1;
                 }
@@ -75,7 +674,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
             else if (r1)
             {
-                top = top + 1;
+                top = n.leftChild;
                 lstack <<= 1;
                 rstack <<= 1;
             }
@@ -108,7 +707,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 }
                 else if ((rstack & 1) != 0) {
                     // visit left node
-                    top = top + 1;
+                    top = n.leftChild;
                     rstack &= ~1;
                     lstack <<= 1;
                     rstack <<= 1;
@@ -124,10 +723,14 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 break;
         }
     }
+
+    // Compact hit record, shading attributes interpolated on use
+    if (found)
+        hit->bary = hitUV;
 }
 
 // Traversal with bitstacks - https://github.com/martinradev/BVH-algo-lib/blob/master/shaders/trace.glsl
-inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline bool bvh_occluded(Ray *r, float *maxDist, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
 {
     int top = 0;
     int lstack = 0;
@@ -137,13 +740,15 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
     {
         bool trackback = false;
         GPUNode n = nodes[top]; // updated in backtracing stage => not const
+        TRAVERSAL_NODE(r);
 
         if (n.nPrims != 0) // Leaf node
         {
             for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
             {
                 float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v) && t > 0.0f && t < *maxDist)
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v) && t > 0.0f && t < *maxDist)
                 {
                     return true;
                 }
@@ -154,7 +759,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
         else {
             float dummy, t1, t2;
 
-            bool r1 = intersectAABB(r, &(nodes[top + 1].box), &t1, &dummy, *maxDist);
+            bool r1 = intersectAABB(r, &(nodes[n.leftChild].box), &t1, &dummy, *maxDist);
             bool r2 = intersectAABB(r, &(nodes[n.rightChild].box), &t2, &dummy, *maxDist);
 
             if (r1 && r2)
@@ -162,7 +767,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
                 if (t1 <= t2)
                 {
                     // first left
-                    top = top + 1; // left child
+                    top = n.leftChild; // left child
                     lstack = (lstack | 1) << 1;
                     rstack <<= 1;
                 }
@@ -176,7 +781,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
             }
             else if (r1)
             {
-                top = top + 1;
+                top = n.leftChild;
                 lstack <<= 1;
                 rstack <<= 1;
             }
@@ -209,7 +814,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
                 }
                 else if ((rstack & 1) != 0) {
                     // visit left node
-                    top = top + 1;
+                    top = n.leftChild;
                     rstack &= ~1;
                     lstack <<= 1;
                     rstack <<= 1;
@@ -231,8 +836,10 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
 
 #else
 // BVH traversal using simulated stack
-inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline void bvh_intersect(Ray *r, Hit *hit, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
 {
+    float2 hitUV = (float2)(0.0f);
+    bool found = false;
     float lnear, lfar, rnear, rfar; // AABB limits
     uint closer, farther;
 
@@ -249,6 +856,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
         int ni = stack[stackptr];
         stackptr--;
         const GPUNode n = nodes[ni];
+        TRAVERSAL_NODE(r);
 
         if (n.nPrims != 0) // Leaf node
         {
@@ -257,7 +865,8 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
             {
                 float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v))
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v))
                 {
                     if (t > 0.0f && t < tmin)
                     {
@@ -270,22 +879,20 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
             if (imin != -1 && tmin < hit->t)
             {
-                hit->i = indices[imin];
-                hit->matId = tris[indices[imin]].matId;
+                hit->i = LEAF_TRI_ID(imin);
                 hit->t = tmin;
-                hit->P = r->orig + tmin * r->dir;
-                hit->N = normalize(lerp(umin, vmin, tris[indices[imin]].v0.n, tris[indices[imin]].v1.n, tris[indices[imin]].v2.n));
-                hit->uvTex = lerp(umin, vmin, tris[indices[imin]].v0.t, tris[indices[imin]].v1.t, tris[indices[imin]].v2.t).xy;
+                hitUV = (float2)(umin, vmin);
+                found = true;
             }
         }
         else // Internal node
         {
-            bool leftWasHit = intersectAABB(r, &(nodes[ni + 1].box), &lnear, &lfar, hit->t);
+            bool leftWasHit = intersectAABB(r, &(nodes[n.leftChild].box), &lnear, &lfar, hit->t);
             bool rightWasHit = intersectAABB(r, &(nodes[n.rightChild].box), &rnear, &rfar, hit->t);
 
             if (leftWasHit && rightWasHit)
             {
-                closer = ni + 1;
+                closer = n.leftChild;
                 farther = n.rightChild;
 
                 // Right child was closer -> swap
@@ -298,7 +905,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
 
             else if (leftWasHit)
             {
-                stack[++stackptr] = ni + 1;
+                stack[++stackptr] = n.leftChild;
             }
 
             else if (rightWasHit)
@@ -307,9 +914,13 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
         }
     }
+
+    // Compact hit record, shading attributes interpolated on use
+    if (found)
+        hit->bary = hitUV;
 }
 
-inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline bool bvh_occluded(Ray *r, float *maxDist, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
 {
     float lnear, lfar, rnear, rfar; // AABB limits
     uint closer, farther;
@@ -327,13 +938,15 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
         int ni = stack[stackptr];
         stackptr--;
         const GPUNode n = nodes[ni];
+        TRAVERSAL_NODE(r);
 
         if (n.nPrims != 0) // Leaf node
         {
             for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
             {
                 float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v) && t > 0.0f && t < *maxDist)
+                TRAVERSAL_TRI(r);
+                if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v) && t > 0.0f && t < *maxDist)
                 {
                     return true;
                 }
@@ -341,12 +954,12 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
         }
         else // Internal node
         {
-            bool leftWasHit = intersectAABB(r, &(nodes[ni + 1].box), &lnear, &lfar, *maxDist);
+            bool leftWasHit = intersectAABB(r, &(nodes[n.leftChild].box), &lnear, &lfar, *maxDist);
             bool rightWasHit = intersectAABB(r, &(nodes[n.rightChild].box), &rnear, &rfar, *maxDist);
 
             if (leftWasHit && rightWasHit)
             {
-                closer = ni + 1;
+                closer = n.leftChild;
                 farther = n.rightChild;
 
                 // Right child was closer -> swap
@@ -359,7 +972,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
 
             else if (leftWasHit)
             {
-                stack[++stackptr] = ni + 1;
+                stack[++stackptr] = n.leftChild;
             }
 
             else if (rightWasHit)
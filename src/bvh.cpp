@@ -1,14 +1,26 @@
 #include <iostream>
 #include <cfloat>
 #include <cassert>
+#include <future>
+#include <algorithm>
+#include <thread>
+#include <limits>
+#include <deque>
+#include <queue>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <numeric>
 
 #include <time.h>
 #include "bvh.hpp"
+#include "mappedfile.hpp"
 
-BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode)
+BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode, U32 numThreads)
 {
     m_triangles = tris;
     m_mode = mode;
+	setBuildThreads(numThreads);
 	
 	size_t tris_sz = m_triangles->size(); 
 
@@ -22,11 +34,23 @@ BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode)
 	// Shared vector to avoid reallocations
 	rightBoxes.resize(tris_sz);
 
-	BuildNode root(0, (U32)tris_sz - 1, -1);
-	m_build_nodes.push_back(root);
-	nodes++;
-    
-	build(0, 0, 0.0f, 1.0f); // root, depth 0
+	if (m_mode == SplitMode::BinnedSAH)
+	{
+		buildBinned(m_build_nodes, 0, (U32)tris_sz - 1, -1, 0, metrics);
+		nodes = (U32)m_build_nodes.size();
+	}
+	else if (m_mode == SplitMode::PresortedSAH)
+	{
+		buildPresorted();
+	}
+	else
+	{
+		BuildNode root(0, (U32)tris_sz - 1, -1);
+		m_build_nodes.push_back(root);
+		nodes++;
+
+		build(0, 0, 0.0f, 1.0f); // root, depth 0
+	}
 	printf("\rBVH builder: progress 100%%\n");
 	assert(m_build_nodes[0].rightChild != -1);
 	assert(metrics.depth <= MaxDepth);
@@ -40,18 +64,16 @@ BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode)
 
 	std::cout
 		<< "======================" << std::endl
-		<< ((m_mode == SplitMode::SAH) ? "SAH" : (m_mode == SplitMode::ObjectMedian)
-            ? "Object Median" : (m_mode == SplitMode::SpatialMedian) ? "Spatial Median" : "Unknown") << std::endl
+		<< splitModeName(m_mode) << std::endl
 		<< "Splits: " << metrics.splits << " (" << int(metrics.bad_splits / float(metrics.splits) * 100.0f) << "% bad)" << std::endl
 		<< "Depth: " << metrics.depth << std::endl
 		<< "Leaves: " << metrics.splits + 1 << std::endl
 		<< "======================" << std::endl;
 }
 
-BVH::BVH(std::vector<RTTriangle>* tris, const std::string filename)
+BVH::BVH(std::vector<RTTriangle>* tris)
 {
     m_triangles = tris;
-    importFrom(filename);
 }
 
 AABB_t BVH::getSceneBounds(void) const
@@ -62,6 +84,399 @@ AABB_t BVH::getSceneBounds(void) const
     return m_nodes[0].box;
 }
 
+template <U32 W>
+U32 BVH::collapse(std::vector<WideNode<W>> &out) const
+{
+	if (m_nodes.size() == 0)
+		throw std::runtime_error("Cannot collapse uninitialized BVH");
+
+	out.clear();
+	out.reserve(m_nodes.size() / (W - 1) + 1);
+	out.emplace_back();
+	const U32 height = collapseNode(out, 0, 0);
+
+	U32 used = 0;
+	for (const WideNode<W> &n : out)
+		used += (U32)std::count_if(n.child, n.child + W, [](S32 c) { return c != -1; });
+
+	std::cout << "BVH" << W << ": " << out.size() << " nodes (" << m_nodes.size() << " binary), "
+		<< int(100.0f * used / (out.size() * W)) << "% slots used, height " << height << std::endl;
+
+	// Popping a node at depth d leaves at most d * (W - 1) entries, then pushes up to W
+	return height * (W - 1) + 1;
+}
+
+// Pull up grandchildren until all W slots are filled, largest inner child first.
+// Returns the height of the wide subtree.
+template <U32 W>
+U32 BVH::collapseNode(std::vector<WideNode<W>> &out, U32 binaryIdx, U32 wideIdx) const
+{
+	U32 slots[W];
+	U32 count = 0;
+
+	const Node &n = m_nodes[binaryIdx];
+	if (n.nPrims > 0)
+	{
+		slots[count++] = binaryIdx; // leaf root
+	}
+	else
+	{
+		slots[count++] = n.leftChild;
+		slots[count++] = n.rightChild;
+	}
+
+	while (count < W)
+	{
+		S32 largest = -1;
+		F32 largestArea = -1.0f;
+		for (U32 i = 0; i < count; i++)
+		{
+			const Node &c = m_nodes[slots[i]];
+			if (c.nPrims == 0 && c.box.area() > largestArea)
+			{
+				largest = (S32)i;
+				largestArea = c.box.area();
+			}
+		}
+		if (largest == -1)
+			break;
+
+		const U32 expanded = slots[largest];
+		slots[largest] = m_nodes[expanded].leftChild;
+		slots[count++] = m_nodes[expanded].rightChild;
+	}
+
+	// Siblings are allocated contiguously before descending
+	U32 wideChildren[W];
+	for (U32 i = 0; i < W; i++)
+	{
+		WideNode<W> &wn = out[wideIdx];
+		if (i >= count)
+		{
+			wn.bminx[i] = wn.bminy[i] = wn.bminz[i] = 0.0f;
+			wn.bmaxx[i] = wn.bmaxy[i] = wn.bmaxz[i] = 0.0f;
+			wn.child[i] = -1;
+			wn.nPrims[i] = 0;
+			continue;
+		}
+
+		const Node &c = m_nodes[slots[i]];
+		wn.bminx[i] = c.box.min.x;
+		wn.bminy[i] = c.box.min.y;
+		wn.bminz[i] = c.box.min.z;
+		wn.bmaxx[i] = c.box.max.x;
+		wn.bmaxy[i] = c.box.max.y;
+		wn.bmaxz[i] = c.box.max.z;
+		wn.nPrims[i] = c.nPrims;
+		if (c.nPrims > 0)
+		{
+			wn.child[i] = (S32)c.iStart;
+		}
+		else
+		{
+			wideChildren[i] = (U32)out.size();
+			wn.child[i] = (S32)wideChildren[i];
+			out.emplace_back(); // invalidates wn
+		}
+	}
+
+	U32 height = 0;
+	for (U32 i = 0; i < count; i++)
+	{
+		if (m_nodes[slots[i]].nPrims == 0)
+			height = std::max(height, collapseNode(out, slots[i], wideChildren[i]) + 1);
+	}
+	return height;
+}
+
+template U32 BVH::collapse<4>(std::vector<WideNode<4>> &out) const;
+template U32 BVH::collapse<8>(std::vector<WideNode<8>> &out) const;
+
+// Decoding must match intersectAABBQuantized: origin + q * 2^e in float
+template <typename Q>
+static bool quantizeAxis(F32 origin, S32 e, F32 cmin, F32 cmax, Q &qlo, Q &qhi)
+{
+	const F32 maxQ = (F32)std::numeric_limits<Q>::max();
+	const F32 scale = std::ldexp(1.0f, e);
+
+	F32 lo = std::min(std::max(std::floor((cmin - origin) / scale), 0.0f), maxQ);
+	F32 hi = std::min(std::max(std::ceil((cmax - origin) / scale), 0.0f), maxQ);
+
+	// Round outwards until decoded box is conservative
+	while (lo > 0.0f && origin + lo * scale > cmin) lo -= 1.0f;
+	while (hi < maxQ && origin + hi * scale < cmax) hi += 1.0f;
+
+	qlo = (Q)lo;
+	qhi = (Q)hi;
+	return origin + lo * scale <= cmin && origin + hi * scale >= cmax;
+}
+
+template <typename Q>
+void BVH::quantize(std::vector<QuantizedNode<Q>> &out) const
+{
+	const F32 maxQ = (F32)std::numeric_limits<Q>::max();
+	out.resize(m_nodes.size());
+
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		const Node &n = m_nodes[i];
+		QuantizedNode<Q> &q = out[i];
+		q.nPrims = n.nPrims;
+		q.iStart = n.iStart; // same bits as rightChild
+
+		if (n.nPrims > 0)
+		{
+			std::fill(q.origin, q.origin + 3, 0.0f);
+			std::fill(q.exponent, q.exponent + 3, (cl_char)0);
+			std::fill(q.childMin, q.childMin + 6, (Q)0);
+			std::fill(q.childMax, q.childMax + 6, (Q)0);
+			continue;
+		}
+
+		const AABB_t *children[2] = { &m_nodes[n.leftChild].box, &m_nodes[n.rightChild].box };
+		AABB_t frame = *children[0];
+		frame.expand(*children[1]);
+
+		for (U32 a = 0; a < 3; a++)
+		{
+			// Smallest grid that spans the frame, normal floats only
+			int e;
+			std::frexp((frame.max[a] - frame.min[a]) / maxQ, &e);
+			e = std::min(std::max(e, -126), 127);
+
+			q.origin[a] = frame.min[a];
+			bool fits = false;
+			while (true)
+			{
+				fits = true;
+				for (U32 c = 0; c < 2; c++)
+					fits &= quantizeAxis(q.origin[a], e, children[c]->min[a], children[c]->max[a], q.childMin[c * 3 + a], q.childMax[c * 3 + a]);
+				if (fits || e >= 127) break;
+				e++;
+			}
+			q.exponent[a] = (cl_char)e;
+
+			// Coarsest grid still too small, children get the full parent range
+			if (!fits)
+			{
+				const F32 top = q.origin[a] + maxQ * std::ldexp(1.0f, e);
+				for (U32 c = 0; c < 2; c++)
+				{
+					q.childMin[c * 3 + a] = (Q)0;
+					q.childMax[c * 3 + a] = (Q)maxQ;
+					assert(q.origin[a] <= children[c]->min[a] && top >= children[c]->max[a]);
+				}
+			}
+		}
+	}
+}
+
+template void BVH::quantize<U8>(std::vector<QuantizedNode<U8>> &out) const;
+template void BVH::quantize<cl_ushort>(std::vector<QuantizedNode<cl_ushort>> &out) const;
+
+void BVH::reorderNodes(NodeLayout layout)
+{
+	if (layout == NodeLayout::DepthFirst || m_nodes.size() < 3)
+		return;
+
+	// Old node indices in new order, parents always precede children
+	std::vector<U32> order;
+	order.reserve(m_nodes.size());
+	if (layout == NodeLayout::VanEmdeBoas)
+	{
+		// Subtree height in levels, children are stored after their parent
+		std::vector<U32> heights(m_nodes.size(), 1);
+		for (size_t i = m_nodes.size(); i-- > 0;)
+		{
+			const Node &n = m_nodes[i];
+			if (n.nPrims == 0)
+				heights[i] = 1 + std::max(heights[n.leftChild], heights[n.rightChild]);
+		}
+		vebOrder(0, heights[0], order);
+	}
+	else
+	{
+		clusteredOrder(order);
+	}
+
+	std::vector<U32> newIndex(m_nodes.size());
+	for (U32 i = 0; i < order.size(); i++)
+		newIndex[order[i]] = i;
+
+	std::vector<Node> out(m_nodes.size());
+	for (U32 i = 0; i < order.size(); i++)
+	{
+		Node n = m_nodes[order[i]];
+		n.parent = (n.parent == -1) ? -1 : (S32)newIndex[n.parent];
+		if (n.nPrims == 0)
+		{
+			n.leftChild = newIndex[n.leftChild];
+			n.rightChild = newIndex[n.rightChild];
+		}
+		out[i] = n;
+	}
+	m_nodes.swap(out);
+
+	std::cout << "Node layout: " << ((layout == NodeLayout::VanEmdeBoas) ? "van Emde Boas" : "clustered") << std::endl;
+}
+
+F32 BVH::sahCost() const
+{
+	F32 cost = 0.0f;
+	for (const Node &n : m_nodes)
+		cost += (n.nPrims > 0 ? sahParams.costTri * n.nPrims : sahParams.costBox) * n.box.area();
+	return cost / m_nodes[0].box.area();
+}
+
+AABB_t BVH::leafBounds(const Node &n) const
+{
+	AABB_t box;
+	for (U32 i = n.iStart; i < n.iStart + n.nPrims; i++)
+	{
+		const RTTriangle &t = (*m_triangles)[m_indices[i]];
+		box.expand(AABB_t(t.min(), t.max()));
+	}
+	return box;
+}
+
+// Children are stored after their parent in every layout => reverse sweep is bottom-up
+F32 BVH::refit()
+{
+	if (m_refitBaseCost == 0.0f)
+		m_refitBaseCost = sahCost();
+
+	for (size_t i = m_nodes.size(); i-- > 0;)
+	{
+		Node &n = m_nodes[i];
+		if (n.nPrims > 0)
+		{
+			n.box = leafBounds(n);
+		}
+		else
+		{
+			n.box = m_nodes[n.leftChild].box;
+			n.box.expand(m_nodes[n.rightChild].box);
+		}
+	}
+
+	return refitDegradation();
+}
+
+// Dirty leaves first, then walk up the parent links until a box stops changing
+F32 BVH::refit(const std::vector<U32> &changedTris)
+{
+	if (m_refitBaseCost == 0.0f)
+		m_refitBaseCost = sahCost();
+
+	std::vector<U8> changed(m_triangles->size(), 0);
+	for (U32 t : changedTris)
+		changed[t] = 1;
+
+	std::vector<U32> dirtyLeaves;
+	for (U32 i = 0; i < m_nodes.size(); i++)
+	{
+		Node &n = m_nodes[i];
+		for (U32 k = n.iStart; n.nPrims > 0 && k < n.iStart + n.nPrims; k++)
+		{
+			if (changed[m_indices[k]])
+			{
+				n.box = leafBounds(n);
+				dirtyLeaves.push_back(i);
+				break;
+			}
+		}
+	}
+
+	for (U32 leaf : dirtyLeaves)
+	{
+		for (S32 p = m_nodes[leaf].parent; p != -1; p = m_nodes[p].parent)
+		{
+			Node &n = m_nodes[p];
+			AABB_t box = m_nodes[n.leftChild].box;
+			box.expand(m_nodes[n.rightChild].box);
+			const bool same = box.min.x == n.box.min.x && box.min.y == n.box.min.y && box.min.z == n.box.min.z &&
+				box.max.x == n.box.max.x && box.max.y == n.box.max.y && box.max.z == n.box.max.z;
+			if (same)
+				break;
+			n.box = box;
+		}
+	}
+
+	return refitDegradation();
+}
+
+F32 BVH::refitDegradation()
+{
+	const F32 degradation = sahCost() / m_refitBaseCost;
+	if (degradation * 100.0f > RefitWarnPercent)
+		std::cout << "Refitted BVH SAH cost +" << (degradation - 1.0f) * 100.0f << "%, consider a rebuild" << std::endl;
+	return degradation;
+}
+
+// Top half of the subtree first, then every bottom subtree, both recursively
+void BVH::vebOrder(U32 root, U32 levels, std::vector<U32> &order) const
+{
+	if (levels == 1 || m_nodes[root].nPrims > 0)
+	{
+		order.push_back(root);
+		return;
+	}
+
+	const U32 topLevels = levels / 2;
+	vebOrder(root, topLevels, order);
+
+	// Roots of bottom subtrees, left to right
+	std::vector<std::pair<U32, U32>> stack = { { root, 0 } };
+	while (!stack.empty())
+	{
+		const std::pair<U32, U32> e = stack.back();
+		stack.pop_back();
+		const Node &n = m_nodes[e.first];
+		if (e.second == topLevels)
+			vebOrder(e.first, levels - topLevels, order);
+		else if (n.nPrims == 0)
+		{
+			stack.push_back({ n.rightChild, e.second + 1 });
+			stack.push_back({ n.leftChild, e.second + 1 });
+		}
+	}
+}
+
+// Treelets of one page each, grown towards the largest (most likely traversed) boxes.
+// Nodes left on the frontier become roots of the following treelets.
+void BVH::clusteredOrder(std::vector<U32> &order) const
+{
+	const U32 clusterSize = std::max(1U, (U32)(LayoutClusterBytes / sizeof(Node)));
+	std::deque<U32> roots = { 0 };
+
+	while (!roots.empty())
+	{
+		std::priority_queue<std::pair<F32, U32>> frontier;
+		frontier.push({ m_nodes[roots.front()].box.area(), roots.front() });
+		roots.pop_front();
+
+		for (U32 count = 0; count < clusterSize && !frontier.empty(); count++)
+		{
+			const U32 i = frontier.top().second;
+			frontier.pop();
+			order.push_back(i);
+
+			const Node &n = m_nodes[i];
+			if (n.nPrims == 0)
+			{
+				frontier.push({ m_nodes[n.leftChild].box.area(), n.leftChild });
+				frontier.push({ m_nodes[n.rightChild].box.area(), n.rightChild });
+			}
+		}
+
+		while (!frontier.empty())
+		{
+			roots.push_back(frontier.top().second);
+			frontier.pop();
+		}
+	}
+}
+
 void BVH::createSmallNodes()
 {
 	m_nodes.clear();
@@ -69,6 +484,7 @@ void BVH::createSmallNodes()
 	for (BuildNode bn : m_build_nodes)
 	{
 		Node n;
+		n.leftChild = (U32)m_nodes.size() + 1;
 		n.box = bn.box;
         n.parent = bn.parent;
 		if (bn.rightChild == -1) { // leaf node
@@ -103,124 +519,97 @@ void BVH::createIndexList() {
 	m_refs.shrink_to_fit();
 }
 
-std::vector<U32> importIndices(std::ifstream &in)
-{
-    U32 size;
-    read(in, size);
-    std::vector<U32> vec(size);
-    
-    for (U32 i = 0; i < size; i++)
-	{
-        U32 ind;
-        read(in, ind);
-        vec[i] = ind;
-    }
+static const char HierarchyMagic[8] = { 'F', 'L', 'U', 'C', 'T', 'B', 'V', 'H' };
 
-    // Return value optimization!
-    return vec;
+static inline U64 alignFileOffset(U64 offset)
+{
+	return (offset + HierarchyAlignment - 1) / HierarchyAlignment * HierarchyAlignment;
 }
 
-std::vector<Node> importNodes(std::ifstream &in)
+// Header and raw arrays are validated, then copied in bulk from the mapping
+bool BVH::importFrom(const std::string filename, U64 sourceHash, U32 builderMode)
 {
-	U32 size;
-	read(in, size);
-	std::vector<Node> vec(size);
+	auto t0 = std::chrono::high_resolution_clock::now();
 
-	for (U32 i = 0; i < size; i++)
+	MappedFile file(filename);
+	if (!file.isOpen() || file.size() < sizeof(HierarchyHeader))
 	{
-		Node n;
-		fr::float3 bmin, bmax;
-		read(in, bmin.x);
-		read(in, bmin.y);
-		read(in, bmin.z);
-		read(in, bmax.x);
-		read(in, bmax.y);
-		read(in, bmax.z);
-		n.box = AABB_t(bmin, bmax);
-		read(in, n.iStart);
-        read(in, n.parent);
-		read(in, n.nPrims);
-		vec[i] = n;
+		std::cout << "Could not map hierarchy file " << filename << std::endl;
+		return false;
 	}
 
-	// Return value optimization!
-	return vec;
-}
-
-
-void BVH::importFrom(const std::string filename)
-{
-	char buffer [128*1024];
-	
-	clock_t time1, time2;
-	
-	time1 = clock();
-	
-    std::ifstream infile;
-    infile.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
- 
-    infile.open(filename, std::ios::binary);
-    infile.rdbuf()->pubsetbuf(buffer, sizeof(buffer)); //for Visual Studio
-	
-    m_indices = importIndices(infile);
-    m_nodes = importNodes(infile);
-	
-	time2 = clock();
-	printf("%s\n%.2f s\n", filename.c_str(), (float)(time2-time1)/(float)CLOCKS_PER_SEC);
-}
+	HierarchyHeader h;
+	std::memcpy(&h, file.data(), sizeof(HierarchyHeader));
+
+	std::string error;
+	if (std::memcmp(h.magic, HierarchyMagic, sizeof(HierarchyMagic)) != 0)
+		error = "unknown format";
+	else if (h.version != HierarchyVersion)
+		error = "version " + std::to_string(h.version) + ", expected " + std::to_string(HierarchyVersion);
+	else if (h.nodeSize != sizeof(Node))
+		error = "node size " + std::to_string(h.nodeSize) + ", expected " + std::to_string(sizeof(Node));
+	else if (h.sourceHash != sourceHash || h.builderMode != builderMode)
+		error = "built from different scene or builder";
+	else if (h.nodeOffset % HierarchyAlignment != 0 || h.indexOffset % HierarchyAlignment != 0 ||
+		h.nodeOffset + (U64)h.numNodes * sizeof(Node) > file.size() ||
+		h.indexOffset + (U64)h.numIndices * sizeof(U32) > file.size())
+		error = "truncated";
+
+	if (!error.empty())
+	{
+		std::cout << "Ignoring hierarchy file " << filename << ": " << error << std::endl;
+		return false;
+	}
 
+	const Node *nodes = reinterpret_cast<const Node*>(file.data() + h.nodeOffset);
+	const U32 *indices = reinterpret_cast<const U32*>(file.data() + h.indexOffset);
+	m_nodes.assign(nodes, nodes + h.numNodes);
+	m_indices.assign(indices, indices + h.numIndices);
 
-void exportNode(std::ofstream &out, const Node &n)
-{
-	// AABB
-    fr::float3 bmin = n.box.min;
-    fr::float3 bmax = n.box.max;
-	write(out, bmin.x);
-	write(out, bmin.y);
-	write(out, bmin.z);
-	write(out, bmax.x);
-	write(out, bmax.y);
-	write(out, bmax.z);
+	auto t1 = std::chrono::high_resolution_clock::now();
+	printf("%s\n%.2f ms\n", filename.c_str(), std::chrono::duration<double, std::milli>(t1 - t0).count());
 
-	// Parameters
-	write(out, n.iStart);
-    write(out, n.parent);
-	write(out, n.nPrims);
+	return true;
 }
 
 /** Write BVH to file for later importing **/
-void BVH::exportTo(const std::string filename) const
+void BVH::exportTo(const std::string filename, U64 sourceHash, U32 builderMode) const
 {
-	char buffer [128*1024];
-	
-	clock_t time1, time2;
-	
-	time1 = clock();
-	
-    std::ofstream out;
-	
-    out.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
- 
-    out.open(filename, std::ios::binary);
-    out.rdbuf()->pubsetbuf(buffer, sizeof(buffer)); //for Visual Studio
-
-    if (out.good())
-    {
-		// Index list
-		write(out, (U32)m_indices.size());
-		for_each(m_indices.begin(), m_indices.end(), [&out](U32 index) { write(out, index); });
-
-		// Node list
-		write(out, (U32)m_indices.size());
-		for_each(m_nodes.begin(), m_nodes.end(), [&out](const Node &n) { exportNode(out, n); });
-    }
-    else
-    {
-        std::cout << "Could not create create file for BVH export!" << std::endl;
-    }
-	
-	time2 = clock();
-	printf("%s\n%.2f s\n", filename.c_str(), (float)(time2-time1)/(float)CLOCKS_PER_SEC);
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	HierarchyHeader h;
+	std::memset(&h, 0, sizeof(HierarchyHeader));
+	std::memcpy(h.magic, HierarchyMagic, sizeof(HierarchyMagic));
+	h.version = HierarchyVersion;
+	h.builderMode = builderMode;
+	h.numNodes = (U32)m_nodes.size();
+	h.numIndices = (U32)m_indices.size();
+	h.nodeSize = sizeof(Node);
+	h.sourceHash = sourceHash;
+	h.nodeOffset = alignFileOffset(sizeof(HierarchyHeader));
+	h.indexOffset = alignFileOffset(h.nodeOffset + (U64)m_nodes.size() * sizeof(Node));
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.good())
+	{
+		std::cout << "Could not create create file for BVH export!" << std::endl;
+		return;
+	}
+
+	const char zeros[HierarchyAlignment] = {};
+	auto padTo = [&](U64 offset) { out.write(zeros, (std::streamsize)(offset - (U64)out.tellp())); };
+
+	out.write(reinterpret_cast<const char*>(&h), sizeof(HierarchyHeader));
+	padTo(h.nodeOffset);
+	out.write(reinterpret_cast<const char*>(m_nodes.data()), (std::streamsize)(m_nodes.size() * sizeof(Node)));
+	padTo(h.indexOffset);
+	out.write(reinterpret_cast<const char*>(m_indices.data()), (std::streamsize)(m_indices.size() * sizeof(U32)));
+
+	if (!out.good())
+		std::cout << "Writing hierarchy file " << filename << " failed!" << std::endl;
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	printf("%s\n%.2f ms\n", filename.c_str(), std::chrono::duration<double, std::milli>(t1 - t0).count());
 }
 
 // Too frequent printing is actually a bottleneck!
@@ -280,6 +669,10 @@ bool BVH::partition(BuildNode &n, SplitInfo &split)
 	case SplitMode::ObjectMedian:
 		return objectMedianSplit(n, split);
 		break;
+	case SplitMode::BinnedSAH:
+		binnedSahSplit(n, split, metrics);
+		return true;
+		break;
 	default:
 		std::cout << "Selected split mode not implemented!" << std::endl;
 		throw std::runtime_error("Selected split mode not implemented!");
@@ -289,8 +682,13 @@ bool BVH::partition(BuildNode &n, SplitInfo &split)
 
 void BVH::sortReferences(U32 s, U32 e, U32 dim)
 {
-	auto start = m_refs.begin() + s;
-	auto end = m_refs.begin() + e + 1;
+	sortReferences(m_refs, s, e, dim);
+}
+
+void BVH::sortReferences(std::vector<TriRef> &refs, U32 s, U32 e, U32 dim)
+{
+	auto start = refs.begin() + s;
+	auto end = refs.begin() + e + 1;
 
 	// Sort the range [s, e[ by triangle centroid
 
@@ -319,10 +717,8 @@ bool BVH::objectMedianSplit(BuildNode &n, U32 dim, SplitInfo &split)
 AABB_t BVH::centroudBounds(std::vector<TriRef>::const_iterator begin, std::vector<TriRef>::const_iterator end) const
 {
 	AABB_t bounds;
-	for (auto i = begin; i != end; i++) {
-		bounds.min = vmin(bounds.min, i->pos);
-		bounds.max = vmax(bounds.max, i->pos);
-	}
+	for (auto i = begin; i != end; i++)
+		bounds.expand(i->pos);
 
 	return bounds;
 }
@@ -438,3 +834,356 @@ bool BVH::sahSplit(BuildNode &n, SplitInfo &info)
 
 	return true;
 }
+
+
+// Sorting once per axis replaces the per-node sorts of sahSplit: O(n log n) instead of O(n log^2 n).
+// Comparisons match sortReferences, so splits and leaf contents equal the SAH mode.
+void BVH::buildPresorted()
+{
+	const U32 n = (U32)m_refs.size();
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		std::vector<U32> &order = m_sorted[dim];
+		order.resize(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](U32 a, U32 b)
+		{
+			const TriRef &r1 = m_refs[a], &r2 = m_refs[b];
+			F32 ca = r1.box.min[dim] + r1.box.max[dim];
+			F32 cb = r2.box.min[dim] + r2.box.max[dim];
+			return (ca < cb || (ca == cb && r1.ind < r2.ind));
+		});
+	}
+
+	BuildNode root(0, n - 1, -1);
+	for (const TriRef &r : m_refs)
+		root.box.expand(r.box);
+	m_build_nodes.push_back(root);
+	nodes++;
+
+	m_presortSide.resize(n);
+	m_presortTmp.resize(n);
+
+	// Leaves copy their references in the order the SAH mode would leave them
+	m_sortedRefs = m_refs;
+	buildPresorted(0, 0, -1, 0.0f, 1.0f);
+	m_refs.swap(m_sortedRefs);
+
+	for (U32 dim = 0; dim < 3; dim++)
+		std::vector<U32>().swap(m_sorted[dim]);
+	std::vector<TriRef>().swap(m_sortedRefs);
+	std::vector<U8>().swap(m_presortSide);
+	std::vector<U32>().swap(m_presortTmp);
+}
+
+// orderDim: axis the SAH mode would have sorted this range by last, -1 = unsorted
+void BVH::buildPresorted(U32 nInd, U32 depth, S32 orderDim, F32 progressStart, F32 progressEnd)
+{
+	lazyPrintBuildStatus(progressStart);
+
+	metrics.depth = std::max(metrics.depth, depth);
+	const U32 iStart = m_build_nodes[nInd].iStart;
+	const U32 iEnd = m_build_nodes[nInd].iEnd;
+	const U32 elems = m_build_nodes[nInd].spannedTris();
+
+	// presortedSahSplit only declines ranges below MaxLeafElems => always a leaf
+	SplitInfo info;
+	if (elems <= MaxLeafElems || !presortedSahSplit(m_build_nodes[nInd], info))
+	{
+		if (orderDim != -1)
+		{
+			for (U32 i = iStart; i <= iEnd; i++)
+				m_sortedRefs[i] = m_refs[m_sorted[orderDim][i]];
+		}
+		return;
+	}
+
+	metrics.splits++;
+
+	F32 progressMid = lerp(progressStart, progressEnd, (F32)(info.i - iStart) / (F32)(elems));
+
+	// Left child
+	BuildNode left(iStart, info.i, nInd);
+	left.box = info.leftBounds;
+	m_build_nodes.push_back(left);
+	nodes++;
+	buildPresorted(nodes - 1, depth + 1, info.dim, progressStart, progressMid);
+
+	// Right child
+	BuildNode right(info.i + 1, iEnd, nInd);
+	right.box = info.rightBounds;
+	m_build_nodes.push_back(right);
+	m_build_nodes[nInd].rightChild = nodes++;
+	buildPresorted(nodes - 1, depth + 1, info.dim, progressMid, progressEnd);
+}
+
+// Same sweep as sahSplit, followed by a stable partition of the other two axes
+bool BVH::presortedSahSplit(BuildNode &n, SplitInfo &info)
+{
+	F32 parentArea = n.box.area();
+	F32 parentArea1 = 1.0f / parentArea;
+	assert(parentArea > 0.0f);
+
+	F32 parentCost = sahParams.costBox + n.spannedTris() * sahParams.costTri;
+	const U32 spanSize = n.spannedTris();
+
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		const U32 *order = m_sorted[dim].data();
+
+		// rightBoxes[i] = box of last i + 1 references
+		AABB_t box;
+		for (U32 i = 0; i < spanSize; i++)
+		{
+			box.expand(m_refs[order[n.iEnd - i]].box);
+			rightBoxes[i] = box;
+		}
+
+		AABB_t leftBox;
+		U32 leftCount = 0;
+		for (U32 s = n.iStart; s < n.iEnd; s++)
+		{
+			leftBox.expand(m_refs[order[s]].box);
+			leftCount++;
+
+			AABB_t &rightBox = rightBoxes[n.iEnd - s - 1];
+			F32 cost = sahCost(leftCount, leftBox.area(), spanSize - leftCount, rightBox.area(), parentArea1);
+
+			if (cost < info.cost)
+			{
+				info.cost = cost;
+				info.i = s;
+				info.leftBounds = leftBox;
+				info.rightBounds = rightBox;
+				info.dim = dim;
+			}
+		}
+	}
+
+	assert(info.cost != FLT_MAX);
+	assert(info.i > -1);
+
+	if (info.cost > parentCost && n.spannedTris() < MaxLeafElems)
+		return false;
+
+	// Fix indexing if only one triangle on either side
+	if (info.i == n.iStart)
+	{
+		info.i++;
+		metrics.bad_splits++;
+	}
+	else if (info.i == n.iEnd)
+	{
+		info.i--;
+		metrics.bad_splits++;
+	}
+
+	// Bounds of the sides actually used
+	const U32 *best = m_sorted[info.dim].data();
+	info.leftBounds = AABB_t();
+	info.rightBounds = AABB_t();
+	for (U32 i = n.iStart; i <= n.iEnd; i++)
+		(i <= (U32)info.i ? info.leftBounds : info.rightBounds).expand(m_refs[best[i]].box);
+
+	// Partition the other axes stably, keeping them sorted
+	std::vector<U8> &side = m_presortSide;
+	for (U32 i = n.iStart; i <= n.iEnd; i++)
+		side[best[i]] = (i > (U32)info.i);
+
+	std::vector<U32> &tmp = m_presortTmp;
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		if (dim == (U32)info.dim)
+			continue;
+
+		U32 *order = m_sorted[dim].data();
+		U32 l = n.iStart, r = 0;
+		for (U32 i = n.iStart; i <= n.iEnd; i++)
+		{
+			if (side[order[i]]) tmp[r++] = order[i];
+			else order[l++] = order[i];
+		}
+		std::copy(tmp.begin(), tmp.begin() + r, order + l);
+	}
+
+	return true;
+}
+
+void BVH::setBuildThreads(U32 numThreads)
+{
+	maxTasks = (numThreads > 0) ? numThreads : std::max(1U, std::thread::hardware_concurrency());
+}
+
+// Calling thread counts as one task
+bool BVH::tryAcquireTask()
+{
+	U32 active = activeTasks.load();
+	while (active + 1 < maxTasks)
+	{
+		if (activeTasks.compare_exchange_weak(active, active + 1))
+			return true;
+	}
+	return false;
+}
+
+void BVH::releaseTask()
+{
+	activeTasks--;
+}
+
+// Thread-safe variant of lazyPrintBuildStatus for the binned builder
+void BVH::reportBinnedProgress(U32 refs)
+{
+	U32 done = finishedRefs += refs;
+	if (printMutex.try_lock())
+	{
+		lazyPrintBuildStatus(done / (F32)m_refs.size());
+		printMutex.unlock();
+	}
+}
+
+// Build subtree spanning [iStart, iEnd] into 'out' in depth-first order.
+// Large right subtrees are built as separate tasks into their own vectors
+// and spliced in afterwards, so the resulting layout is identical to a
+// serial build regardless of the number of threads.
+void BVH::buildBinned(std::vector<BuildNode> &out, U32 iStart, U32 iEnd, S32 parent, U32 depth, BuildMetrics &m)
+{
+	const U32 nInd = (U32)out.size();
+	out.push_back(BuildNode(iStart, iEnd, parent));
+	out[nInd].computeBB(m_refs);
+	m.depth = std::max(m.depth, depth);
+
+	const U32 elems = out[nInd].spannedTris();
+	if (elems <= MaxLeafElems)
+	{
+		reportBinnedProgress(elems);
+		return;
+	}
+
+	SplitInfo info;
+	binnedSahSplit(out[nInd], info, m);
+	m.splits++;
+
+	// Subtree ranges are disjoint => tasks can partition m_refs concurrently
+	const bool spawn = (elems >= ParallelMinElems) && tryAcquireTask();
+
+	std::vector<BuildNode> rightNodes;
+	BuildMetrics rightMetrics;
+	std::future<void> rightTask;
+	if (spawn)
+	{
+		rightTask = std::async(std::launch::async, [&]()
+		{
+			buildBinned(rightNodes, info.i + 1, iEnd, -1, depth + 1, rightMetrics);
+			releaseTask();
+		});
+	}
+
+	// Left child
+	buildBinned(out, iStart, info.i, nInd, depth + 1, m);
+
+	// Right child
+	if (!spawn)
+	{
+		out[nInd].rightChild = (S32)out.size();
+		buildBinned(out, info.i + 1, iEnd, nInd, depth + 1, m);
+		return;
+	}
+
+	rightTask.get();
+
+	// Splice task-local subtree, rebase its indices
+	const S32 offset = (S32)out.size();
+	out[nInd].rightChild = offset;
+	for (BuildNode &c : rightNodes)
+	{
+		if (c.rightChild != -1)
+			c.rightChild += offset;
+		c.parent = (c.parent == -1) ? (S32)nInd : c.parent + offset;
+		out.push_back(c);
+	}
+
+	m.merge(rightMetrics);
+}
+
+// Binned SAH (Wald 07): centroids are binned along each axis, split candidates
+// are evaluated at bin boundaries. Writes index of last element of first group into split.
+void BVH::binnedSahSplit(BuildNode &n, SplitInfo &info, BuildMetrics &m)
+{
+	auto s = m_refs.begin() + n.iStart;
+	auto e = m_refs.begin() + n.iEnd + 1;
+
+	AABB_t centroidBox = centroudBounds(s, e);
+	F32 parentArea1 = 1.0f / n.box.area();
+	U32 binSplit = 0;
+
+	auto binIndex = [&centroidBox](const TriRef &r, U32 dim, F32 scale)
+	{
+		S32 b = (S32)((r.pos[dim] - centroidBox.min[dim]) * scale);
+		return (U32)std::max(0, std::min((S32)NumBins - 1, b));
+	};
+
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		F32 extent = centroidBox.max[dim] - centroidBox.min[dim];
+		if (extent <= 0.0f)
+			continue;
+
+		F32 scale = NumBins / extent;
+		SAHBin bins[NumBins];
+		for (auto it = s; it != e; it++)
+		{
+			SAHBin &bin = bins[binIndex(*it, dim, scale)];
+			bin.bounds.expand(it->box);
+			bin.count++;
+		}
+
+		// rightBins[i] = bins [i + 1, NumBins[
+		SAHBin rightBins[NumBins - 1];
+		SAHBin acc;
+		for (U32 i = NumBins - 1; i > 0; i--)
+		{
+			acc.bounds.expand(bins[i].bounds);
+			acc.count += bins[i].count;
+			rightBins[i - 1] = acc;
+		}
+
+		// Sweep bin boundaries left to right
+		SAHBin left;
+		for (U32 i = 0; i < NumBins - 1; i++)
+		{
+			left.bounds.expand(bins[i].bounds);
+			left.count += bins[i].count;
+			const SAHBin &right = rightBins[i];
+
+			if (left.count == 0 || right.count == 0)
+				continue;
+
+			F32 cost = sahCost(left.count, left.bounds.area(), right.count, right.bounds.area(), parentArea1);
+			if (cost < info.cost)
+			{
+				info.cost = cost;
+				info.dim = dim;
+				info.pos = centroidBox.min[dim] + (i + 1) / scale;
+				info.leftBounds = left.bounds;
+				info.rightBounds = right.bounds;
+				binSplit = i + 1;
+			}
+		}
+	}
+
+	// All centroids coincide => split in the middle
+	if (info.dim == -1)
+	{
+		m.bad_splits++;
+		objectMedianSplit(n, info);
+		return;
+	}
+
+	// Partition using the same bin mapping as above
+	const U32 dim = info.dim;
+	const F32 scale = NumBins / (centroidBox.max[dim] - centroidBox.min[dim]);
+	auto it = std::partition(s, e, [&](const TriRef &r) { return binIndex(r, dim, scale) < binSplit; });
+	info.i = (S32)(it - m_refs.begin()) - 1;
+	assert(info.i >= (S32)n.iStart && info.i < (S32)n.iEnd);
+}
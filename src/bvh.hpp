@@ -3,35 +3,88 @@
 #include <vector>
 #include <numeric>
 #include <fstream>
+#include <atomic>
+#include <mutex>
 #include "triangle.hpp"
 #include "bvhnode.hpp"
 #include "rtutil.hpp"
 
 template <class A, class B> A lerp(const A& a, const A& b, const B& t) { return (A)(a * ((B)1 - t) + b * t); }
 
+// On-disk hierarchy cache: header followed by raw node and index arrays.
+// Arrays start at HierarchyAlignment-byte offsets, the file can be used through mmap as is.
+enum
+{
+	HierarchyVersion = 2,
+	HierarchyAlignment = 64
+};
+
+struct HierarchyHeader
+{
+	char magic[8];
+	U32 version;
+	U32 builderMode;	// builder configuration tag chosen by the caller
+	U32 numNodes;
+	U32 numIndices;
+	U32 nodeSize;		// sizeof(Node), guards against layout changes
+	U32 reserved;
+	U64 sourceHash;		// hash of the source geometry
+	U64 nodeOffset;
+	U64 indexOffset;
+	U8 padding[8];
+};
+static_assert(sizeof(HierarchyHeader) == HierarchyAlignment, "Hierarchy header must fill one aligned block");
+
 class BVH
 {
 
 friend class CLContext;
+friend class TreeletOptimizer;
+friend class TwoLevelBVH;
+friend class BVHReport;
 
 public:
-    BVH(std::vector<RTTriangle> *tris, SplitMode mode);
-    BVH(std::vector<RTTriangle> *tris, const std::string filename);
+    BVH(std::vector<RTTriangle> *tris, SplitMode mode, U32 numThreads = 0);
+    BVH(std::vector<RTTriangle> *tris); // empty, filled by importFrom
 	BVH(void) {}
 	~BVH() {}
 
-    void exportTo(const std::string filename) const;
+    // False if the file is missing, outdated or was built from other data
+    bool importFrom(const std::string filename, U64 sourceHash, U32 builderMode);
+    void exportTo(const std::string filename, U64 sourceHash, U32 builderMode) const;
 
     AABB_t getSceneBounds(void) const;
 
+	// Collapse binary hierarchy into W-wide nodes (W = 4 or 8).
+	// Returns the traversal stack size the result needs.
+	template <U32 W>
+	U32 collapse(std::vector<WideNode<W>> &out) const;
+
+	// Same layout as m_nodes with child boxes quantized into each parent (Q = U8 or U16)
+	// Expects depth-first layout, left child is implicit in the output
+	template <typename Q>
+	void quantize(std::vector<QuantizedNode<Q>> &out) const;
+
+	// Cache-aware reordering of m_nodes, rewrites parent/child links
+	void reorderNodes(NodeLayout layout);
+
+	// Recompute boxes from the current triangle positions, topology is kept.
+	// Returns SAH cost relative to the hierarchy before its first refit,
+	// a full rebuild pays off once this grows well above 1.
+	F32 refit();
+	F32 refit(const std::vector<U32> &changedTris); // only leaves with changed triangles and their ancestors
+
+	// SAH cost normalized by root area
+	F32 sahCost() const;
+
 private:
 	void build(U32 nInd, U32 depth, F32 progressStart, F32 progressEnd);
 
 protected:
 	struct SplitInfo;
+	struct BuildMetrics;
 	
 	
-    void importFrom(const std::string filename);
 	void lazyPrintBuildStatus(F32 percentage);
 
     // Convert build nodes to small nodes
@@ -47,6 +100,30 @@ protected:
 	bool objectMedianSplit(BuildNode &n, U32 dim, SplitInfo &split);
 	bool sahSplit(BuildNode &n, SplitInfo &split);
 	void sortReferences(U32 s, U32 e, U32 dim);
+	static void sortReferences(std::vector<TriRef> &refs, U32 s, U32 e, U32 dim);
+
+	// Task-parallel binned SAH builder
+	void buildBinned(std::vector<BuildNode> &out, U32 iStart, U32 iEnd, S32 parent, U32 depth, BuildMetrics &m);
+	void binnedSahSplit(BuildNode &n, SplitInfo &split, BuildMetrics &m);
+	void reportBinnedProgress(U32 finishedRefs);
+
+	// Full-sweep SAH over per-axis presorted reference lists (Wald 07), stable partitioning
+	void buildPresorted();
+	void buildPresorted(U32 nInd, U32 depth, S32 orderDim, F32 progressStart, F32 progressEnd);
+	bool presortedSahSplit(BuildNode &n, SplitInfo &split);
+
+	template <U32 W>
+	U32 collapseNode(std::vector<WideNode<W>> &out, U32 binaryIdx, U32 wideIdx) const;
+
+	void vebOrder(U32 root, U32 levels, std::vector<U32> &order) const;
+	AABB_t leafBounds(const Node &n) const;
+	F32 refitDegradation();
+	void clusteredOrder(std::vector<U32> &order) const;
+
+	// Task slots shared by the parallel builders, 0 threads = all cores
+	void setBuildThreads(U32 numThreads);
+	bool tryAcquireTask();
+	void releaseTask();
 
 	F32 sahCost(U32 N1, F32 area1, U32 N2, F32 area2, F32 area_root) const;
 	void buildBoxLookup(BuildNode &n);
@@ -58,13 +135,22 @@ protected:
 	std::vector<BuildNode> m_build_nodes;
 	std::vector<Node> m_nodes;
 	std::vector<AABB_t> rightBoxes; // SAH builder optimization
+	std::vector<U32> m_sorted[3];   // presorted builder, m_refs indices per axis
+	std::vector<TriRef> m_sortedRefs;
+	std::vector<U8> m_presortSide;  // per reference: 1 = right of current split
+	std::vector<U32> m_presortTmp;
 	U32 nodes = 0;
 	SplitMode m_mode;
+	F32 m_refitBaseCost = 0.0f; // SAH cost before the first refit
 
 	enum
 	{
 		MaxLeafElems = 8,
-		MaxDepth = 64
+		MaxDepth = 64,
+		NumBins = 32,              // binned SAH
+		LayoutClusterBytes = 4096, // clustered node layout
+		RefitWarnPercent = 150,    // refit SAH degradation that triggers a rebuild hint
+		ParallelMinElems = 1 << 14 // smallest subtree built as separate task
 	};
 
 	struct
@@ -73,13 +159,26 @@ protected:
 		const F32 costTri = 1.0f;
 	} sahParams;
 
-	struct
+	struct BuildMetrics
 	{
 		U32 depth = 0;
 		U32 bad_splits = 0;
 		U32 splits = 0;
+
+		void merge(const BuildMetrics &other)
+		{
+			depth = std::max(depth, other.depth);
+			bad_splits += other.bad_splits;
+			splits += other.splits;
+		}
 	} metrics;
 
+	struct SAHBin
+	{
+		AABB_t bounds;
+		U32 count = 0;
+	};
+
 	struct SplitInfo
 	{
 		S32 i;
@@ -93,6 +192,12 @@ protected:
 	};
 
 	S32 buildPercentage = -1; // for printing sparingly
+
+	// Binned builder task state
+	std::atomic<U32> activeTasks{ 0 };
+	std::atomic<U32> finishedRefs{ 0 };
+	std::mutex printMutex;
+	U32 maxTasks = 1;
 };
 
 // Write a simple data type to a stream.
@@ -7,12 +7,3 @@ void BuildNode::computeBB(std::vector<TriRef> &refs) {
 		box.expand(refs[i].box);
 	}
 }
-
-void SBVHNode::deleteTree() {
-	if (!this->isLeaf()) {
-		leftChild->deleteTree();
-		rightChild->deleteTree();
-	}
-
-	delete this;
-}
\ No newline at end of file
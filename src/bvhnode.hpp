@@ -31,19 +31,18 @@ struct BuildNode
 	BuildNode(U32 s, U32 e, S32 p) : iStart(s), iEnd(e), parent(p) {}
 };
 
-/* Pointer-based node used in SBVH construction */
+/* Node used in SBVH construction, stored in a per-task pool (children are pool indices) */
 struct SBVHNode
 {
 	AABB_t box;
 	U32 lo, hi; // inclusive
-	SBVHNode *leftChild = nullptr;
-	SBVHNode *rightChild = nullptr;
+	S32 leftChild = -1;
+	S32 rightChild = -1;
 	inline U32 spannedTris() const { return hi - lo; }
-	inline bool isLeaf() const { return !leftChild && !rightChild; }
-	void deleteTree();
+	inline bool isLeaf() const { return leftChild == -1; }
 
-	SBVHNode(const AABB_t &b, SBVHNode* l, SBVHNode* r) : box(b), leftChild(l), rightChild(r) {} // inner node
-	SBVHNode(const AABB_t &b, int l, int h) : box(b), lo(l), hi(h) {} // leaf node
+	SBVHNode(const AABB_t &b, S32 l, S32 r) : box(b), lo(0), hi(0), leftChild(l), rightChild(r) {} // inner node
+	SBVHNode(const AABB_t &b, U32 l, U32 h) : box(b), lo(l), hi(h) {} // leaf node
 };
 
 /* Small node used in BVH traversal */
@@ -53,7 +52,35 @@ struct Node
 	S32 parent;
 	union {
 		U32 iStart;		// leaf node, indiex into index list
-		U32 rightChild; // internal node, index into node vector (left child always current + 1)
+		U32 rightChild; // internal node, index into node vector
 	};
+	U32 leftChild;		// internal node, current + 1 in depth-first layout
 	U8 nPrims = 0;		// 0 for interior nodes
 };
+
+/* Wide node used in BVH4/BVH8 traversal, child boxes stored as SoA */
+template <U32 W>
+struct WideNode
+{
+	F32 bminx[W], bminy[W], bminz[W];
+	F32 bmaxx[W], bmaxy[W], bmaxz[W];
+	S32 child[W];	// node index, or index into index list for leaf children; -1 for empty slots
+	U8 nPrims[W];	// 0 for interior children
+};
+
+/* Compressed node used in quantized BVH traversal (Q = U8 or U16, 32B / 44B)
+   Child boxes are stored on a per-axis 2^exponent grid anchored at origin,
+   rounded outwards. No parent index => stack traversal only. */
+template <typename Q>
+struct QuantizedNode
+{
+	F32 origin[3];		// min corner of the union of the child boxes
+	cl_char exponent[3];
+	U8 nPrims = 0;		// 0 for interior nodes
+	Q childMin[6];		// left xyz, right xyz
+	Q childMax[6];
+	union {
+		U32 iStart;		// leaf node, index into index list
+		U32 rightChild;	// internal node, index into node vector (left child always current + 1)
+	};
+};
@@ -0,0 +1,298 @@
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iomanip>
+#include "bvhreport.hpp"
+
+BVHReport::BVHReport(const BVH &bvh, U32 numThreads) : bvh(bvh), nodes(bvh.m_nodes)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1U, std::thread::hardware_concurrency());
+
+	numNodes = (U32)nodes.size();
+	numIndices = (U32)bvh.m_indices.size();
+	numTris = (U32)bvh.m_triangles->size();
+	sahCost = bvh.sahCost();
+
+	computeStructure();
+	computeEPO(numThreads);
+
+	std::vector<WideNode<4>> wide4;
+	std::vector<WideNode<8>> wide8;
+	std::vector<QuantizedNode<U8>> quant8;
+	std::vector<QuantizedNode<cl_ushort>> quant16;
+	bvh.collapse(wide4);
+	bvh.collapse(wide8);
+	bvh.quantize(quant8);
+	bvh.quantize(quant16);
+
+	indexBytes = bvh.m_indices.size() * sizeof(U32);
+	nodeBytes = nodes.size() * sizeof(Node);
+	wide4Bytes = wide4.size() * sizeof(WideNode<4>);
+	wide8Bytes = wide8.size() * sizeof(WideNode<8>);
+	quant8Bytes = quant8.size() * sizeof(QuantizedNode<U8>);
+	quant16Bytes = quant16.size() * sizeof(QuantizedNode<cl_ushort>);
+}
+
+// Histograms, expected test counts and pre-order intervals (any node layout)
+void BVHReport::computeStructure()
+{
+	const F32 rootArea1 = 1.0f / nodes[0].box.area();
+	enterOrder.resize(nodes.size());
+	exitOrder.resize(nodes.size());
+
+	U64 depthSum = 0;
+	U32 counter = 0;
+	std::vector<std::pair<U32, U32>> stack = { { 0, 0 } }; // node, depth; second visit has depth ~0U
+	while (!stack.empty())
+	{
+		const std::pair<U32, U32> e = stack.back();
+		stack.pop_back();
+		if (e.second == ~0U)
+		{
+			exitOrder[e.first] = counter;
+			continue;
+		}
+
+		const Node &n = nodes[e.first];
+		enterOrder[e.first] = counter++;
+		stack.push_back({ e.first, ~0U });
+
+		const F32 p = n.box.area() * rootArea1;
+		if (n.nPrims > 0)
+		{
+			triTests += p * n.nPrims;
+			numLeaves++;
+			depthSum += e.second;
+			maxDepth = std::max(maxDepth, e.second);
+			if (leafSizes.size() <= n.nPrims) leafSizes.resize(n.nPrims + 1, 0);
+			if (leafDepths.size() <= e.second) leafDepths.resize(e.second + 1, 0);
+			leafSizes[n.nPrims]++;
+			leafDepths[e.second]++;
+		}
+		else
+		{
+			boxTests += 2.0f * p;
+			stack.push_back({ n.rightChild, e.second + 1 });
+			stack.push_back({ n.leftChild, e.second + 1 });
+		}
+	}
+
+	avgLeafDepth = (F32)depthSum / numLeaves;
+	avgLeafSize = (F32)numIndices / numLeaves;
+
+	// Triangle => leaves, more than one for split references
+	leafOfStart.assign(numTris + 1, 0);
+	for (const Node &n : nodes)
+		for (U32 i = n.iStart; i < n.iStart + n.nPrims; i++)
+			leafOfStart[bvh.m_indices[i] + 1]++;
+	for (U32 t = 0; t < numTris; t++)
+		leafOfStart[t + 1] += leafOfStart[t];
+
+	leafOf.resize(numIndices);
+	std::vector<U32> fill(leafOfStart.begin(), leafOfStart.end() - 1);
+	for (U32 ni = 0; ni < numNodes; ni++)
+	{
+		const Node &n = nodes[ni];
+		for (U32 i = n.iStart; i < n.iStart + n.nPrims; i++)
+			leafOf[fill[bvh.m_indices[i]]++] = ni;
+	}
+}
+
+void BVHReport::computeEPO(U32 numThreads)
+{
+	double totalArea = 0.0;
+	for (const RTTriangle &t : *bvh.m_triangles)
+		totalArea += t.area();
+
+	std::vector<double> nodeEPO(nodes.size(), 0.0);
+	std::atomic<U32> next{ 0 };
+	auto worker = [&]()
+	{
+		std::vector<U32> stack, found;
+		for (U32 i = next++; i < numNodes; i = next++)
+		{
+			const Node &n = nodes[i];
+			const F32 c = (n.nPrims > 0) ? bvh.sahParams.costTri * n.nPrims : bvh.sahParams.costBox;
+			nodeEPO[i] = c * externalArea(i, stack, found);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (U32 t = 1; t < numThreads; t++)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread &t : workers)
+		t.join();
+
+	// Fixed summation order => same result for any thread count
+	double sum = 0.0;
+	for (double e : nodeEPO)
+		sum += e;
+	epo = (F32)(sum / totalArea);
+}
+
+bool BVHReport::inSubtree(U32 tri, U32 node) const
+{
+	for (U32 i = leafOfStart[tri]; i < leafOfStart[tri + 1]; i++)
+	{
+		const U32 leaf = leafOf[i];
+		if (enterOrder[leaf] >= enterOrder[node] && enterOrder[leaf] < exitOrder[node])
+			return true;
+	}
+	return false;
+}
+
+static inline bool overlaps(const AABB_t &a, const AABB_t &b)
+{
+	return a.min.x <= b.max.x && a.max.x >= b.min.x
+		&& a.min.y <= b.max.y && a.max.y >= b.min.y
+		&& a.min.z <= b.max.z && a.max.z >= b.min.z;
+}
+
+// Sutherland-Hodgman against the six box planes, area of the remaining polygon
+static F32 clippedArea(const RTTriangle &t, const AABB_t &box)
+{
+	fr::float3 bufA[9], bufB[9];
+	fr::float3 *poly = bufA, *out = bufB;
+	U32 count = 3;
+	poly[0] = t.v0.p; poly[1] = t.v1.p; poly[2] = t.v2.p;
+
+	for (int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		const int dim = plane >> 1;
+		const F32 sign = (plane & 1) ? -1.0f : 1.0f;               // keep p >= min, or p <= max
+		const F32 bound = (plane & 1) ? box.max[dim] : box.min[dim];
+
+		U32 outCount = 0;
+		for (U32 i = 0; i < count; i++)
+		{
+			const fr::float3 &a = poly[i];
+			const fr::float3 &b = poly[(i + 1) % count];
+			const F32 da = sign * (a[dim] - bound);
+			const F32 db = sign * (b[dim] - bound);
+			if (da >= 0.0f)
+				out[outCount++] = a;
+			if ((da >= 0.0f) != (db >= 0.0f))
+				out[outCount++] = lerp(a, b, da / (da - db));
+		}
+		std::swap(poly, out);
+		count = outCount;
+	}
+
+	if (count < 3)
+		return 0.0f;
+
+	fr::float3 n(0.0f);
+	for (U32 i = 1; i + 1 < count; i++)
+		n += cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+	return 0.5f * length(n);
+}
+
+// Area of triangles outside the subtree of 'node' within its box, found by traversing the hierarchy itself
+double BVHReport::externalArea(U32 node, std::vector<U32> &stack, std::vector<U32> &found) const
+{
+	const AABB_t &box = nodes[node].box;
+	stack.clear();
+	found.clear();
+	stack.push_back(0);
+
+	while (!stack.empty())
+	{
+		const U32 ni = stack.back();
+		stack.pop_back();
+		const Node &n = nodes[ni];
+		if (ni == node || !overlaps(n.box, box))
+			continue;
+
+		if (n.nPrims == 0)
+		{
+			stack.push_back(n.leftChild);
+			stack.push_back(n.rightChild);
+			continue;
+		}
+
+		for (U32 i = n.iStart; i < n.iStart + n.nPrims; i++)
+		{
+			const U32 tri = bvh.m_indices[i];
+			const RTTriangle &t = (*bvh.m_triangles)[tri];
+			if (overlaps(AABB_t(t.min(), t.max()), box))
+				found.push_back(tri);
+		}
+	}
+
+	// Split references are reported once per leaf
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+
+	double area = 0.0;
+	for (U32 tri : found)
+	{
+		if (!inSubtree(tri, node))
+			area += clippedArea((*bvh.m_triangles)[tri], box);
+	}
+	return area;
+}
+
+void BVHReport::print(std::ostream &os) const
+{
+	os
+		<< "SAH cost: " << sahCost << std::endl
+		<< "EPO: " << epo << std::endl
+		<< "Box tests / ray: " << boxTests << std::endl
+		<< "Triangle tests / ray: " << triTests << std::endl
+		<< "Nodes: " << numNodes << " (" << numLeaves << " leaves)" << std::endl
+		<< "Indices: " << numIndices << " (" << std::fixed << std::setprecision(1)
+		<< (numIndices - numTris) * 100.0f / numTris << "% duplicates)" << std::defaultfloat << std::setprecision(6) << std::endl
+		<< "Depth: " << maxDepth << " (avg. leaf " << avgLeafDepth << ")" << std::endl
+		<< "Leaf size: avg. " << avgLeafSize << std::endl;
+
+	for (size_t i = 1; i < leafSizes.size(); i++)
+	{
+		if (leafSizes[i] > 0)
+			os << "  " << std::setw(3) << i << ": " << leafSizes[i] << std::endl;
+	}
+
+	os << "Leaf depth:" << std::endl;
+	for (size_t i = 0; i < leafDepths.size(); i++)
+	{
+		if (leafDepths[i] > 0)
+			os << "  " << std::setw(3) << i << ": " << leafDepths[i] << std::endl;
+	}
+
+	const F32 MB = 1.0f / (1 << 20);
+	os
+		<< "Memory (MB): indices " << indexBytes * MB
+		<< ", binary " << nodeBytes * MB
+		<< ", BVH4 " << wide4Bytes * MB
+		<< ", BVH8 " << wide8Bytes * MB
+		<< ", quantized 8-bit " << quant8Bytes * MB
+		<< ", 16-bit " << quant16Bytes * MB << std::endl;
+}
+
+nlohmann::json BVHReport::toJson() const
+{
+	nlohmann::json j;
+	j["sahCost"] = sahCost;
+	j["epo"] = epo;
+	j["boxTestsPerRay"] = boxTests;
+	j["triTestsPerRay"] = triTests;
+	j["nodes"] = numNodes;
+	j["leaves"] = numLeaves;
+	j["indices"] = numIndices;
+	j["triangles"] = numTris;
+	j["maxDepth"] = maxDepth;
+	j["avgLeafDepth"] = avgLeafDepth;
+	j["avgLeafSize"] = avgLeafSize;
+	j["leafSizeHistogram"] = leafSizes;
+	j["leafDepthHistogram"] = leafDepths;
+	j["memory"] = {
+		{ "indices", indexBytes },
+		{ "binary", nodeBytes },
+		{ "bvh4", wide4Bytes },
+		{ "bvh8", wide8Bytes },
+		{ "quantized8", quant8Bytes },
+		{ "quantized16", quant16Bytes }
+	};
+	return j;
+}
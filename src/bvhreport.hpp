@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <ostream>
+#include "json.hpp"
+#include "bvh.hpp"
+
+/*
+ * Quality metrics of a finished binary hierarchy, independent of its builder.
+ * EPO as in Aila et al. 2013, "On Quality Metrics of Bounding Volume Hierarchies":
+ * surface area of geometry outside a node's subtree that lies inside its box,
+ * weighted by the node's SAH cost factor and normalized by total surface area.
+ */
+class BVHReport
+{
+public:
+	// Expects depth-first layout (for the quantized memory figures)
+	BVHReport(const BVH &bvh, U32 numThreads = 0);
+
+	void print(std::ostream &os) const;
+	nlohmann::json toJson() const;
+
+	F32 sahCost = 0.0f;    // normalized by root area
+	F32 epo = 0.0f;        // normalized by total triangle area
+	F32 boxTests = 0.0f;   // expected per random ray through the root, no early exit
+	F32 triTests = 0.0f;
+	U32 numNodes = 0;
+	U32 numLeaves = 0;
+	U32 numIndices = 0;
+	U32 numTris = 0;
+	U32 maxDepth = 0;
+	F32 avgLeafDepth = 0.0f;
+	F32 avgLeafSize = 0.0f;
+	std::vector<U32> leafSizes;  // leaves per primitive count
+	std::vector<U32> leafDepths; // leaves per depth
+	size_t indexBytes = 0;
+	size_t nodeBytes = 0;        // binary nodes
+	size_t wide4Bytes = 0;
+	size_t wide8Bytes = 0;
+	size_t quant8Bytes = 0;
+	size_t quant16Bytes = 0;
+
+private:
+	void computeStructure();
+	void computeEPO(U32 numThreads);
+	double externalArea(U32 node, std::vector<U32> &stack, std::vector<U32> &found) const;
+	bool inSubtree(U32 tri, U32 node) const;
+
+	const BVH &bvh;
+	const std::vector<Node> &nodes;
+	std::vector<U32> enterOrder;   // pre-order interval [enter, exit[ per node
+	std::vector<U32> exitOrder;
+	std::vector<U32> leafOf;        // leaves referencing each triangle, CSR
+	std::vector<U32> leafOfStart;
+};
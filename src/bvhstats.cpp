@@ -0,0 +1,207 @@
+#include "bvhreport.hpp"
+#include "sbvh.hpp"
+#include "treelet.hpp"
+#include "scene.hpp"
+#include "settings.hpp"
+#include "IL/il.h"
+#include "IL/ilu.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <tclap/CmdLine.h>
+
+// Hierarchy analysis tool: builds (or loads) hierarchies for a scene with
+// several builders and reports their quality metrics side by side
+
+struct BuilderConfig
+{
+    std::string name;
+    SplitMode mode;
+    bool sbvh;
+};
+
+static bool parseBuilder(const std::string &name, BuilderConfig &out)
+{
+    const std::vector<BuilderConfig> builders =
+    {
+        { "spatial_median", SplitMode::SpatialMedian, false },
+        { "object_median", SplitMode::ObjectMedian, false },
+        { "sah", SplitMode::SAH, false },
+        { "binned_sah", SplitMode::BinnedSAH, false },
+        { "presorted_sah", SplitMode::PresortedSAH, false },
+        { "sbvh", SplitMode::SAH, true },
+    };
+
+    for (const BuilderConfig &b : builders)
+    {
+        if (b.name == name)
+        {
+            out = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    Settings &s = Settings::getInstance();
+
+    std::string scenePath;
+    std::string jsonPath;
+    std::vector<std::string> builderNames;
+    unsigned int threads;
+    unsigned int optimizePasses;
+    bool useCache;
+
+    try
+    {
+        TCLAP::CmdLine cmd("~ Fluctus hierarchy statistics ~", ' ', "0.1");
+
+        TCLAP::MultiArg<std::string> aBuilders("m", "mode",
+            "Builder: spatial_median, object_median, sah, binned_sah, presorted_sah or sbvh (with bvhSplitMode from settings.json; repeatable, default binned_sah, presorted_sah, sbvh)",
+            false, "string");
+        cmd.add(aBuilders);
+
+        TCLAP::ValueArg<std::string> aJson("j", "json", "Write results as JSON to file, - for stdout", false, "", "string");
+        cmd.add(aJson);
+
+        TCLAP::ValueArg<unsigned int> aThreads("t", "threads", "Build and analysis threads, 0 = all cores", false, s.getBvhBuildThreads(), "int");
+        cmd.add(aThreads);
+
+        TCLAP::ValueArg<unsigned int> aOptimize("o", "optimize", "Treelet optimization passes", false, s.getBvhOptimizePasses(), "int");
+        cmd.add(aOptimize);
+
+        TCLAP::SwitchArg aCache("c", "cached", "Load hierarchies from the renderer's cache when available", cmd, false);
+
+        TCLAP::UnlabeledValueArg<std::string> aScene("Scene", "Scene to analyze", true, "", "string");
+        cmd.add(aScene);
+
+        cmd.parse(argc, argv);
+        scenePath = aScene.getValue();
+        jsonPath = aJson.getValue();
+        builderNames = aBuilders.getValue();
+        threads = aThreads.getValue();
+        optimizePasses = aOptimize.getValue();
+        useCache = aCache.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cout << "Error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    if (builderNames.empty())
+        builderNames = { "binned_sah", "presorted_sah", "sbvh" };
+
+    std::vector<BuilderConfig> builders;
+    for (const std::string &name : builderNames)
+    {
+        BuilderConfig b;
+        if (!parseBuilder(name, b))
+        {
+            std::cout << "Unknown builder: " << name << std::endl;
+            return 1;
+        }
+
+        // The renderer pairs SBVH with the configured split mode, cache key included
+        if (b.sbvh)
+            b.mode = s.getBvhSplitMode();
+        builders.push_back(b);
+    }
+
+    ilInit();
+    iluInit();
+
+    // Single-level hierarchies only, instances are flattened
+    s.import({ { "useInstancing", false } });
+
+    Scene scene;
+    scene.loadModel(scenePath, nullptr);
+    std::vector<RTTriangle> &triangles = scene.getTriangles();
+    if (triangles.empty())
+    {
+        std::cout << "No triangles in " << scenePath << std::endl;
+        return 1;
+    }
+
+    nlohmann::json results = nlohmann::json::array();
+    for (const BuilderConfig &b : builders)
+    {
+        // Same file naming and builder tag as Tracer::initHierarchy
+        std::string builderTag = (b.sbvh ? "sbvh" : "bvh") + std::to_string((int)b.mode);
+        if (optimizePasses > 0) builderTag += "_opt" + std::to_string(optimizePasses);
+        const std::string hashFile = "data/hierarchies/hierarchy_" + scene.hashString() + "_" + builderTag + ".bin";
+        const U32 builderMode = (b.sbvh ? 0x100U : 0U) | (U32)b.mode | (optimizePasses << 16);
+
+        BVH *bvh = nullptr;
+        bool cached = false;
+        double buildMs = 0.0;
+        if (useCache)
+        {
+            bvh = new BVH(&triangles);
+            cached = bvh->importFrom(hashFile, scene.getHash(), builderMode);
+            if (!cached)
+            {
+                delete bvh;
+                bvh = nullptr;
+            }
+        }
+
+        if (!bvh)
+        {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            if (b.sbvh)
+                bvh = new SBVH(&triangles, b.mode, nullptr, threads);
+            else
+                bvh = new BVH(&triangles, b.mode, threads);
+            if (optimizePasses > 0)
+                TreeletOptimizer(*bvh, threads).optimize(optimizePasses);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            buildMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        }
+
+        BVHReport report(*bvh, threads);
+        delete bvh;
+
+        std::cout
+            << std::endl
+            << "======================" << std::endl
+            << "Builder: " << b.name << (optimizePasses > 0 ? " + treelet optimization" : "") << std::endl;
+        if (cached)
+            std::cout << "Loaded from " << hashFile << std::endl;
+        else
+            std::cout << "Build time: " << buildMs << " ms" << std::endl;
+        report.print(std::cout);
+        std::cout << "======================" << std::endl;
+
+        nlohmann::json j = report.toJson();
+        j["builder"] = b.name;
+        j["optimizePasses"] = optimizePasses;
+        j["cached"] = cached;
+        j["buildMs"] = cached ? nlohmann::json() : nlohmann::json(buildMs);
+        results.push_back(j);
+    }
+
+    if (!jsonPath.empty())
+    {
+        nlohmann::json out = { { "scene", scenePath }, { "triangles", triangles.size() }, { "results", results } };
+        if (jsonPath == "-")
+        {
+            std::cout << out.dump(4) << std::endl;
+        }
+        else
+        {
+            std::ofstream file(jsonPath);
+            if (!file.good())
+            {
+                std::cout << "Could not write " << jsonPath << std::endl;
+                return 1;
+            }
+            file << out.dump(4) << std::endl;
+        }
+    }
+
+    return 0;
+}
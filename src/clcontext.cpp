@@ -5,6 +5,7 @@
 #include "bvhnode.hpp"
 #include "settings.hpp"
 #include "bvh.hpp"
+#include "devicebvh.hpp"
 #include "scene.hpp"
 #include "texture.hpp"
 #include "window.hpp"
@@ -13,7 +14,10 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h> // texture conversion stuff
 #include <string>
+#include <cstring>
 #include <vector>
+#include <numeric>
+#include <cfloat>
 
 CLContext::CLContext()
 {
@@ -91,6 +95,8 @@ void CLContext::setupKernels()
     setupWfDeltaKernel();
     setupWfEmissiveKernel();
     setupWfAllMaterialsKernel();
+    setupWfSortKernels();
+    setupWfPrimaryKernel();
 
     // Other
     setupPickKernel();
@@ -147,11 +153,42 @@ void CLContext::setKernelBuildSettings()
     std::string buildOpts = "-DGPU -I./src -cl-denorms-are-zero -cl-fast-relaxed-math -cl-kernel-arg-info -DFLT_FLOAT_ATOMICS";
     Settings &s = Settings::getInstance();
     if (s.getUseBitstack()) buildOpts += " -DUSE_BITSTACK";
+    if (s.getBvhWidth() > 2) buildOpts += " -DUSE_WIDE_BVH -DBVH_WIDTH=" + std::to_string(s.getBvhWidth());
+    else if (s.getBvhQuantBits() > 0) buildOpts += " -DUSE_QUANTIZED_BVH -DBVH_QUANT_BITS=" + std::to_string(s.getBvhQuantBits());
+    if (s.getBvhWidth() > 2 && wideStackSize > 0) buildOpts += " -DWIDE_STACK_SIZE=" + std::to_string(wideStackSize);
+    if (s.getUseBitstack() && s.getBvhQuantBits() > 0 && s.getBvhWidth() == 2)
+        std::cout << "Compressed BVH nodes have no parent links, using stack traversal" << std::endl;
+    if (s.getBvhLeafOrderTris()) buildOpts += " -DLEAF_ORDER_TRIS";
+    if (s.getTriangleTest() == TriangleTest::Woop) buildOpts += " -DTRI_WOOP";
+    else if (s.getTriangleTest() == TriangleTest::Watertight) buildOpts += " -DTRI_WATERTIGHT";
+    if (s.getUseInstancing()) buildOpts += " -DUSE_INSTANCING";
+    if (s.getUseInstancing() && s.getUseBitstack())
+        std::cout << "Two-level hierarchies have no parent links across levels, using stack traversal" << std::endl;
     if (s.getUseSoA()) buildOpts += " -DUSE_SOA";
+    if (s.getTraversalStats()) buildOpts += " -DTRAVERSAL_STATS";
+    if (s.getPersistentThreads()) buildOpts += " -DPERSISTENT_THREADS";
+    if (s.getPacketTraversal()) buildOpts += " -DPACKET_TRAVERSAL";
     if (platformIsNvidia(platform)) buildOpts += " -DNVIDIA -cl-nv-verbose";
 
     // Static, shared by all kernels
     clt::setGlobalBuildOptions(buildOpts);
+    kernelBuildOptions = buildOpts;
+}
+
+// Compiled on first use
+LBVHProgram &CLContext::getLBVHProgram()
+{
+    if (!lbvhProgram)
+        lbvhProgram = new LBVHProgram(context, device, kernelBuildOptions);
+    return *lbvhProgram;
+}
+
+// Created on first build, reused by later builds and refits
+DeviceBVHBuilder &CLContext::getDeviceBuilder()
+{
+    if (!deviceBuilder)
+        deviceBuilder = new DeviceBVHBuilder(context, device, cmdQueue, getLBVHProgram());
+    return *deviceBuilder;
 }
 
 void CLContext::setupPickKernel()
@@ -172,6 +209,51 @@ void CLContext::setupWfExtKernel()
     wf_extension->build(context, device, platform);
 }
 
+void CLContext::setupWfPrimaryKernel()
+{
+    if (!Settings::getInstance().getPacketTraversal())
+        return;
+
+    if (!wf_primary)
+        wf_primary = new WFPrimaryKernel();
+
+    window->showMessage("Building kernel", "wf_primaryrays");
+    wf_primary->build(context, device, platform);
+}
+
+void CLContext::setupWfSortKernels()
+{
+    if (!Settings::getInstance().getRayReordering())
+        return;
+
+    // Allocated and compiled once (NUM_TASKS is fixed), later calls only refresh the arguments
+    if (wf_ray_keys)
+    {
+        wf_ray_keys->setArgs();
+        return;
+    }
+
+    int err = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        deviceBuffers.rayKeys[i] = cl::Buffer(context, CL_MEM_READ_WRITE, NUM_TASKS * sizeof(cl_uint), NULL, &err);
+        deviceBuffers.rayValues[i] = cl::Buffer(context, CL_MEM_READ_WRITE, NUM_TASKS * sizeof(cl_uint), NULL, &err);
+    }
+    verify("Ray sort buffer creation failed!");
+
+    wf_ray_keys = new WFRayKeysKernel();
+    window->showMessage("Building kernel", "wf_sortrays");
+    wf_ray_keys->build(context, device, platform);
+
+    raySorter = new DeviceRadixSort(context, device, cmdQueue, getLBVHProgram());
+    if (!raySorter->supported())
+    {
+        std::cout << "Device cannot run the radix sort, ray reordering disabled" << std::endl;
+        delete raySorter;
+        raySorter = nullptr;
+    }
+}
+
 void CLContext::setupWfLogicKernel()
 {
     if (!wf_logic)
@@ -188,6 +270,26 @@ void CLContext::setupWfShadowKernel()
 
     window->showMessage("Building kernel", "wf_shadowrays");
     wf_shadow->build(context, device, platform);
+    setupPersistentLaunch();
+}
+
+// One SIMD width per group so that a batch is one warp/wavefront,
+// enough groups per compute unit to hide latency
+void CLContext::setupPersistentLaunch()
+{
+    if (!Settings::getInstance().getPersistentThreads())
+        return;
+
+    const cl::Kernel &ext = *wf_extension;
+    const cl::Kernel &shadow = *wf_shadow;
+    const size_t maxGroup = std::min(ext.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), shadow.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+    const size_t simdWidth = ext.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    const size_t computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+    persistentLocalSize = std::max((size_t)1, std::min(simdWidth, maxGroup));
+    persistentGlobalSize = computeUnits * PersistentGroupsPerUnit * persistentLocalSize;
+    std::cout << "Persistent traversal: " << computeUnits << " compute units, "
+        << persistentGlobalSize / persistentLocalSize << " groups of " << persistentLocalSize << std::endl;
 }
 
 void CLContext::setupWfRaygenKernel()
@@ -351,6 +453,8 @@ void CLContext::setupPixelStorage(PTWindow *window)
     deviceBuffers.denoiserAlbedoBufferGL = cl::BufferGL(context, CL_MEM_READ_WRITE, window->getAlbedoPBO(), &err);
     deviceBuffers.denoiserNormalBufferGL = cl::BufferGL(context, CL_MEM_READ_WRITE, window->getNormalPBO(), &err);
     deviceBuffers.samplesPerPixel = cl::Buffer(context, CL_MEM_READ_WRITE, numPixels * sizeof(cl_uint), NULL, &err);
+    const unsigned int statsPixels = Settings::getInstance().getTraversalStats() ? numPixels : 1; // placeholder arg if disabled
+    deviceBuffers.traversalStats = cl::Buffer(context, CL_MEM_READ_WRITE, statsPixels * sizeof(cl_uint) * 2, NULL, &err);
     sharedMemory = { deviceBuffers.previewBuffer, deviceBuffers.denoiserAlbedoBufferGL, deviceBuffers.denoiserNormalBufferGL };
     verify("CL pixel storage creation failed!");
 
@@ -387,7 +491,14 @@ void CLContext::setupPixelStorage(PTWindow *window)
         err |= wf_reset->setArg("denoiserAlbedo", deviceBuffers.denoiserAlbedoBuffer);
         err |= wf_reset->setArg("denoiserNormal", deviceBuffers.denoiserNormalBuffer);
         err |= wf_reset->setArg("samplesPerPixel", deviceBuffers.samplesPerPixel);
+        err |= wf_reset->setArg("traversalStats", deviceBuffers.traversalStats);
     }
+    if (wf_extension)
+        err |= wf_extension->setArg("traversalStats", deviceBuffers.traversalStats);
+    if (wf_primary)
+        err |= wf_primary->setArg("traversalStats", deviceBuffers.traversalStats);
+    if (wf_shadow)
+        err |= wf_shadow->setArg("traversalStats", deviceBuffers.traversalStats);
     if (mk_postprocess)
     {
         err |= mk_postprocess->setArg("pixelsRaw", deviceBuffers.pixelBuffer);
@@ -396,6 +507,7 @@ void CLContext::setupPixelStorage(PTWindow *window)
         err |= mk_postprocess->setArg("pixelsPreview", deviceBuffers.previewBuffer);
         err |= mk_postprocess->setArg("denoiserAlbedoGL", deviceBuffers.denoiserAlbedoBufferGL);
         err |= mk_postprocess->setArg("denoiserNormalGL", deviceBuffers.denoiserNormalBufferGL);
+        err |= mk_postprocess->setArg("traversalStats", deviceBuffers.traversalStats);
     }
         
     verify("Failed to update kernel pixel storage args");
@@ -482,6 +594,228 @@ void CLContext::saveImage(std::string filename, const RenderParams &params)
     std::cout << ((Error == IL_NO_ERROR) ? "\nSaved " : "\nFailed saving ") << filename << std::endl;
 }
 
+// Float image of average traversal cost per sample: R = node visits, G = triangle tests
+void CLContext::saveTraversalStats(std::string filename, const RenderParams &params)
+{
+    const unsigned int numPixels = params.width * params.height;
+    std::vector<cl_uint> counts(numPixels * 2);
+    std::vector<float> pixels(numPixels * 4);
+
+    err = 0;
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.traversalStats, CL_TRUE, 0, counts.size() * sizeof(cl_uint), counts.data());
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.pixelBuffer, CL_TRUE, 0, pixels.size() * sizeof(float), pixels.data());
+    verify("Failed to copy traversal statistics to host!");
+
+    std::vector<float> data(numPixels * 3);
+    for (unsigned int i = 0; i < numPixels; i++)
+    {
+        const float spp = pixels[4 * i + 3];
+        const float norm = (spp > 0.0f) ? 1.0f / spp : 0.0f;
+        data[3 * i + 0] = counts[2 * i + 0] * norm;
+        data[3 * i + 1] = counts[2 * i + 1] * norm;
+        data[3 * i + 2] = 0.0f;
+    }
+
+    ILuint imageID = ilGenImage();
+    ilBindImage(imageID);
+    ilTexImage(params.width, params.height, 1, 3, IL_RGB, IL_FLOAT, data.data());
+    ilSaveImage(filename.c_str());
+    ilDeleteImage(imageID);
+
+    ILenum Error = IL_NO_ERROR;
+    while ((Error = ilGetError()) != IL_NO_ERROR)
+    {
+        printf("\n%d: %s", Error, iluErrorString(Error));
+    }
+    std::cout << ((Error == IL_NO_ERROR) ? "\nSaved " : "\nFailed saving ") << filename << std::endl;
+}
+
+// Float slot of a path state member component, in either task layout
+static inline size_t taskSlot(size_t memberOffset, cl_uint cmp, cl_uint task, cl_uint numTasks, bool soa)
+{
+    const size_t slot = memberOffset / sizeof(cl_uint) + cmp;
+    return soa ? slot * numTasks + task : task * (sizeof(GPUTaskState) / sizeof(cl_uint)) + slot;
+}
+
+static inline U64 fnv1a(U64 hash, cl_uint value)
+{
+    for (int b = 0; b < 4; b++)
+    {
+        hash ^= (value >> (8 * b)) & 0xFF;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void CLContext::captureRays(RayDump &dump)
+{
+    QueueCounters cnt;
+    std::vector<cl_uint> extQueue(NUM_TASKS);
+    std::vector<cl_uint> raygenQueue(NUM_TASKS);
+    std::vector<cl_uint> shadowQueue(NUM_TASKS);
+    std::vector<cl_uint> tasks(NUM_TASKS * sizeof(GPUTaskState) / sizeof(cl_uint));
+
+    err = 0;
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.queueCounters, CL_TRUE, 0, sizeof(QueueCounters), &cnt);
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.extensionQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), extQueue.data());
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.raygenQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), raygenQueue.data());
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.shadowQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), shadowQueue.data());
+    err |= cmdQueue.enqueueReadBuffer(deviceBuffers.tasksBuffer, CL_TRUE, 0, tasks.size() * sizeof(cl_uint), tasks.data());
+    verify("Failed to copy ray queues to host!");
+
+    const bool soa = Settings::getInstance().getUseSoA();
+    auto u32 = [&](size_t offset, cl_uint cmp, cl_uint task) { return tasks[taskSlot(offset, cmp, task, NUM_TASKS, soa)]; };
+    auto f32 = [&](size_t offset, cl_uint cmp, cl_uint task) { cl_float f; cl_uint u = u32(offset, cmp, task); std::memcpy(&f, &u, sizeof(f)); return f; };
+
+    // Packet traversal keeps camera rays out of the extension queue
+    if (wf_primary)
+        extQueue.insert(extQueue.begin() + std::min(cnt.extensionQueue, NUM_TASKS), raygenQueue.begin(), raygenQueue.begin() + std::min(cnt.raygenQueue, NUM_TASKS));
+    const cl_uint numExtension = std::min(cnt.extensionQueue, NUM_TASKS) + (wf_primary ? std::min(cnt.raygenQueue, NUM_TASKS) : 0);
+
+    for (cl_uint i = 0; i < numExtension; i++)
+    {
+        const cl_uint gid = extQueue[i];
+        RayRecord r;
+        for (cl_uint c = 0; c < 3; c++)
+        {
+            r.orig[c] = f32(offsetof(GPUTaskState, orig), c, gid);
+            r.dir[c] = f32(offsetof(GPUTaskState, dir), c, gid);
+        }
+        r.tMax = FLT_MAX;
+        r.kind = (u32(offsetof(GPUTaskState, pathLen), 0, gid) == 0) ? RayKind::Primary : RayKind::Secondary;
+        dump.rays.push_back(r);
+    }
+
+    for (cl_uint i = 0; i < std::min(cnt.shadowQueue, NUM_TASKS); i++)
+    {
+        const cl_uint gid = shadowQueue[i];
+        RayRecord r;
+        for (cl_uint c = 0; c < 3; c++)
+        {
+            r.orig[c] = f32(offsetof(GPUTaskState, shadowOrig), c, gid);
+            r.dir[c] = f32(offsetof(GPUTaskState, shadowDir), c, gid);
+        }
+        r.tMax = f32(offsetof(GPUTaskState, shadowRayLen), 0, gid);
+        r.kind = RayKind::Shadow;
+        dump.rays.push_back(r);
+    }
+}
+
+// Rays of each kind are traced in batches of NUM_TASKS, results read from the path state
+std::vector<RayReplayResult> CLContext::replayRays(const RayDump &dump, unsigned int iterations)
+{
+    const bool soa = Settings::getInstance().getUseSoA();
+    std::vector<cl_uint> tasks(NUM_TASKS * sizeof(GPUTaskState) / sizeof(cl_uint), 0);
+    auto u32 = [&](size_t offset, cl_uint cmp, cl_uint task) -> cl_uint& { return tasks[taskSlot(offset, cmp, task, NUM_TASKS, soa)]; };
+    auto setF32 = [&](size_t offset, cl_uint cmp, cl_uint task, cl_float f) { std::memcpy(&u32(offset, cmp, task), &f, sizeof(f)); };
+    auto getF32 = [&](size_t offset, cl_uint cmp, cl_uint task) { cl_float f; std::memcpy(&f, &u32(offset, cmp, task), sizeof(f)); return f; };
+
+    // Queues are the identity, paths 0..n-1 hold the batch
+    std::vector<cl_uint> identity(NUM_TASKS);
+    std::iota(identity.begin(), identity.end(), 0);
+    err = 0;
+    err |= cmdQueue.enqueueWriteBuffer(deviceBuffers.extensionQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), identity.data());
+    err |= cmdQueue.enqueueWriteBuffer(deviceBuffers.shadowQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), identity.data());
+    err |= cmdQueue.enqueueWriteBuffer(deviceBuffers.raygenQueue, CL_TRUE, 0, NUM_TASKS * sizeof(cl_uint), identity.data());
+    verify("Failed to upload replay queues!");
+
+    std::vector<RayReplayResult> results;
+    for (RayKind kind : { RayKind::Primary, RayKind::Secondary, RayKind::Shadow })
+    {
+        std::vector<const RayRecord*> rays;
+        for (const RayRecord &r : dump.rays)
+        {
+            if (r.kind == kind)
+                rays.push_back(&r);
+        }
+        if (rays.empty())
+            continue;
+
+        const bool shadow = (kind == RayKind::Shadow);
+        const size_t origOffset = shadow ? offsetof(GPUTaskState, shadowOrig) : offsetof(GPUTaskState, orig);
+        const size_t dirOffset = shadow ? offsetof(GPUTaskState, shadowDir) : offsetof(GPUTaskState, dir);
+        // Camera rays take the packet path when it is enabled, as in rendering
+        const bool packet = (kind == RayKind::Primary && wf_primary);
+        clt::Kernel *kernel = shadow ? wf_shadow : (packet ? wf_primary : wf_extension);
+
+        RayReplayResult res;
+        res.kind = kind;
+        res.numRays = (cl_uint)rays.size();
+        U64 hash = 14695981039346656037ULL;
+
+        for (size_t start = 0; start < rays.size(); start += NUM_TASKS)
+        {
+            const cl_uint n = (cl_uint)std::min((size_t)NUM_TASKS, rays.size() - start);
+            for (cl_uint i = 0; i < n; i++)
+            {
+                const RayRecord &r = *rays[start + i];
+                for (cl_uint c = 0; c < 3; c++)
+                {
+                    setF32(origOffset, c, i, r.orig[c]);
+                    setF32(dirOffset, c, i, r.dir[c]);
+                }
+                setF32(offsetof(GPUTaskState, shadowRayLen), 0, i, r.tMax);
+                u32(offsetof(GPUTaskState, pathLen), 0, i) = 0;
+                u32(offsetof(GPUTaskState, pixelIndex), 0, i) = 0;
+            }
+
+            QueueCounters cnt = {};
+            (shadow ? cnt.shadowQueue : packet ? cnt.raygenQueue : cnt.extensionQueue) = n;
+            err = cmdQueue.enqueueWriteBuffer(deviceBuffers.tasksBuffer, CL_TRUE, 0, tasks.size() * sizeof(cl_uint), tasks.data());
+            verify("Failed to upload replay batch!");
+
+            for (unsigned int it = 0; it < iterations; it++)
+            {
+                // Persistent fetch counters restart with every launch
+                err = cmdQueue.enqueueWriteBuffer(deviceBuffers.queueCounters, CL_TRUE, 0, sizeof(QueueCounters), &cnt);
+                verify("Failed to upload replay queue length!");
+
+                cl::Event event;
+                if (packet)
+                    enqueueWfPrimaryKernel(&event);
+                else
+                    enqueueWfTraceKernel(kernel, &event);
+                verify("Failed to enqueue replay kernel");
+                event.wait();
+
+                cl_ulong t0, t1;
+                clGetEventProfilingInfo(event(), CL_PROFILING_COMMAND_START, sizeof(t0), &t0, NULL);
+                clGetEventProfilingInfo(event(), CL_PROFILING_COMMAND_END, sizeof(t1), &t1, NULL);
+                res.kernelMs += (t1 - t0) / 1e6 / iterations;
+            }
+
+            err = cmdQueue.enqueueReadBuffer(deviceBuffers.tasksBuffer, CL_TRUE, 0, tasks.size() * sizeof(cl_uint), tasks.data());
+            verify("Failed to copy replay results to host!");
+
+            for (cl_uint i = 0; i < n; i++)
+            {
+                if (shadow)
+                {
+                    const cl_uint blocked = u32(offsetof(GPUTaskState, shadowRayBlocked), 0, i);
+                    hash = fnv1a(hash, blocked);
+                    res.numHits += blocked;
+                }
+                else
+                {
+                    const cl_uint tri = u32(offsetof(GPUTaskState, i), 0, i);
+                    hash = fnv1a(hash, tri);
+                    if ((cl_int)tri >= 0)
+                    {
+                        res.numHits++;
+                        res.sumT += getF32(offsetof(GPUTaskState, t), 0, i);
+                    }
+                }
+            }
+        }
+
+        res.checksum = hash;
+        results.push_back(res);
+    }
+
+    enqueueClearWfQueues();
+    return results;
+}
+
 void CLContext::createEnvMap(EnvironmentMap *map)
 {
     int width = map->getWidth(), height = map->getHeight();
@@ -539,48 +873,229 @@ void CLContext::setupScene()
 // Upload BVH data, geometry and materials to GPU
 void CLContext::uploadSceneData(BVH *bvh, Scene *scene)
 {
-    std::vector<RTTriangle> *tris = bvh->m_triangles;
+    uploadGeometry(bvh->m_triangles, scene);
+    uploadHierarchy(bvh, scene);
+
+    // Ensures that the kernels have the correct arguments
+    setupKernels();
+}
+
+// Replaces the hierarchy of the current scene, e.g. with a finished background build.
+// Runs between frames: in-flight work completes before any buffer is replaced,
+// so no kernel sees a mix of old and new hierarchy data.
+void CLContext::swapHierarchy(BVH *bvh, Scene *scene)
+{
+    err = cmdQueue.finish();
+    verify("Failed to finish queue before hierarchy swap!");
+
+    uploadHierarchy(bvh, scene);
+    setupKernels();
+}
+
+// Nodes, indices and the (possibly leaf-ordered) positions they reference
+void CLContext::uploadHierarchy(BVH *bvh, Scene *scene)
+{
     std::vector<cl_uint> *indices = &bvh->m_indices; 
-    std::vector<Node> *nodes = &bvh->m_nodes;
+    size_t i_bytes = indices->size() * sizeof(cl_uint);
+    const bool leafOrder = Settings::getInstance().getBvhLeafOrderTris();
+    refitBaseCost = 0.0f;
+
+    uploadTrianglePositions(*bvh->m_triangles, leafOrder ? indices : nullptr);
+    updateLeafTriangles();
+
+    if (leafOrder)
+    {
+        // Leaves index the positions directly
+        deviceBuffers.indexBuffer = cl::Buffer();
+    }
+    else
+    {
+        deviceBuffers.indexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, i_bytes, NULL, &err);
+        verify("Index buffer creation failed!");
+
+        err = cmdQueue.enqueueWriteBuffer(deviceBuffers.indexBuffer, CL_TRUE, 0, i_bytes, indices->data());
+        verify("Index buffer writing failed!");
+    }
+
+    // Wide and compressed layouts are derived from the binary tree at upload time
+    const unsigned int width = Settings::getInstance().getBvhWidth();
+    const unsigned int quantBits = Settings::getInstance().getBvhQuantBits();
+    if (width == 4)
+    {
+        std::vector<WideNode<4>> wide;
+        updateWideStackSize(bvh->collapse(wide));
+        uploadNodes(wide);
+    }
+    else if (width == 8)
+    {
+        std::vector<WideNode<8>> wide;
+        updateWideStackSize(bvh->collapse(wide));
+        uploadNodes(wide);
+    }
+    else if (quantBits == 8)
+    {
+        std::vector<QuantizedNode<U8>> quantized;
+        bvh->quantize(quantized);
+        uploadNodes(quantized);
+    }
+    else if (quantBits == 16)
+    {
+        std::vector<QuantizedNode<cl_ushort>> quantized;
+        bvh->quantize(quantized);
+        uploadNodes(quantized);
+    }
+    else
+    {
+        // Two-level node buffers have a fixed layout
+        if (!scene->isInstanced())
+            bvh->reorderNodes(Settings::getInstance().getBvhNodeLayout());
+        uploadNodes(bvh->m_nodes);
+    }
+}
+
+// Wide traversal stack sized for this hierarchy, kernels are rebuilt by the following setupKernels()
+void CLContext::updateWideStackSize(cl_uint stackSize)
+{
+    if (stackSize == wideStackSize)
+        return;
+
+    wideStackSize = stackSize;
+    setKernelBuildSettings();
+}
+
+template <typename T>
+void CLContext::uploadNodes(const std::vector<T> &nodes)
+{
+    size_t n_bytes = nodes.size() * sizeof(T);
+
+    // Writable, refits update the boxes in place
+    deviceBuffers.nodeBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, n_bytes, NULL, &err);
+    verify("Node buffer creation failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, n_bytes, nodes.data());
+    verify("Node buffer writing failed!");
+}
+
+// Upload geometry and materials, build hierarchy on device
+// Returns false if the device cannot run the builder
+bool CLContext::buildDeviceHierarchy(Scene *scene, DeviceBuildMode mode, AABB_t &bounds)
+{
+    std::vector<RTTriangle> *tris = &scene->getTriangles();
+    DeviceBVHBuilder &builder = getDeviceBuilder();
+    if (!builder.supported() || tris->size() < 2)
+        return false;
+
+    refitBaseCost = 0.0f;
+    uploadGeometry(tris, scene);
+    uploadTrianglePositions(*tris, nullptr);
+    bounds = builder.build(deviceBuffers.trianglePosBuffer, (cl_uint)tris->size(), mode,
+        deviceBuffers.nodeBuffer, deviceBuffers.indexBuffer, Settings::getInstance().getBvhLeafOrderTris());
+    updateLeafTriangles();
+
+    // Ensures that the kernels have the correct arguments
+    setupKernels();
+
+    return true;
+}
+
+// Refit of the binary hierarchy in device memory after the scene triangles moved.
+// Returns SAH cost relative to the hierarchy before its first refit.
+float CLContext::refitDeviceHierarchy(Scene *scene)
+{
+    std::vector<RTTriangle> *tris = &scene->getTriangles();
+    DeviceBVHBuilder &builder = getDeviceBuilder();
+    if (refitBaseCost == 0.0f)
+        refitBaseCost = builder.sahCost(deviceBuffers.nodeBuffer);
+
+    // Same triangle count, buffers are reused
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.triangleBuffer, CL_TRUE, 0, tris->size() * sizeof(RTTriangle), tris->data());
+    verify("Triangle buffer writing failed!");
+
+    cl::Buffer previous = deviceBuffers.trianglePosBuffer;
+    uploadTrianglePositions(*tris, nullptr);
+    cl::Buffer positions = deviceBuffers.trianglePosBuffer;
+    deviceBuffers.trianglePosBuffer = previous;
+    builder.refit(deviceBuffers.trianglePosBuffer, positions, deviceBuffers.nodeBuffer,
+        deviceBuffers.indexBuffer, Settings::getInstance().getBvhLeafOrderTris());
+    updateLeafTriangles();
+
+    // Position buffer replaced
+    setupKernels();
+
+    return builder.sahCost(deviceBuffers.nodeBuffer) / refitBaseCost;
+}
+
+// Triangles, materials and textures, shared by host and device hierarchies
+void CLContext::uploadGeometry(std::vector<RTTriangle> *tris, Scene *scene)
+{
     std::vector<Material> *materials = &scene->getMaterials();
 
     size_t t_bytes = tris->size() * sizeof(RTTriangle);
-    size_t i_bytes = indices->size() * sizeof(cl_uint);
-    size_t n_bytes = nodes->size() * sizeof(Node);
     size_t m_bytes = materials->size() * sizeof(Material);
 
-    // Allocate memory for buffers
     deviceBuffers.triangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, t_bytes, NULL, &err);
     verify("Triangle buffer creation failed!");
 
-    deviceBuffers.indexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, i_bytes, NULL, &err);
-    verify("Index buffer creation failed!");
-
-    deviceBuffers.nodeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, n_bytes, NULL, &err);
-    verify("Node buffer creation failed!");
-
     if(m_bytes > 0) deviceBuffers.materialBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, m_bytes, NULL, &err);
     verify("Material buffer creation failed!");
 
-
-    // Write data to buffers
     err = cmdQueue.enqueueWriteBuffer(deviceBuffers.triangleBuffer, CL_TRUE, 0, t_bytes, tris->data());
     verify("Triangle buffer writing failed!");
 
-    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.indexBuffer, CL_TRUE, 0, i_bytes, indices->data());
-    verify("Index buffer writing failed!");
-
-    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, n_bytes, nodes->data());
-    verify("Node buffer writing failed!");
-
     if(m_bytes > 0) err = cmdQueue.enqueueWriteBuffer(deviceBuffers.materialBuffer, CL_TRUE, 0, m_bytes, materials->data());
     verify("Material buffer writing failed!");
 
     // Pack texture data into aggregate array
     packTextures(scene);
+}
 
-    // Ensures that the kernels have the correct arguments
-    setupKernels();
+// Compact copy of the positions, the only triangle data touched during traversal.
+// With a leaf order, entries follow the index list (duplicated for SBVH references)
+// and v0.w stores the original triangle index for shading.
+void CLContext::uploadTrianglePositions(const std::vector<RTTriangle> &tris, const std::vector<cl_uint> *leafOrder)
+{
+    const size_t count = leafOrder ? leafOrder->size() : tris.size();
+    std::vector<TrianglePos> positions(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const cl_uint id = leafOrder ? (*leafOrder)[i] : (cl_uint)i;
+        const RTTriangle &t = tris[id];
+        positions[i] = { t.v0.p, t.v1.p, t.v2.p };
+        if (leafOrder)
+            std::memcpy(&positions[i].v0.w, &id, sizeof(cl_uint));
+    }
+
+    size_t p_bytes = positions.size() * sizeof(TrianglePos);
+    deviceBuffers.trianglePosBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, p_bytes, NULL, &err);
+    verify("Triangle position buffer creation failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.trianglePosBuffer, CL_TRUE, 0, p_bytes, positions.data());
+    verify("Triangle position buffer writing failed!");
+}
+
+// Traversal reads the positions directly, or their Woop transform computed on the device.
+// Positions stay resident for device builds and refits.
+void CLContext::updateLeafTriangles()
+{
+    if (Settings::getInstance().getTriangleTest() != TriangleTest::Woop)
+    {
+        deviceBuffers.leafTriangleBuffer = deviceBuffers.trianglePosBuffer;
+        return;
+    }
+
+    const cl_uint n = (cl_uint)(deviceBuffers.trianglePosBuffer.getInfo<CL_MEM_SIZE>() / sizeof(TrianglePos));
+    deviceBuffers.leafTriangleBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(TriangleWoop), NULL, &err);
+    verify("Woop triangle buffer creation failed!");
+
+    if (!woop_triangles)
+        woop_triangles = new LBVHKernel(getLBVHProgram(), "woopTriangles");
+
+    err = 0;
+    err |= woop_triangles->setArg("triPos", deviceBuffers.trianglePosBuffer);
+    err |= woop_triangles->setArg("woop", deviceBuffers.leafTriangleBuffer);
+    err |= woop_triangles->setArg("n", n);
+    err |= cmdQueue.enqueueNDRangeKernel(*woop_triangles, cl::NullRange, cl::NDRange(n), cl::NullRange);
+    verify("Failed to enqueue woopTriangles");
 }
 
 // Upload texture data to GPU
@@ -793,18 +1308,72 @@ void CLContext::enqueueWfRaygenKernel(const RenderParams & params)
     verify("Failed to enqueue wf_raygen");
 }
 
+// Queue => coherent order: keys from ray octant and origin, device radix sort, sorted path indices copied back.
+// Only the queued entries are sorted, lengths are read by enqueueWfExtRayKernel.
+void CLContext::enqueueWfSortRays(bool shadowRays)
+{
+    const cl_uint len = (shadowRays) ? sortQueueLens.shadowQueue : sortQueueLens.extensionQueue;
+    if (len < MinSortedRays)
+        return;
+
+    cl::Buffer &queue = (shadowRays) ? deviceBuffers.shadowQueue : deviceBuffers.extensionQueue;
+    err = 0;
+    err |= wf_ray_keys->setArg("queue", queue);
+    err |= wf_ray_keys->setArg("shadowRays", (cl_uint)shadowRays);
+    err |= cmdQueue.enqueueNDRangeKernel(*wf_ray_keys, cl::NullRange, cl::NDRange(len), cl::NullRange);
+    verify("Failed to enqueue wf_ray_keys");
+
+    // 30-bit keys need all eight passes
+    raySorter->sort(deviceBuffers.rayKeys, deviceBuffers.rayValues, len, DeviceBVHBuilder::SortPasses);
+
+    err = cmdQueue.enqueueCopyBuffer(deviceBuffers.rayValues[0], queue, 0, 0, len * sizeof(cl_uint));
+    verify("Failed to enqueue sorted queue copy");
+}
+
+// Packet mode: new paths are not in the extension queue, traced here tile by tile
 void CLContext::enqueueWfExtRayKernel(const RenderParams & params)
 {
-    err = cmdQueue.enqueueNDRangeKernel(*wf_extension, cl::NullRange, cl::NDRange(NUM_TASKS), cl::NullRange, 0, &extRayEvent);
+    if (wf_primary)
+    {
+        enqueueWfPrimaryKernel(nullptr);
+        verify("Failed to enqueue wf_primary");
+    }
+
+    if (raySorter)
+    {
+        // Queues are final here, one blocking read covers both sorts of this segment
+        err = cmdQueue.enqueueReadBuffer(deviceBuffers.queueCounters, CL_TRUE, 0, sizeof(QueueCounters), &sortQueueLens);
+        verify("Failed to read queue lengths for sorting");
+        enqueueWfSortRays(false);
+    }
+    enqueueWfTraceKernel(wf_extension, &extRayEvent);
     verify("Failed to enqueue wf_extension");
 }
 
 void CLContext::enqueueWfShadowRayKernel(const RenderParams & params)
 {
-    err = cmdQueue.enqueueNDRangeKernel(*wf_shadow, cl::NullRange, cl::NDRange(NUM_TASKS), cl::NullRange, 0, &shdwRayEvent);
+    if (raySorter)
+        enqueueWfSortRays(true);
+    enqueueWfTraceKernel(wf_shadow, &shdwRayEvent);
     verify("Failed to enqueue wf_shadow");
 }
 
+// Persistent kernels drain the queue with a fixed launch, otherwise one work-item per task
+void CLContext::enqueueWfPrimaryKernel(cl::Event *event)
+{
+    const size_t packetSize = PACKET_TILE * PACKET_TILE;
+    const size_t globalSize = ((NUM_TASKS - 1) / packetSize + 1) * packetSize;
+    err = cmdQueue.enqueueNDRangeKernel(*wf_primary, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(packetSize), 0, event);
+}
+
+void CLContext::enqueueWfTraceKernel(clt::Kernel *kernel, cl::Event *event)
+{
+    if (persistentGlobalSize > 0)
+        err = cmdQueue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(persistentGlobalSize), cl::NDRange(persistentLocalSize), 0, event);
+    else
+        err = cmdQueue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(NUM_TASKS), cl::NullRange, 0, event);
+}
+
 void CLContext::enqueueWfLogicKernel(const RenderParams& params, const bool firstIteration)
 {
     cl_uint numElems = ((NUM_TASKS - 1) / 32 + 1) * 32;
@@ -890,6 +1459,24 @@ void CLContext::recompileKernels(bool setArgs)
     wf_ggx_refr->rebuild(setArgs);
     wf_delta->rebuild(setArgs);
     wf_emissive->rebuild(setArgs);
+    if (wf_ray_keys)
+        wf_ray_keys->rebuild(setArgs);
+    if (wf_primary)
+        wf_primary->rebuild(setArgs);
+
+    // Kernels of the shared lbvh.cl program are recreated after an edit
+    if (lbvhProgram && lbvhProgram->rebuild())
+    {
+        delete woop_triangles;
+        woop_triangles = nullptr; // recreated by the next updateLeafTriangles()
+        delete deviceBuilder;
+        deviceBuilder = nullptr;
+        if (raySorter)
+        {
+            delete raySorter;
+            raySorter = new DeviceRadixSort(context, device, cmdQueue, *lbvhProgram);
+        }
+    }
 
     mk_reset->rebuild(setArgs);
     mk_raygen->rebuild(setArgs);
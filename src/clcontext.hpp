@@ -6,6 +6,8 @@
 
 #include "cl2.hpp"
 #include "geom.h"
+#include "rtutil.hpp"
+#include "raydump.hpp"
 #include <clt.hpp>
 #include <string>
 
@@ -22,6 +24,10 @@ class EnvironmentMap;
 class BVH;
 class Scene;
 class PTWindow;
+class DeviceRadixSort;
+class DeviceBVHBuilder;
+class LBVHProgram;
+class LBVHKernel;
 
 class CLContext
 {
@@ -73,13 +79,26 @@ public:
 
     void updateParams(const RenderParams &params);
     void uploadSceneData(BVH *bvh, Scene *scene);
+    void swapHierarchy(BVH *bvh, Scene *scene);
+    bool buildDeviceHierarchy(Scene *scene, DeviceBuildMode mode, AABB_t &bounds);
+    float refitDeviceHierarchy(Scene *scene);
     void setupPixelStorage(PTWindow *window);
     void saveImage(std::string filename, const RenderParams &params);
+    void saveTraversalStats(std::string filename, const RenderParams &params);
+    void captureRays(RayDump &dump); // queued extension and shadow rays, call before tracing them
+    std::vector<RayReplayResult> replayRays(const RayDump &dump, unsigned int iterations); // clobbers path state
     void createEnvMap(EnvironmentMap *map);
 private:
     void setupScene();
     void verify(std::string msg, int pred = -1);
     void packTextures(Scene *scene);
+    void uploadGeometry(std::vector<RTTriangle> *tris, Scene *scene);
+    void uploadHierarchy(BVH *bvh, Scene *scene);
+    void updateWideStackSize(cl_uint stackSize);
+    void uploadTrianglePositions(const std::vector<RTTriangle> &tris, const std::vector<cl_uint> *leafOrder);
+    void updateLeafTriangles();
+    template <typename T>
+    void uploadNodes(const std::vector<T> &nodes);
 
     void enqueueWfDiffuseKernel(const RenderParams &params);
     void enqueueWfGlossyKernel(const RenderParams &params);
@@ -110,12 +129,28 @@ private:
     void setupWfDeltaKernel();
     void setupWfEmissiveKernel();
     void setupWfAllMaterialsKernel();
+    void setupWfSortKernels();
+    void setupWfPrimaryKernel();
+    void setupPersistentLaunch();
+    void enqueueWfTraceKernel(clt::Kernel *kernel, cl::Event *event);
+    void enqueueWfPrimaryKernel(cl::Event *event);
+    void enqueueWfSortRays(bool shadowRays);
     void initMCBuffers();
 
     void setKernelBuildSettings();
+    LBVHProgram &getLBVHProgram();
+    DeviceBVHBuilder &getDeviceBuilder();
 
     int err;                // error code returned from api calls
     cl_uint NUM_TASKS = 0;  // the amount of paths in flight simultaneously, limited by VRAM, defined in settings
+    float refitBaseCost = 0.0f; // device hierarchy SAH cost before its first refit
+    std::string kernelBuildOptions; // global options, also used for lbvh.cl
+    cl_uint wideStackSize = 0;      // traversal stack entries needed by the uploaded wide hierarchy
+    static const size_t PersistentGroupsPerUnit = 16;
+    size_t persistentGlobalSize = 0; // 0 = persistent traversal disabled
+    size_t persistentLocalSize = 0;
+    static const cl_uint MinSortedRays = 8192; // shorter queues are traced unsorted
+    QueueCounters sortQueueLens = {};  // read before the extension rays of each segment
 
     // For showing progress
     PTWindow *window;
@@ -127,6 +162,7 @@ private:
     
     // General kernels
     clt::Kernel* kernel_pick = nullptr;
+    LBVHKernel* woop_triangles = nullptr; // precomputed triangle tests
     clt::Kernel* mk_postprocess = nullptr;
 
     // Luxrender-style microkernels
@@ -150,6 +186,13 @@ private:
     clt::Kernel* wf_delta = nullptr;
     clt::Kernel* wf_emissive = nullptr;
     clt::Kernel* wf_mat_all = nullptr;
+    clt::Kernel* wf_ray_keys = nullptr;
+    clt::Kernel* wf_primary = nullptr;  // optional packet traversal of camera rays
+    DeviceRadixSort* raySorter = nullptr; // optional queue reordering
+
+    // lbvh.cl, shared by the device builder, ray sort and woop_triangles
+    LBVHProgram* lbvhProgram = nullptr;
+    DeviceBVHBuilder* deviceBuilder = nullptr; // kept for refits
 
     
     // Device memory shared with GL
@@ -181,10 +224,14 @@ public:
         cl::Buffer emissiveMatQueue;
         cl::Buffer currentPixelIdx; // points to next pixel, since NUM_TASKS != #pixels
         cl::Buffer queueCounters;   // atomic counters keeping track of queue lengths
+        cl::Buffer rayKeys[2];      // queue reordering, sort ping-pong buffers
+        cl::Buffer rayValues[2];
         cl::Buffer samplesPerPixel;
 
         // Variables from BVH
-        cl::Buffer triangleBuffer;
+        cl::Buffer triangleBuffer;    // shading attributes
+        cl::Buffer trianglePosBuffer; // positions, read by the device builders
+        cl::Buffer leafTriangleBuffer; // read by traversal: positions or their Woop transform
         cl::Buffer nodeBuffer;
         cl::Buffer indexBuffer;
         cl::Buffer materialBuffer;
@@ -199,6 +246,7 @@ public:
 
         // Statistics
         cl::Buffer renderStats;  // ray + sample counts
+        cl::Buffer traversalStats; // node visits + triangle tests per pixel (wavefront only)
 
         // Pixel storage
         cl::Buffer pixelBuffer;     // raw (linear) pixel data, not used by OpenGL
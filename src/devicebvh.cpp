@@ -0,0 +1,462 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "devicebvh.hpp"
+#include "utils.h"
+#include "geom.h"
+
+static std::string readLBVHSource()
+{
+    std::ifstream f("src/lbvh.cl");
+    if (!f)
+        throw std::runtime_error("Could not open src/lbvh.cl");
+
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+LBVHProgram::LBVHProgram(cl::Context &context, cl::Device &device, const std::string &buildOptions)
+    : context(context), device(device), options(buildOptions)
+{
+    source = readLBVHSource();
+    build();
+}
+
+bool LBVHProgram::rebuild()
+{
+    std::string current = readLBVHSource();
+    if (current == source)
+        return false;
+
+    source = current;
+    build();
+    return true;
+}
+
+void LBVHProgram::build()
+{
+    int err = 0;
+    program = cl::Program(context, source, false, &err);
+    clt::check(err, "lbvh.cl program creation failed");
+
+    err = program.build({ device }, options.c_str());
+    if (err != CL_SUCCESS)
+        std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+    clt::check(err, "lbvh.cl build failed");
+}
+
+// Same by-name binding as clt::Kernel, needs -cl-kernel-arg-info
+LBVHKernel::LBVHKernel(const LBVHProgram &program, const char *name)
+{
+    int err = 0;
+    cl::Kernel::operator=(cl::Kernel(program.get(), name, &err));
+    clt::check(err, "lbvh.cl kernel creation failed");
+
+    const cl_uint numArgs = getInfo<CL_KERNEL_NUM_ARGS>();
+    for (cl_uint i = 0; i < numArgs; i++)
+    {
+        std::string argName = getArgInfo<CL_KERNEL_ARG_NAME>(i);
+        argName.erase(argName.find_last_not_of('\0') + 1); // some drivers include the terminator
+        argIndices[argName] = i;
+    }
+}
+
+DeviceBVHBuilder::DeviceBVHBuilder(cl::Context &context, cl::Device &device, cl::CommandQueue &cmdQueue, const LBVHProgram &program)
+    : context(context), device(device), cmdQueue(cmdQueue)
+{
+    centroidBounds = new LBVHKernel(program, "centroidBounds");
+    reduceBounds = new LBVHKernel(program, "reduceBounds");
+    mortonCodes = new LBVHKernel(program, "mortonCodes");
+    scanExclusive = new LBVHKernel(program, "scanExclusive");
+    lbvhEmit = new LBVHKernel(program, "lbvhEmit");
+    leafBounds = new LBVHKernel(program, "leafBounds");
+    lbvhFitBounds = new LBVHKernel(program, "lbvhFitBounds");
+    plocInit = new LBVHKernel(program, "plocInit");
+    plocNearestNeighbor = new LBVHKernel(program, "plocNearestNeighbor");
+    plocMerge = new LBVHKernel(program, "plocMerge");
+    plocCompact = new LBVHKernel(program, "plocCompact");
+    computeLayout = new LBVHKernel(program, "computeLayout");
+    writeNodes = new LBVHKernel(program, "writeNodes");
+    gatherLeafOrder = new LBVHKernel(program, "gatherLeafOrder");
+    refitNodes = new LBVHKernel(program, "refitNodes");
+    refreshLeafOrder = new LBVHKernel(program, "refreshLeafOrder");
+    nodeCost = new LBVHKernel(program, "nodeCost");
+
+    sorter = new DeviceRadixSort(context, device, cmdQueue, program);
+}
+
+DeviceBVHBuilder::~DeviceBVHBuilder()
+{
+    for (LBVHKernel *k : { centroidBounds, reduceBounds, mortonCodes, scanExclusive,
+                           lbvhEmit, leafBounds, lbvhFitBounds, plocInit, plocNearestNeighbor, plocMerge,
+                           plocCompact, computeLayout, writeNodes, gatherLeafOrder, refitNodes,
+                           refreshLeafOrder, nodeCost })
+    {
+        delete k;
+    }
+    delete sorter;
+}
+
+bool DeviceBVHBuilder::supported() const
+{
+    return sorter->supported();
+}
+
+void DeviceBVHBuilder::dispatch(LBVHKernel *kernel, size_t numItems)
+{
+    const size_t globalSize = (numItems + GroupSize - 1) / GroupSize * GroupSize;
+    int err = cmdQueue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(GroupSize));
+    clt::check(err, "Device BVH kernel dispatch failed");
+}
+
+AABB_t DeviceBVHBuilder::build(cl::Buffer &triPos, cl_uint numTris, DeviceBuildMode mode, cl::Buffer &nodes, cl::Buffer &indices, bool leafOrder)
+{
+    if (numTris < 2)
+        throw std::runtime_error("Device BVH builder needs at least two triangles");
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    const cl_uint n = numTris;
+    const cl_uint numNodes = 2 * n - 1;
+
+    int err = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        buffers.keys[i] = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &err);
+        buffers.values[i] = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &err);
+    }
+    buffers.total = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    buffers.childLeft = cl::Buffer(context, CL_MEM_READ_WRITE, (n - 1) * sizeof(cl_int), NULL, &err);
+    buffers.childRight = cl::Buffer(context, CL_MEM_READ_WRITE, (n - 1) * sizeof(cl_int), NULL, &err);
+    buffers.parents = cl::Buffer(context, CL_MEM_READ_WRITE, numNodes * sizeof(cl_int), NULL, &err);
+    buffers.boxes = cl::Buffer(context, CL_MEM_READ_WRITE, numNodes * sizeof(AABB), NULL, &err);
+    buffers.sizes = cl::Buffer(context, CL_MEM_READ_WRITE, numNodes * sizeof(cl_uint), NULL, &err);
+    buffers.positions = cl::Buffer(context, CL_MEM_READ_WRITE, numNodes * sizeof(cl_uint), NULL, &err);
+    nodes = cl::Buffer(context, CL_MEM_READ_WRITE, numNodes * sizeof(GPUNode), NULL, &err);
+    clt::check(err, "Device BVH buffer creation failed");
+
+    // Centroid bounds => Morton codes
+    cl::Buffer bounds(context, CL_MEM_READ_WRITE, BoundsGroups * sizeof(AABB), NULL, &err);
+    clt::check(err, "Device BVH bounds buffer creation failed");
+
+    err |= centroidBounds->setArg("triPos", triPos);
+    err |= centroidBounds->setArg("groupBounds", bounds);
+    err |= centroidBounds->setArg("n", n);
+    err |= reduceBounds->setArg("bounds", bounds);
+    err |= reduceBounds->setArg("count", (cl_uint)BoundsGroups);
+    err |= mortonCodes->setArg("triPos", triPos);
+    err |= mortonCodes->setArg("sceneBounds", bounds);
+    err |= mortonCodes->setArg("keys", buffers.keys[0]);
+    err |= mortonCodes->setArg("values", buffers.values[0]);
+    err |= mortonCodes->setArg("n", n);
+    clt::check(err, "Failed to set Morton code arguments");
+
+    dispatch(centroidBounds, BoundsGroups * GroupSize);
+    dispatch(reduceBounds, GroupSize);
+    dispatch(mortonCodes, n);
+
+    sorter->sort(buffers.keys, buffers.values, n, SortPasses);
+
+    // Leaves reference sorted triangles
+    err |= leafBounds->setArg("triPos", triPos);
+    err |= leafBounds->setArg("values", buffers.values[0]);
+    err |= leafBounds->setArg("boxes", buffers.boxes);
+    err |= leafBounds->setArg("sizes", buffers.sizes);
+    err |= leafBounds->setArg("n", n);
+    clt::check(err, "Failed to set leaf bound arguments");
+    dispatch(leafBounds, n);
+
+    if (mode == DeviceBuildMode::PLOC)
+        buildPLOC(n);
+    else
+        buildLBVH(n);
+
+    // Depth-first layout
+    err |= computeLayout->setArg("childLeft", buffers.childLeft);
+    err |= computeLayout->setArg("parents", buffers.parents);
+    err |= computeLayout->setArg("sizes", buffers.sizes);
+    err |= computeLayout->setArg("positions", buffers.positions);
+    err |= computeLayout->setArg("numNodes", numNodes);
+    err |= writeNodes->setArg("childLeft", buffers.childLeft);
+    err |= writeNodes->setArg("childRight", buffers.childRight);
+    err |= writeNodes->setArg("parents", buffers.parents);
+    err |= writeNodes->setArg("boxes", buffers.boxes);
+    err |= writeNodes->setArg("positions", buffers.positions);
+    err |= writeNodes->setArg("nodes", nodes);
+    err |= writeNodes->setArg("n", n);
+    clt::check(err, "Failed to set node output arguments");
+
+    dispatch(computeLayout, numNodes);
+    dispatch(writeNodes, numNodes);
+
+    // Sorted triangle indices double as the index list
+    indices = buffers.values[0];
+
+    // Or replace the positions with a leaf-ordered copy
+    if (leafOrder)
+    {
+        cl::Buffer ordered(context, CL_MEM_READ_ONLY, n * sizeof(TrianglePos), NULL, &err);
+        clt::check(err, "Leaf-ordered triangle buffer creation failed");
+        err |= gatherLeafOrder->setArg("triPos", triPos);
+        err |= gatherLeafOrder->setArg("values", buffers.values[0]);
+        err |= gatherLeafOrder->setArg("ordered", ordered);
+        err |= gatherLeafOrder->setArg("n", n);
+        clt::check(err, "Failed to set leaf order arguments");
+        dispatch(gatherLeafOrder, n);
+
+        triPos = ordered;
+        indices = cl::Buffer();
+    }
+
+    AABB_t sceneBounds;
+    err = cmdQueue.enqueueReadBuffer(nodes, CL_TRUE, 0, sizeof(AABB), &sceneBounds);
+    clt::check(err, "Failed to read device BVH bounds");
+
+    buffers = decltype(buffers)();
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::cout
+        << "======================" << std::endl
+        << ((mode == DeviceBuildMode::PLOC) ? "Device PLOC" : "Device LBVH") << std::endl
+        << "Nodes: " << numNodes << std::endl
+        << "Time: " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl
+        << "======================" << std::endl;
+
+    return sceneBounds;
+}
+
+void DeviceBVHBuilder::refit(cl::Buffer &triPos, cl::Buffer &newPos, cl::Buffer &nodes, cl::Buffer &indices, bool leafOrder)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    const cl_uint numNodes = (cl_uint)(nodes.getInfo<CL_MEM_SIZE>() / sizeof(GPUNode));
+    const cl_uint numPos = (cl_uint)(triPos.getInfo<CL_MEM_SIZE>() / sizeof(TrianglePos));
+
+    int err = 0;
+    if (leafOrder)
+    {
+        cl::Buffer ordered(context, CL_MEM_READ_ONLY, numPos * sizeof(TrianglePos), NULL, &err);
+        clt::check(err, "Leaf-ordered triangle buffer creation failed");
+        err |= refreshLeafOrder->setArg("source", newPos);
+        err |= refreshLeafOrder->setArg("previous", triPos);
+        err |= refreshLeafOrder->setArg("ordered", ordered);
+        err |= refreshLeafOrder->setArg("n", numPos);
+        clt::check(err, "Failed to set leaf order arguments");
+        dispatch(refreshLeafOrder, numPos);
+        triPos = ordered;
+    }
+    else
+    {
+        triPos = newPos;
+    }
+
+    cl::Buffer visited(context, CL_MEM_READ_WRITE, numNodes * sizeof(cl_uint), NULL, &err);
+    clt::check(err, "Device BVH visit flag creation failed");
+    err = cmdQueue.enqueueFillBuffer(visited, (cl_uint)0, 0, numNodes * sizeof(cl_uint));
+    clt::check(err, "Failed to clear device BVH visit flags");
+
+    err |= refitNodes->setArg("triPos", triPos);
+    err |= refitNodes->setArg("indices", indices);
+    err |= refitNodes->setArg("nodes", nodes);
+    err |= refitNodes->setArg("visited", visited);
+    err |= refitNodes->setArg("leafOrder", (cl_uint)leafOrder);
+    err |= refitNodes->setArg("numNodes", numNodes);
+    clt::check(err, "Failed to set refit arguments");
+    dispatch(refitNodes, numNodes);
+
+    err = cmdQueue.finish();
+    clt::check(err, "Device BVH refit failed");
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::cout << "Device BVH refit: " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+}
+
+F32 DeviceBVHBuilder::sahCost(cl::Buffer &nodes)
+{
+    const cl_uint numNodes = (cl_uint)(nodes.getInfo<CL_MEM_SIZE>() / sizeof(GPUNode));
+
+    int err = 0;
+    cl::Buffer groupCosts(context, CL_MEM_READ_WRITE, BoundsGroups * sizeof(cl_float), NULL, &err);
+    clt::check(err, "Device BVH cost buffer creation failed");
+
+    err |= nodeCost->setArg("nodes", nodes);
+    err |= nodeCost->setArg("groupCosts", groupCosts);
+    err |= nodeCost->setArg("costBox", 1.0f);
+    err |= nodeCost->setArg("costTri", 1.0f);
+    err |= nodeCost->setArg("numNodes", numNodes);
+    clt::check(err, "Failed to set node cost arguments");
+    dispatch(nodeCost, BoundsGroups * GroupSize);
+
+    std::vector<cl_float> costs(BoundsGroups);
+    AABB_t rootBox;
+    err = cmdQueue.enqueueReadBuffer(groupCosts, CL_FALSE, 0, BoundsGroups * sizeof(cl_float), costs.data());
+    err |= cmdQueue.enqueueReadBuffer(nodes, CL_TRUE, 0, sizeof(AABB), &rootBox);
+    clt::check(err, "Failed to read device BVH cost");
+
+    F32 cost = 0.0f;
+    for (cl_float c : costs)
+        cost += c;
+    return cost / (0.5f * rootBox.area()); // kernel uses half area
+}
+
+// Topology straight from the sorted Morton codes
+void DeviceBVHBuilder::buildLBVH(cl_uint n)
+{
+    int err = 0;
+    cl::Buffer visited(context, CL_MEM_READ_WRITE, (n - 1) * sizeof(cl_uint), NULL, &err);
+    clt::check(err, "Device BVH visit flag creation failed");
+    err = cmdQueue.enqueueFillBuffer(visited, (cl_uint)0, 0, (n - 1) * sizeof(cl_uint));
+    clt::check(err, "Failed to clear device BVH visit flags");
+
+    err |= lbvhEmit->setArg("keys", buffers.keys[0]);
+    err |= lbvhEmit->setArg("childLeft", buffers.childLeft);
+    err |= lbvhEmit->setArg("childRight", buffers.childRight);
+    err |= lbvhEmit->setArg("parents", buffers.parents);
+    err |= lbvhEmit->setArg("n", n);
+    err |= lbvhFitBounds->setArg("childLeft", buffers.childLeft);
+    err |= lbvhFitBounds->setArg("childRight", buffers.childRight);
+    err |= lbvhFitBounds->setArg("parents", buffers.parents);
+    err |= lbvhFitBounds->setArg("boxes", buffers.boxes);
+    err |= lbvhFitBounds->setArg("sizes", buffers.sizes);
+    err |= lbvhFitBounds->setArg("visited", visited);
+    err |= lbvhFitBounds->setArg("n", n);
+    clt::check(err, "Failed to set LBVH arguments");
+
+    dispatch(lbvhEmit, n - 1);
+    dispatch(lbvhFitBounds, n);
+}
+
+// Agglomerative clustering of Morton-ordered leaves, merges mutual nearest neighbors
+void DeviceBVHBuilder::buildPLOC(cl_uint n)
+{
+    int err = 0;
+    cl::Buffer clusters[2];
+    clusters[0] = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int), NULL, &err);
+    clusters[1] = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int), NULL, &err);
+    cl::Buffer neighbors(context, CL_MEM_READ_WRITE, n * sizeof(cl_int), NULL, &err);
+    cl::Buffer offsets(context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &err);
+    cl::Buffer nodeCounter(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    clt::check(err, "PLOC buffer creation failed");
+    err = cmdQueue.enqueueFillBuffer(nodeCounter, (cl_uint)0, 0, sizeof(cl_uint));
+    clt::check(err, "Failed to clear PLOC node counter");
+
+    err |= plocInit->setArg("clusters", clusters[0]);
+    err |= plocInit->setArg("n", n);
+    clt::check(err, "Failed to set PLOC init arguments");
+    dispatch(plocInit, n);
+
+    cl_uint count = n;
+    int src = 0;
+    while (count > 1)
+    {
+        err |= plocNearestNeighbor->setArg("clusters", clusters[src]);
+        err |= plocNearestNeighbor->setArg("boxes", buffers.boxes);
+        err |= plocNearestNeighbor->setArg("neighbors", neighbors);
+        err |= plocNearestNeighbor->setArg("count", count);
+        err |= plocNearestNeighbor->setArg("radius", (cl_uint)PlocRadius);
+        err |= plocMerge->setArg("clusters", clusters[src]);
+        err |= plocMerge->setArg("neighbors", neighbors);
+        err |= plocMerge->setArg("boxes", buffers.boxes);
+        err |= plocMerge->setArg("sizes", buffers.sizes);
+        err |= plocMerge->setArg("childLeft", buffers.childLeft);
+        err |= plocMerge->setArg("childRight", buffers.childRight);
+        err |= plocMerge->setArg("parents", buffers.parents);
+        err |= plocMerge->setArg("valid", offsets);
+        err |= plocMerge->setArg("nodeCounter", nodeCounter);
+        err |= plocMerge->setArg("count", count);
+        err |= scanExclusive->setArg("data", offsets);
+        err |= scanExclusive->setArg("total", buffers.total);
+        err |= scanExclusive->setArg("count", count);
+        err |= plocCompact->setArg("clustersIn", clusters[src]);
+        err |= plocCompact->setArg("clustersOut", clusters[src ^ 1]);
+        err |= plocCompact->setArg("neighbors", neighbors);
+        err |= plocCompact->setArg("offsets", offsets);
+        err |= plocCompact->setArg("count", count);
+        clt::check(err, "Failed to set PLOC arguments");
+
+        dispatch(plocNearestNeighbor, count);
+        dispatch(plocMerge, count);
+        dispatch(scanExclusive, GroupSize);
+        dispatch(plocCompact, count);
+
+        err = cmdQueue.enqueueReadBuffer(buffers.total, CL_TRUE, 0, sizeof(cl_uint), &count);
+        clt::check(err, "Failed to read PLOC cluster count");
+        src ^= 1;
+    }
+}
+
+DeviceRadixSort::DeviceRadixSort(cl::Context &context, cl::Device &device, cl::CommandQueue &cmdQueue, const LBVHProgram &program)
+    : context(context), device(device), cmdQueue(cmdQueue)
+{
+    radixHistogram = new LBVHKernel(program, "radixHistogram");
+    scanExclusive = new LBVHKernel(program, "scanExclusive");
+    radixScatter = new LBVHKernel(program, "radixScatter");
+
+    int err = 0;
+    total = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    clt::check(err, "Radix sort buffer creation failed");
+}
+
+DeviceRadixSort::~DeviceRadixSort()
+{
+    for (LBVHKernel *k : { radixHistogram, scanExclusive, radixScatter })
+        delete k;
+}
+
+bool DeviceRadixSort::supported() const
+{
+    const size_t GroupSize = DeviceBVHBuilder::GroupSize;
+    if (device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() < GroupSize)
+        return false;
+
+    // Local memory use of the scatter kernel can lower the limit further
+    const cl::Kernel &scatter = *radixScatter;
+    return scatter.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) >= GroupSize;
+}
+
+void DeviceRadixSort::sort(cl::Buffer *keys, cl::Buffer *values, cl_uint n, cl_uint passes)
+{
+    const cl_uint GroupSize = DeviceBVHBuilder::GroupSize;
+    const cl_uint sortGroups = (n + GroupSize - 1) / GroupSize;
+    const cl_uint histSize = DeviceBVHBuilder::RadixBins * sortGroups;
+    const size_t globalSize = sortGroups * GroupSize;
+
+    int err = 0;
+    if (histSize > histCapacity)
+    {
+        hist = cl::Buffer(context, CL_MEM_READ_WRITE, histSize * sizeof(cl_uint), NULL, &err);
+        clt::check(err, "Radix sort histogram creation failed");
+        histCapacity = histSize;
+    }
+
+    // LSD radix sort, ping-pong between key/value buffers
+    for (cl_uint pass = 0; pass < passes; pass++)
+    {
+        const cl_uint shift = pass * DeviceBVHBuilder::RadixBits;
+        const int src = pass & 1;
+        const int dst = src ^ 1;
+
+        err |= radixHistogram->setArg("keys", keys[src]);
+        err |= radixHistogram->setArg("hist", hist);
+        err |= radixHistogram->setArg("n", n);
+        err |= radixHistogram->setArg("shift", shift);
+        err |= scanExclusive->setArg("data", hist);
+        err |= scanExclusive->setArg("total", total);
+        err |= scanExclusive->setArg("count", histSize);
+        err |= radixScatter->setArg("keysIn", keys[src]);
+        err |= radixScatter->setArg("valuesIn", values[src]);
+        err |= radixScatter->setArg("keysOut", keys[dst]);
+        err |= radixScatter->setArg("valuesOut", values[dst]);
+        err |= radixScatter->setArg("hist", hist);
+        err |= radixScatter->setArg("n", n);
+        err |= radixScatter->setArg("shift", shift);
+        clt::check(err, "Failed to set radix sort arguments");
+
+        err |= cmdQueue.enqueueNDRangeKernel(*radixHistogram, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(GroupSize));
+        err |= cmdQueue.enqueueNDRangeKernel(*scanExclusive, cl::NullRange, cl::NDRange(GroupSize), cl::NDRange(GroupSize));
+        err |= cmdQueue.enqueueNDRangeKernel(*radixScatter, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(GroupSize));
+        clt::check(err, "Radix sort dispatch failed");
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "cl2.hpp"
+#include "rtutil.hpp"
+#include <clt.hpp>
+#include <map>
+#include <string>
+
+class DeviceRadixSort;
+
+// lbvh.cl compiled into one program, shared by the hierarchy builder,
+// the radix sort and the triangle precomputation kernel
+class LBVHProgram
+{
+public:
+    LBVHProgram(cl::Context &context, cl::Device &device, const std::string &buildOptions);
+
+    // Recompiles if lbvh.cl was edited, kernels created from the old program must then be recreated
+    bool rebuild();
+
+    const cl::Program &get() const { return program; }
+
+private:
+    void build();
+
+    cl::Context &context;
+    cl::Device &device;
+    cl::Program program;
+    std::string options;
+    std::string source;
+};
+
+// Kernel of the shared program, arguments set by name like clt::Kernel
+class LBVHKernel : public cl::Kernel
+{
+public:
+    LBVHKernel(const LBVHProgram &program, const char *name);
+
+    template<typename T>
+    int setArg(const std::string &name, const T &value)
+    {
+        auto it = argIndices.find(name);
+        if (it == argIndices.end())
+            return CL_INVALID_ARG_INDEX;
+        return cl::Kernel::setArg(it->second, value);
+    }
+
+private:
+    std::map<std::string, cl_uint> argIndices;
+};
+
+// Builds the hierarchy on the OpenCL device from triangles already in device memory.
+// Output matches the host builders' GPUNode / index layout, with one triangle per leaf.
+class DeviceBVHBuilder
+{
+public:
+    enum {
+        GroupSize = 256,   // must match GROUP_SIZE in lbvh.cl
+        RadixBins = 16,
+        RadixBits = 4,
+        SortPasses = 8,    // 30-bit keys, even count => result ends in first buffer
+        BoundsGroups = 64,
+        PlocRadius = 16
+    };
+
+    DeviceBVHBuilder(cl::Context &context, cl::Device &device, cl::CommandQueue &cmdQueue, const LBVHProgram &program);
+    ~DeviceBVHBuilder();
+
+    // False if the device cannot run GroupSize work-groups
+    bool supported() const;
+
+    // Allocates and fills 'nodes' and 'indices', returns scene bounds.
+    // With leafOrder, 'triPos' is replaced by a leaf-ordered copy and no index list is produced.
+    AABB_t build(cl::Buffer &triPos, cl_uint numTris, DeviceBuildMode mode, cl::Buffer &nodes, cl::Buffer &indices, bool leafOrder = false);
+
+    // Refits existing binary nodes (any layout) to 'newPos', which replaces 'triPos'
+    // (as a leaf-ordered copy with leafOrder). Topology is kept.
+    void refit(cl::Buffer &triPos, cl::Buffer &newPos, cl::Buffer &nodes, cl::Buffer &indices, bool leafOrder);
+
+    // SAH cost normalized by root area
+    F32 sahCost(cl::Buffer &nodes);
+
+private:
+    void dispatch(LBVHKernel *kernel, size_t numItems);
+    void buildLBVH(cl_uint n);
+    void buildPLOC(cl_uint n);
+
+    cl::Context &context;
+    cl::Device &device;
+    cl::CommandQueue &cmdQueue;
+    DeviceRadixSort *sorter = nullptr;
+
+    LBVHKernel *centroidBounds = nullptr;
+    LBVHKernel *reduceBounds = nullptr;
+    LBVHKernel *mortonCodes = nullptr;
+    LBVHKernel *scanExclusive = nullptr;
+    LBVHKernel *lbvhEmit = nullptr;
+    LBVHKernel *leafBounds = nullptr;
+    LBVHKernel *lbvhFitBounds = nullptr;
+    LBVHKernel *plocInit = nullptr;
+    LBVHKernel *plocNearestNeighbor = nullptr;
+    LBVHKernel *plocMerge = nullptr;
+    LBVHKernel *plocCompact = nullptr;
+    LBVHKernel *computeLayout = nullptr;
+    LBVHKernel *writeNodes = nullptr;
+    LBVHKernel *gatherLeafOrder = nullptr;
+    LBVHKernel *refitNodes = nullptr;
+    LBVHKernel *refreshLeafOrder = nullptr;
+    LBVHKernel *nodeCost = nullptr;
+
+    // Scratch, only alive during build()
+    struct
+    {
+        cl::Buffer keys[2];
+        cl::Buffer values[2];
+        cl::Buffer total;
+        cl::Buffer childLeft;
+        cl::Buffer childRight;
+        cl::Buffer parents;
+        cl::Buffer boxes;
+        cl::Buffer sizes;
+        cl::Buffer positions;
+    } buffers;
+};
+
+// LSD radix sort of uint keys with uint payloads (lbvh.cl kernels), also used for ray reordering
+class DeviceRadixSort
+{
+public:
+    DeviceRadixSort(cl::Context &context, cl::Device &device, cl::CommandQueue &cmdQueue, const LBVHProgram &program);
+    ~DeviceRadixSort();
+
+    bool supported() const;
+
+    // Sorts n pairs by the lowest passes * RadixBits key bits, ping-ponging between
+    // the buffer pairs. Even pass count => result in keys[0] / values[0].
+    void sort(cl::Buffer *keys, cl::Buffer *values, cl_uint n, cl_uint passes);
+
+private:
+    cl::Context &context;
+    cl::Device &device;
+    cl::CommandQueue &cmdQueue;
+
+    LBVHKernel *radixHistogram = nullptr;
+    LBVHKernel *scanExclusive = nullptr;
+    LBVHKernel *radixScatter = nullptr;
+
+    cl::Buffer hist;   // grown on demand
+    cl::Buffer total;
+    cl_uint histCapacity = 0;
+};
@@ -5,6 +5,7 @@ typedef float cl_float;
 typedef int cl_int;
 typedef unsigned int cl_uint;
 typedef char cl_uchar;
+typedef char cl_char;
 typedef bool cl_bool;
 typedef float2 vfloat2;
 typedef float3 vfloat3;
@@ -37,6 +38,8 @@ typedef FireRays::float2 vfloat2;
 #define toDeg(rad) (rad * PI_180_INV)
 // Path Length for RR
 #define MIN_PATH_LENGTH 5
+// Primary ray packets cover PACKET_TILE x PACKET_TILE pixels
+#define PACKET_TILE 8
 
 // For handling SoA data, only used on GPU
 // Variable names gid, numTasks are assumed for brevity
@@ -70,6 +73,10 @@ typedef struct
 {
     vfloat3 orig;
     vfloat3 dir;
+#if defined(GPU) && defined(TRAVERSAL_STATS)
+    cl_uint nodeVisits;
+    cl_uint triTests;
+#endif
 } Ray;
 
 typedef struct
@@ -91,11 +98,57 @@ typedef struct
     cl_int parent;
     union {
         cl_uint iStart;     // leaf node, index into index list
-        cl_uint rightChild; // internal node, index into node vector (left child always current + 1)
+        cl_uint rightChild; // internal node, index into node vector
     };
+    cl_uint leftChild;      // internal node, current + 1 in depth-first layout
     cl_uchar nPrims;        // 0 for interior nodes
 } GPUNode;
 
+// Instance record of a two-level hierarchy, stored in a GPUNode slot of the node buffer.
+// Top-level leaves: iStart = record slot, leftChild = bottom-level root.
+typedef struct
+{
+    cl_float worldToObject[12]; // 3x4 rows, translation in last column
+} GPUInstance; // 48B
+
+// Collapsed BVH4/BVH8 node, child boxes in SoA
+// Host side equivalent: WideNode<W> in bvhnode.hpp
+#ifdef USE_WIDE_BVH
+typedef struct
+{
+    cl_float bminx[BVH_WIDTH];
+    cl_float bminy[BVH_WIDTH];
+    cl_float bminz[BVH_WIDTH];
+    cl_float bmaxx[BVH_WIDTH];
+    cl_float bmaxy[BVH_WIDTH];
+    cl_float bmaxz[BVH_WIDTH];
+    cl_int child[BVH_WIDTH];        // node index, or index into index list for leaves; -1 if empty
+    cl_uchar nPrims[BVH_WIDTH];     // 0 for interior children
+} GPUWideNode;
+#endif
+
+// Compressed binary node, child boxes quantized on a 2^exponent grid (rounded outwards)
+// Host side equivalent: QuantizedNode<Q> in bvhnode.hpp
+#ifdef USE_QUANTIZED_BVH
+#if BVH_QUANT_BITS == 16
+typedef ushort quant_t;
+#else
+typedef uchar quant_t;
+#endif
+typedef struct
+{
+    cl_float origin[3];
+    cl_char exponent[3];
+    cl_uchar nPrims;        // 0 for interior nodes
+    quant_t childMin[6];    // left xyz, right xyz
+    quant_t childMax[6];
+    union {
+        cl_uint iStart;     // leaf node, index into index list
+        cl_uint rightChild; // internal node, index into node vector (left child always current + 1)
+    };
+} GPUQuantizedNode;
+#endif
+
 typedef struct
 {
     vfloat3 p; // 16B
@@ -111,6 +164,38 @@ typedef struct
     cl_int matId;
 } Triangle; // this struct is used interchangeably with RTTriangle...sizes must match!
 
+// Positions only, read during traversal. Triangle holds the shading attributes.
+// With LEAF_ORDER_TRIS the array is in leaf order and v0.w holds the original triangle index.
+typedef struct
+{
+    vfloat3 v0;
+    vfloat3 v1;
+    vfloat3 v2;
+} TrianglePos; // 48B
+
+#ifdef GPU
+#define TRI_POS_ID(ptr) (((global int*)(ptr))[3])
+#endif
+
+// Precomputed Woop test: 3x4 rows mapping world space into the space where the
+// triangle is (0,0,0), (1,0,0), (0,1,0). Row order: normal (w), u, v.
+// Derived on the device from TrianglePos by woopTriangles in lbvh.cl.
+typedef struct
+{
+    cl_float rows[12];
+    cl_int id;          // original triangle index
+    cl_int pad[3];
+} TriangleWoop; // 64B
+
+// Leaf triangle record read by the traversal kernels
+#ifdef GPU
+#ifdef TRI_WOOP
+typedef TriangleWoop LeafTriangle;
+#else
+typedef TrianglePos LeafTriangle;
+#endif
+#endif
+
 typedef struct
 {
     vfloat3 E;   // Diffuse emission (W/m^2), ~'color * intensity'?
@@ -149,18 +234,22 @@ typedef struct
     cl_uint height;
 } TexDescriptor;
 
+// Traversal fills t, i, bary (and inst), the shading attributes
+// P, N, uvTex and matId are interpolated on use by interpolateHit
 typedef struct
 {
     vfloat3 P;
     vfloat3 N;
     vfloat2 uvTex;
+    vfloat2 bary; // weights of v1 and v2
     cl_float t;
     cl_int i; // index of hit triangle, -1 by default
     cl_int areaLightHit;
     cl_int matId; // index of hit material
+    cl_uint inst; // instance record slot, two-level hierarchies only
 } Hit;
 
-#define EMPTY_HIT(tmax) { (vfloat3)(0.0f), (vfloat3)(0.0f), (vfloat2)(0.0f), tmax, -1, 0, -1 }
+#define EMPTY_HIT(tmax) { (vfloat3)(0.0f), (vfloat3)(0.0f), (vfloat2)(0.0f), (vfloat2)(0.0f), tmax, -1, 0, -1, 0 }
 
 typedef struct
 {
@@ -178,6 +267,8 @@ typedef struct
 {
     cl_float exposure;
     cl_uint tmOperator;
+    cl_uint heatmap;         // 0 = off, 1 = node visits, 2 = triangle tests (traversal stats builds)
+    cl_float heatmapScale;   // per-sample count mapped to the top of the color ramp
 } PostProcessParams;
 
 typedef struct
@@ -200,6 +291,8 @@ typedef struct
     cl_float worldRadius;
     cl_float width1;
     cl_float height1;
+    vfloat3 worldMin;      // scene bounds, quantization range of ray sort keys
+    vfloat3 worldMax;
 } RenderParams;
 
 
@@ -231,10 +324,9 @@ typedef struct
     vfloat3 lastBsdf; // added to Ei if shadow ray unblocked
     vfloat3 lastEmission;
     vfloat3 lastT;
-    // Last hit:
-    vfloat3 P;
-    vfloat3 N;
-    vfloat2 uvTex;
+    // Last hit, shading attributes interpolated on use:
+    vfloat3 shadingN; // normal mapped, facing the incoming ray (set by logic)
+    vfloat2 bary;
     // Path state:
     PathPhase phase;
 	cl_float lastPdfW; // prev. brdf pdf, for MIS (implicit light samples)
@@ -255,7 +347,7 @@ typedef struct
     cl_float t;
     cl_int i;        // index of hit triangle, -1 by default
     cl_int areaLightHit;
-    cl_int matId;    // index of hit material
+    cl_uint inst;    // instance record slot of the hit triangle
 } GPUTaskState;
 
 // Atomic counters for queues
@@ -274,6 +366,9 @@ typedef struct
     cl_uint deltaQueue;
     cl_uint emissiveQueue;
     cl_uint splattedSamples;
+    // Persistent traversal: next unclaimed queue entry
+    cl_uint extensionFetch;
+    cl_uint shadowFetch;
 } QueueCounters;
 
 typedef struct
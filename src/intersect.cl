@@ -59,12 +59,112 @@ inline bool intersectAABB(Ray *r, global AABB *box, float *tminRet, float *tMaxR
     return tmin < tMaxPrev; // not behind current best hit
 }
 
-// Möller-Trumbore
+// Child box of a compressed node, decoded outwards-rounded => never tighter than the original
+inline bool intersectAABBQuantized(Ray *r, float3 origin, float3 scale, float3 qmin, float3 qmax, float *tminRet, float *tMaxRet, float tMaxPrev)
+{
+    const float3 dinv = native_recip(r->dir);
+    const float3 tmp = (origin + qmin * scale - r->orig) * dinv;
+    float3 tmaxv = (origin + qmax * scale - r->orig) * dinv;
+    const float3 tminv = fmin(tmp, tmaxv);
+    tmaxv = fmax(tmp, tmaxv);
+
+    float tmin = fmax( fmax( tminv.x, tminv.y ), tminv.z );
+    float tmax = fmin( fmin( tmaxv.x, tmaxv.y ), tmaxv.z );
+
+    if (tmax < 0) return false;
+    if (tmin > tmax) return false;
+
+    *tminRet = tmin;
+    *tMaxRet = tmax;
+
+    return tmin < tMaxPrev;
+}
+
 #define EPSILON 1e-12f
-inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *uret, float *vret)
+
+#if defined(TRI_WOOP)
+// Woop: ray moved into unit triangle space with the precomputed rows,
+// u and v are the weights of v1 and v2 as with Möller-Trumbore
+inline bool intersectTriangle(Ray *r, global LeafTriangle *tri, float *tret, float *uret, float *vret)
 {
-    float3 s1 = tri->v1.p - tri->v0.p;
-    float3 s2 = tri->v2.p - tri->v0.p;
+    const float4 rw = vload4(0, tri->rows);
+    const float dz = dot(r->dir, rw.xyz);
+    if (dz == 0.0f) return false; // parallel, or degenerate triangle (zero rows)
+
+    const float t = (rw.w - dot(r->orig, rw.xyz)) * native_recip(dz);
+    if (t < 0.0f) return false;
+
+    const float4 ru = vload4(1, tri->rows);
+    const float u = ru.w + dot(r->orig, ru.xyz) + t * dot(r->dir, ru.xyz);
+    if (u < 0.0f || u > 1.0f) return false;
+
+    const float4 rv = vload4(2, tri->rows);
+    const float v = rv.w + dot(r->orig, rv.xyz) + t * dot(r->dir, rv.xyz);
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    *tret = t;
+    *uret = u;
+    *vret = v;
+
+    return true;
+}
+
+#elif defined(TRI_WATERTIGHT)
+// Axes permuted so that the dominant ray direction is z,
+// x and y swapped for negative z to keep the winding
+inline float3 permuteAxes(float3 v, int kz, bool flip)
+{
+    const float3 p = (kz == 0) ? v.yzx : (kz == 1) ? v.zxy : v;
+    return flip ? p.yxz : p;
+}
+
+// Watertight test (Woop, Benthin & Wald 2013): vertices sheared into ray space,
+// edge functions tested for sign without epsilons => no gaps along shared edges
+inline bool intersectTriangle(Ray *r, global LeafTriangle *tri, float *tret, float *uret, float *vret)
+{
+    const float3 ad = fabs(r->dir);
+    const int kz = (ad.x >= ad.y && ad.x >= ad.z) ? 0 : (ad.y >= ad.z) ? 1 : 2;
+    const bool flip = permuteAxes(r->dir, kz, false).z < 0.0f;
+
+    const float3 d = permuteAxes(r->dir, kz, flip);
+    const float3 a = permuteAxes(tri->v0 - r->orig, kz, flip);
+    const float3 b = permuteAxes(tri->v1 - r->orig, kz, flip);
+    const float3 c = permuteAxes(tri->v2 - r->orig, kz, flip);
+
+    // Shear
+    const float sz = 1.0f / d.z;
+    const float sx = d.x * sz;
+    const float sy = d.y * sz;
+    const float ax = a.x - sx * a.z, ay = a.y - sy * a.z;
+    const float bx = b.x - sx * b.z, by = b.y - sy * b.z;
+    const float cx = c.x - sx * c.z, cy = c.y - sy * c.z;
+
+    // Scaled barycentrics
+    const float U = cx * by - cy * bx;
+    const float V = ax * cy - ay * cx;
+    const float W = bx * ay - by * ax;
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) return false;
+
+    const float det = U + V + W;
+    if (det == 0.0f) return false;
+
+    const float iDet = 1.0f / det;
+    const float t = (U * a.z + V * b.z + W * c.z) * sz * iDet;
+    if (t < 0.0f) return false;
+
+    *tret = t;
+    *uret = V * iDet;
+    *vret = W * iDet;
+
+    return true;
+}
+
+#else
+// Möller-Trumbore
+inline bool intersectTriangle(Ray *r, global LeafTriangle *tri, float *tret, float *uret, float *vret)
+{
+    float3 s1 = tri->v1 - tri->v0;
+    float3 s2 = tri->v2 - tri->v0;
     float3 pvec = cross(r->dir, s2); // order matters!
     float det = dot(s1, pvec);
 
@@ -72,7 +172,7 @@ inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *
     if (fabs(det) < EPSILON) return false;
     float iDet = native_recip(det);
 
-    float3 tvec = r->orig - tri->v0.p;
+    float3 tvec = r->orig - tri->v0;
     float u = dot(tvec, pvec) * iDet;
     if (u < 0.0f || u > 1.0f) return false;
 
@@ -91,6 +191,7 @@ inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *
 
     return true;
 }
+#endif
 
 // For drawing the test area light
 inline bool intersectTriangleLocal(Ray *r, Triangle *tri, float *tres)
@@ -147,10 +248,7 @@ inline void intersectLight(Hit *hit, Ray *r, global RenderParams *params)
     if (first || second)
     {
         hit->areaLightHit = 1;
-        hit->P = r->orig + hit->t * r->dir;
-        hit->N = params->areaLight.N;
-        hit->i = 0; // use first triangle
-        hit->matId = 0; // use default material (always available)
+        hit->i = 0; // use first triangle, attributes set by interpolateHit
     }
 }
 
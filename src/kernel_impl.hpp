@@ -71,6 +71,7 @@ public:
         CLContext *ctx = getCtxPtr(userPtr);
         int err = 0;
         err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
@@ -89,15 +90,56 @@ public:
         err |= setArg("tasks", ctx->deviceBuffers.tasksBuffer);
         err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
         err |= setArg("extensionQueue", ctx->deviceBuffers.extensionQueue);
-        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("traversalStats", ctx->deviceBuffers.traversalStats);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_extension arguments!");
     }
 };
 
+// Camera rays straight from the raygen queue, one screen tile per work-group
+class WFPrimaryKernel : public clt::Kernel
+{
+public:
+    WFPrimaryKernel(void) : Kernel("src/wf_primaryrays.cl", "tracePrimary") {}
+    void setArgs() override {
+        CLContext *ctx = getCtxPtr(userPtr);
+        int err = 0;
+        err |= setArg("tasks", ctx->deviceBuffers.tasksBuffer);
+        err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
+        err |= setArg("raygenQueue", ctx->deviceBuffers.raygenQueue);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
+        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("traversalStats", ctx->deviceBuffers.traversalStats);
+        err |= setArg("numTasks", ctx->getNumTasks());
+        clt::check(err, "Failed to set wf_primary arguments!");
+    }
+};
+
+// Queue and ray type set per dispatch by CLContext::enqueueWfSortRays
+class WFRayKeysKernel : public clt::Kernel
+{
+public:
+    WFRayKeysKernel(void) : Kernel("src/wf_sortrays.cl", "rayKeys") {}
+    void setArgs() override {
+        CLContext *ctx = getCtxPtr(userPtr);
+        int err = 0;
+        err |= setArg("tasks", ctx->deviceBuffers.tasksBuffer);
+        err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
+        err |= setArg("queue", ctx->deviceBuffers.extensionQueue);
+        err |= setArg("keys", ctx->deviceBuffers.rayKeys[0]);
+        err |= setArg("values", ctx->deviceBuffers.rayValues[0]);
+        err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("shadowRays", 0);
+        clt::check(err, "Failed to set wf_ray_keys arguments!");
+    }
+};
+
 class WFShadowKernel : public clt::Kernel
 {
 public:
@@ -108,10 +150,11 @@ public:
         err |= setArg("tasks", ctx->deviceBuffers.tasksBuffer);
         err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
         err |= setArg("shadowQueue", ctx->deviceBuffers.shadowQueue);
-        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("traversalStats", ctx->deviceBuffers.traversalStats);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_shadow arguments!");
     }
@@ -149,6 +192,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_diffuse arguments!");
@@ -169,6 +214,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_glossy arguments!");
@@ -189,6 +236,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_ggx_refl arguments!");
@@ -209,6 +258,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_ggx_refr arguments!");
@@ -229,6 +280,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_delta arguments!");
@@ -249,6 +302,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_emissive arguments!");
@@ -269,6 +324,8 @@ public:
         err |= setArg("materials", ctx->deviceBuffers.materialBuffer);
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
+        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_all_mats arguments!");
@@ -297,6 +354,7 @@ public:
         err |= setArg("raygenQueue", ctx->deviceBuffers.raygenQueue);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("samplesPerPixel", ctx->deviceBuffers.samplesPerPixel);
+        err |= setArg("traversalStats", ctx->deviceBuffers.traversalStats);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_reset arguments!");
     }
@@ -346,6 +404,7 @@ public:
         err |= setArg("texData", ctx->deviceBuffers.texDataBuffer);
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
         err |= setArg("denoiserNormal", ctx->deviceBuffers.denoiserNormalBuffer);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
@@ -382,6 +441,7 @@ public:
         err |= setArg("probTable", ctx->deviceBuffers.probTable);
         err |= setArg("aliasTable", ctx->deviceBuffers.aliasTable);
         err |= setArg("pdfTable", ctx->deviceBuffers.pdfTable);
+        err |= setArg("triPos", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
         err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
@@ -458,6 +518,7 @@ public:
         err |= setArg("denoiserAlbedoGL", ctx->deviceBuffers.denoiserAlbedoBufferGL);
         err |= setArg("denoiserNormalGL", ctx->deviceBuffers.denoiserNormalBufferGL);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
+        err |= setArg("traversalStats", ctx->deviceBuffers.traversalStats);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set mk_postprocess arguments!");
     }
@@ -3,7 +3,7 @@
 #include "utils.cl"
 #include "intersect.cl"
 
-kernel void pick(global RenderParams *params, global Triangle *tris, global GPUNode *nodes, global uint *indices, global Hit *pickResult, float NDCx, float NDCy)
+kernel void pick(global RenderParams *params, global LeafTriangle *triPos, global Triangle *tris, global GPUNode *nodes, global uint *indices, global Hit *pickResult, float NDCx, float NDCy)
 {
     // Uses one single thread
     if (get_global_id(0) != 0 || get_global_id(1) != 0)
@@ -30,9 +30,10 @@ kernel void pick(global RenderParams *params, global Triangle *tris, global GPUN
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX);
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, triPos, nodes, indices);
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
 
-    // Write result
+    // Write result, with shading attributes
+    interpolateHit(&hit, r.orig, r.dir, tris, nodes, params);
     *pickResult = hit;
 }
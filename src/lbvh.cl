@@ -0,0 +1,688 @@
+#include "geom.h"
+
+// On-device hierarchy construction
+// Triangles are sorted along a Morton curve, after which the topology is
+// either emitted directly (LBVH, Karras 2012) or built bottom-up by
+// locally-ordered clustering (PLOC, Meister & Bittner 2018).
+// Both produce the same GPUNode layout as the host builders:
+// depth-first order, left child at current + 1, one triangle per leaf.
+//
+// Intermediate tree: internal nodes [0, n-2], leaves [n-1, 2n-2],
+// leaf k references sorted triangle k.
+
+#define GROUP_SIZE 256  // must match DeviceBVHBuilder::GroupSize
+#define RADIX_BITS 4
+#define RADIX_BINS 16
+
+inline AABB boxUnion(AABB a, AABB b)
+{
+    AABB res = { fmin(a.min, b.min), fmax(a.max, b.max) };
+    return res;
+}
+
+inline float boxArea(AABB b)
+{
+    const float3 d = b.max - b.min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+inline AABB triangleBox(global TrianglePos *tri)
+{
+    AABB res;
+    res.min = fmin(fmin(tri->v0, tri->v1), tri->v2);
+    res.max = fmax(fmax(tri->v0, tri->v1), tri->v2);
+    return res;
+}
+
+// Box written by another work-item, bypass stale caches
+inline AABB loadBoxVolatile(global AABB *boxes, int i)
+{
+    volatile global float *p = (volatile global float*)(boxes + i);
+    AABB res;
+    res.min = (float3)(p[0], p[1], p[2]);
+    res.max = (float3)(p[4], p[5], p[6]);
+    return res;
+}
+
+// Spread lower 10 bits over 30 bits
+inline uint expandBits(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Work-group wide exclusive prefix sum, returns total through 'total'
+inline uint scanLocal(local uint *buf, uint lid, uint value, uint *total)
+{
+    buf[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint offset = 1; offset < GROUP_SIZE; offset <<= 1)
+    {
+        const uint add = (lid >= offset) ? buf[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        buf[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    *total = buf[GROUP_SIZE - 1];
+    const uint res = buf[lid] - value;
+    barrier(CLK_LOCAL_MEM_FENCE); // buf can be reused
+    return res;
+}
+
+inline void reduceBoxLocal(local float3 *lmin, local float3 *lmax, uint lid, AABB box)
+{
+    lmin[lid] = box.min;
+    lmax[lid] = box.max;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = GROUP_SIZE / 2; s > 0; s >>= 1)
+    {
+        if (lid < s)
+        {
+            lmin[lid] = fmin(lmin[lid], lmin[lid + s]);
+            lmax[lid] = fmax(lmax[lid], lmax[lid + s]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Per-group bounds of triangle centroids
+kernel void centroidBounds(
+    global TrianglePos *triPos,
+    global AABB *groupBounds,
+    uint n
+)
+{
+    local float3 lmin[GROUP_SIZE];
+    local float3 lmax[GROUP_SIZE];
+    const uint lid = get_local_id(0);
+
+    AABB box = { (float3)(FLT_MAX), (float3)(-FLT_MAX) };
+    for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+    {
+        const AABB tb = triangleBox(&triPos[i]);
+        const float3 c = 0.5f * (tb.min + tb.max);
+        box.min = fmin(box.min, c);
+        box.max = fmax(box.max, c);
+    }
+
+    reduceBoxLocal(lmin, lmax, lid, box);
+    if (lid == 0)
+    {
+        AABB res = { lmin[0], lmax[0] };
+        groupBounds[get_group_id(0)] = res;
+    }
+}
+
+// Single group, reduces 'count' boxes into bounds[0]
+kernel void reduceBounds(
+    global AABB *bounds,
+    uint count
+)
+{
+    local float3 lmin[GROUP_SIZE];
+    local float3 lmax[GROUP_SIZE];
+    const uint lid = get_local_id(0);
+
+    AABB box = { (float3)(FLT_MAX), (float3)(-FLT_MAX) };
+    for (uint i = lid; i < count; i += GROUP_SIZE)
+        box = boxUnion(box, bounds[i]);
+
+    reduceBoxLocal(lmin, lmax, lid, box);
+    if (lid == 0)
+    {
+        AABB res = { lmin[0], lmax[0] };
+        bounds[0] = res;
+    }
+}
+
+// 30-bit Morton codes of triangle centroids
+kernel void mortonCodes(
+    global TrianglePos *triPos,
+    global AABB *sceneBounds,
+    global uint *keys,
+    global uint *values,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    const AABB bounds = sceneBounds[0];
+    const float3 extent = fmax(bounds.max - bounds.min, (float3)(1e-20f));
+    const AABB tb = triangleBox(&triPos[gid]);
+    const float3 c = (0.5f * (tb.min + tb.max) - bounds.min) / extent;
+    const uint3 q = convert_uint3(clamp(c * 1024.0f, (float3)(0.0f), (float3)(1023.0f)));
+
+    keys[gid] = (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+    values[gid] = gid;
+}
+
+// Radix sort, pass 1: digit histogram per group, stored digit-major
+kernel void radixHistogram(
+    global uint *keys,
+    global uint *hist,
+    uint n,
+    uint shift
+)
+{
+    local uint counts[RADIX_BINS];
+    const uint gid = get_global_id(0);
+    const uint lid = get_local_id(0);
+
+    if (lid < RADIX_BINS)
+        counts[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (gid < n)
+        atomic_inc(&counts[(keys[gid] >> shift) & (RADIX_BINS - 1)]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid < RADIX_BINS)
+        hist[lid * get_num_groups(0) + get_group_id(0)] = counts[lid];
+}
+
+// Single group exclusive scan of 'count' elements in-place, total written to total[0]
+kernel void scanExclusive(
+    global uint *data,
+    global uint *total,
+    uint count
+)
+{
+    local uint buf[GROUP_SIZE];
+    const uint lid = get_local_id(0);
+    const uint chunk = (count + GROUP_SIZE - 1) / GROUP_SIZE;
+    const uint start = min(lid * chunk, count);
+    const uint end = min(start + chunk, count);
+
+    uint sum = 0;
+    for (uint i = start; i < end; i++)
+        sum += data[i];
+
+    uint groupTotal;
+    uint offset = scanLocal(buf, lid, sum, &groupTotal);
+    for (uint i = start; i < end; i++)
+    {
+        const uint v = data[i];
+        data[i] = offset;
+        offset += v;
+    }
+
+    if (lid == 0)
+        total[0] = groupTotal;
+}
+
+// Radix sort, pass 2: stable local sort by digit, then scatter to global offsets
+kernel void radixScatter(
+    global uint *keysIn,
+    global uint *valuesIn,
+    global uint *keysOut,
+    global uint *valuesOut,
+    global uint *hist,
+    uint n,
+    uint shift
+)
+{
+    local uint lkeys[GROUP_SIZE];
+    local uint lvalues[GROUP_SIZE];
+    local uint lscan[GROUP_SIZE];
+    local uint digitStart[RADIX_BINS];
+
+    const uint gid = get_global_id(0);
+    const uint lid = get_local_id(0);
+    const uint groupStart = get_group_id(0) * GROUP_SIZE;
+    const uint numValid = min((uint)GROUP_SIZE, n - groupStart);
+
+    // Padding sorts last within the group
+    uint key = (gid < n) ? keysIn[gid] : 0xFFFFFFFFu;
+    uint value = (gid < n) ? valuesIn[gid] : 0u;
+
+    // Sequence of stable 1-bit splits
+    for (uint b = 0; b < RADIX_BITS; b++)
+    {
+        const uint bit = (key >> (shift + b)) & 1u;
+        uint numOnes;
+        const uint onesBefore = scanLocal(lscan, lid, bit, &numOnes);
+        const uint dst = bit ? (GROUP_SIZE - numOnes) + onesBefore : lid - onesBefore;
+
+        lkeys[dst] = key;
+        lvalues[dst] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        key = lkeys[lid];
+        value = lvalues[lid];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    lkeys[lid] = key;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const uint digit = (key >> shift) & (RADIX_BINS - 1);
+    if (lid == 0 || ((lkeys[lid - 1] >> shift) & (RADIX_BINS - 1)) != digit)
+        digitStart[digit] = lid;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid < numValid)
+    {
+        const uint dst = hist[digit * get_num_groups(0) + get_group_id(0)] + lid - digitStart[digit];
+        keysOut[dst] = key;
+        valuesOut[dst] = value;
+    }
+}
+
+// Length of common prefix of sorted keys i and j, ties broken by index
+inline int commonPrefix(global uint *keys, int n, int i, int j)
+{
+    if (j < 0 || j >= n)
+        return -1;
+    const uint ki = keys[i];
+    const uint kj = keys[j];
+    return (ki == kj) ? 32 + (int)clz((uint)(i ^ j)) : (int)clz(ki ^ kj);
+}
+
+// LBVH topology, one work-item per internal node
+kernel void lbvhEmit(
+    global uint *keys,
+    global int *childLeft,
+    global int *childRight,
+    global int *parents,
+    uint n
+)
+{
+    const int i = get_global_id(0);
+    const int numKeys = (int)n;
+    if (i >= numKeys - 1)
+        return;
+
+    // Direction of the range
+    const int d = (commonPrefix(keys, numKeys, i, i + 1) - commonPrefix(keys, numKeys, i, i - 1)) >= 0 ? 1 : -1;
+    const int minPrefix = commonPrefix(keys, numKeys, i, i - d);
+
+    // Upper bound for range length, then binary search for the other end
+    int lMax = 2;
+    while (commonPrefix(keys, numKeys, i, i + lMax * d) > minPrefix)
+        lMax <<= 1;
+    int l = 0;
+    for (int t = lMax >> 1; t >= 1; t >>= 1)
+    {
+        if (commonPrefix(keys, numKeys, i, i + (l + t) * d) > minPrefix)
+            l += t;
+    }
+    const int j = i + l * d;
+
+    // Binary search for split position
+    const int nodePrefix = commonPrefix(keys, numKeys, i, j);
+    int s = 0;
+    for (int div = 2; ; div <<= 1)
+    {
+        const int t = (l + div - 1) / div;
+        if (commonPrefix(keys, numKeys, i, i + (s + t) * d) > nodePrefix)
+            s += t;
+        if (t == 1)
+            break;
+    }
+    const int split = i + s * d + min(d, 0);
+
+    const int leafBase = numKeys - 1;
+    const int left = (min(i, j) == split) ? leafBase + split : split;
+    const int right = (max(i, j) == split + 1) ? leafBase + split + 1 : split + 1;
+
+    childLeft[i] = left;
+    childRight[i] = right;
+    parents[left] = i;
+    parents[right] = i;
+    if (i == 0)
+        parents[0] = -1;
+}
+
+// Leaf bounds from sorted triangle indices
+kernel void leafBounds(
+    global TrianglePos *triPos,
+    global uint *values,
+    global AABB *boxes,
+    global uint *sizes,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    boxes[n - 1 + gid] = triangleBox(&triPos[values[gid]]);
+    sizes[n - 1 + gid] = 1;
+}
+
+// Bottom-up bounds and subtree sizes, second work-item to reach a node processes it
+kernel void lbvhFitBounds(
+    global int *childLeft,
+    global int *childRight,
+    global int *parents,
+    global AABB *boxes,
+    global uint *sizes,
+    global uint *visited,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    volatile global uint *vsizes = sizes;
+    int node = parents[n - 1 + gid];
+    while (node != -1)
+    {
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&visited[node]) == 0)
+            return; // sibling not done yet
+
+        const int l = childLeft[node];
+        const int r = childRight[node];
+        boxes[node] = boxUnion(loadBoxVolatile(boxes, l), loadBoxVolatile(boxes, r));
+        vsizes[node] = 1 + vsizes[l] + vsizes[r];
+        node = parents[node];
+    }
+}
+
+// PLOC: every leaf starts as its own cluster
+kernel void plocInit(
+    global int *clusters,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid < n)
+        clusters[gid] = n - 1 + gid;
+}
+
+// PLOC: nearest neighbor within 'radius' along the Morton curve
+kernel void plocNearestNeighbor(
+    global int *clusters,
+    global AABB *boxes,
+    global int *neighbors,
+    uint count,
+    uint radius
+)
+{
+    const int i = get_global_id(0);
+    if (i >= (int)count)
+        return;
+
+    const AABB box = boxes[clusters[i]];
+    const int first = max(0, i - (int)radius);
+    const int last = min((int)count - 1, i + (int)radius);
+
+    // Ascending scan with strict comparison => ties resolved consistently
+    // by pair index, which guarantees at least one mutual pair per pass
+    float minCost = FLT_MAX;
+    int best = -1;
+    for (int j = first; j <= last; j++)
+    {
+        if (j == i)
+            continue;
+        const float cost = boxArea(boxUnion(box, boxes[clusters[j]]));
+        if (cost < minCost)
+        {
+            minCost = cost;
+            best = j;
+        }
+    }
+    neighbors[i] = best;
+}
+
+// PLOC: mutual nearest neighbors are merged, lower index keeps the new cluster
+kernel void plocMerge(
+    global int *clusters,
+    global int *neighbors,
+    global AABB *boxes,
+    global uint *sizes,
+    global int *childLeft,
+    global int *childRight,
+    global int *parents,
+    global uint *valid,
+    global uint *nodeCounter,
+    uint count
+)
+{
+    const int i = get_global_id(0);
+    if (i >= (int)count)
+        return;
+
+    const int j = neighbors[i];
+    const bool mutual = (neighbors[j] == i);
+    valid[i] = (!mutual || i < j) ? 1 : 0;
+    if (!mutual || i > j)
+        return;
+
+    const int l = clusters[i];
+    const int r = clusters[j];
+    const int node = (int)atomic_inc(nodeCounter);
+    childLeft[node] = l;
+    childRight[node] = r;
+    parents[l] = node;
+    parents[r] = node;
+    parents[node] = -1;
+    boxes[node] = boxUnion(boxes[l], boxes[r]);
+    sizes[node] = 1 + sizes[l] + sizes[r];
+    clusters[i] = node;
+}
+
+// PLOC: remove merged clusters, keeping Morton order
+kernel void plocCompact(
+    global int *clustersIn,
+    global int *clustersOut,
+    global int *neighbors,
+    global uint *offsets,
+    uint count
+)
+{
+    const int i = get_global_id(0);
+    if (i >= (int)count)
+        return;
+
+    const int j = neighbors[i];
+    if (neighbors[j] == i && i > j)
+        return;
+
+    clustersOut[offsets[i]] = clustersIn[i];
+}
+
+// Depth-first position of every node: walk to the root, summing the sizes of
+// left siblings along the way
+kernel void computeLayout(
+    global int *childLeft,
+    global int *parents,
+    global uint *sizes,
+    global uint *positions,
+    uint numNodes
+)
+{
+    const int gid = get_global_id(0);
+    if (gid >= (int)numNodes)
+        return;
+
+    uint pos = 0;
+    int curr = gid;
+    int p = parents[curr];
+    while (p != -1)
+    {
+        const int left = childLeft[p];
+        pos += (left == curr) ? 1 : 1 + sizes[left];
+        curr = p;
+        p = parents[p];
+    }
+    positions[gid] = pos;
+}
+
+// Final GPUNode output
+kernel void writeNodes(
+    global int *childLeft,
+    global int *childRight,
+    global int *parents,
+    global AABB *boxes,
+    global uint *positions,
+    global GPUNode *nodes,
+    uint n
+)
+{
+    const int gid = get_global_id(0);
+    const int leafBase = (int)n - 1;
+    if (gid >= 2 * (int)n - 1)
+        return;
+
+    GPUNode node;
+    node.box = boxes[gid];
+    node.parent = (parents[gid] == -1) ? -1 : (int)positions[parents[gid]];
+    if (gid >= leafBase)
+    {
+        node.iStart = gid - leafBase;
+        node.nPrims = 1;
+    }
+    else
+    {
+        node.rightChild = positions[childRight[gid]];
+        node.leftChild = positions[childLeft[gid]];
+        node.nPrims = 0;
+    }
+    nodes[positions[gid]] = node;
+}
+
+// Positions permuted into leaf order, original index kept in v0.w
+kernel void gatherLeafOrder(
+    global TrianglePos *triPos,
+    global uint *values,
+    global TrianglePos *ordered,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    const uint id = values[gid];
+    ordered[gid] = triPos[id];
+    TRI_POS_ID(&ordered[gid]) = (int)id;
+}
+
+// Refit: new positions, same topology.
+// Every work-item owns one node, leaves recompute their box and walk up
+// the parent links, the second child to arrive at a node computes its box.
+// Works for any node layout since only explicit links are followed.
+kernel void refitNodes(
+    global TrianglePos *triPos,
+    global uint *indices,
+    global GPUNode *nodes,
+    global uint *visited,
+    uint leafOrder,
+    uint numNodes
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= numNodes || nodes[gid].nPrims == 0)
+        return;
+
+    AABB box = { (float3)(FLT_MAX), (float3)(-FLT_MAX) };
+    const uint iStart = nodes[gid].iStart;
+    for (uint i = iStart; i < iStart + nodes[gid].nPrims; i++)
+        box = boxUnion(box, triangleBox(&triPos[leafOrder ? i : indices[i]]));
+    nodes[gid].box = box;
+
+    int node = nodes[gid].parent;
+    while (node != -1)
+    {
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&visited[node]) == 0)
+            return; // sibling not done yet
+
+        const uint l = nodes[node].leftChild;
+        const uint r = nodes[node].rightChild;
+        nodes[node].box = boxUnion(loadBoxVolatile((global AABB*)&nodes[l], 0), loadBoxVolatile((global AABB*)&nodes[r], 0));
+        node = nodes[node].parent;
+    }
+}
+
+// Leaf-ordered copy of new positions, source indices taken from the previous copy
+kernel void refreshLeafOrder(
+    global TrianglePos *source,
+    global TrianglePos *previous,
+    global TrianglePos *ordered,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    const int id = TRI_POS_ID(&previous[gid]);
+    ordered[gid] = source[id];
+    TRI_POS_ID(&ordered[gid]) = id;
+}
+
+// Woop transform of every (possibly leaf-ordered) triangle, rerun after builds and refits.
+// Rows are the inverse of [e1 e2 n | v0], degenerate triangles get zero rows.
+kernel void woopTriangles(
+    global TrianglePos *triPos,
+    global TriangleWoop *woop,
+    uint n
+)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+
+    const float3 v0 = triPos[gid].v0;
+    const float3 e1 = triPos[gid].v1 - v0;
+    const float3 e2 = triPos[gid].v2 - v0;
+    const float3 nrm = cross(e1, e2);
+    const float len2 = dot(nrm, nrm);
+    const float s = (len2 > 0.0f) ? 1.0f / len2 : 0.0f;
+
+    const float3 rw = nrm * s;
+    const float3 ru = cross(e2, nrm) * s;
+    const float3 rv = cross(nrm, e1) * s;
+
+    TriangleWoop w;
+    vstore4((float4)(rw, dot(rw, v0)), 0, w.rows);
+    vstore4((float4)(ru, -dot(ru, v0)), 1, w.rows);
+    vstore4((float4)(rv, -dot(rv, v0)), 2, w.rows);
+#ifdef LEAF_ORDER_TRIS
+    w.id = TRI_POS_ID(&triPos[gid]);
+#else
+    w.id = (int)gid;
+#endif
+    w.pad[0] = w.pad[1] = w.pad[2] = 0;
+    woop[gid] = w;
+}
+
+// Per-group partial sums of the SAH cost, normalized on the host
+kernel void nodeCost(
+    global GPUNode *nodes,
+    global float *groupCosts,
+    float costBox,
+    float costTri,
+    uint numNodes
+)
+{
+    local float lcost[GROUP_SIZE];
+    const uint lid = get_local_id(0);
+
+    float cost = 0.0f;
+    for (uint i = get_global_id(0); i < numNodes; i += get_global_size(0))
+    {
+        const uint nPrims = nodes[i].nPrims;
+        cost += ((nPrims > 0) ? costTri * nPrims : costBox) * boxArea(nodes[i].box);
+    }
+
+    lcost[lid] = cost;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = GROUP_SIZE / 2; s > 0; s >>= 1)
+    {
+        if (lid < s)
+            lcost[lid] += lcost[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+        groupCosts[get_group_id(0)] = lcost[0];
+}
@@ -15,6 +15,8 @@ int main(int argc, char* argv[])
     int height;
     int spp;
     bool interactiveMode;
+    std::string replayFile;
+    unsigned int replayIterations;
     std::vector<std::string> scenes;
     unsigned int defaultScene = 0;
 
@@ -39,6 +41,12 @@ int main(int argc, char* argv[])
 
         TCLAP::SwitchArg aBatch("b", "batch", "Batch mode", cmd, false);
 
+        TCLAP::ValueArg<std::string> aReplay("r", "replay", "Replay captured rays (F7) through the traversal kernels and exit", false, "", "string");
+        cmd.add(aReplay);
+
+        TCLAP::ValueArg<unsigned int> aReplayIter("n", "replay-iterations", "Kernel launches per ray batch in replay mode", false, 10, "int");
+        cmd.add(aReplayIter);
+
         TCLAP::UnlabeledMultiArg<std::string> aScenes("Scene", "Scene(s) to render, file selector used if empty", false, "string");
         cmd.add(aScenes);
 
@@ -49,6 +57,8 @@ int main(int argc, char* argv[])
         spp = aSpp.getValue();
         interactiveMode = !aBatch.getValue();
         scenes = aScenes.getValue();
+        replayFile = aReplay.getValue();
+        replayIterations = aReplayIter.getValue();
 
         if (width < 0)
             throw TCLAP::ArgException("Invalid value", "width");
@@ -58,6 +68,8 @@ int main(int argc, char* argv[])
             throw TCLAP::ArgException("Invalid value", "samples");
         if (interactiveMode && scenes.size() > 1)
             throw TCLAP::ArgException("Only one scene allowed in interactive mode", "Scene");
+        if (!replayFile.empty() && scenes.size() != 1)
+            throw TCLAP::ArgException("Replay needs the scene the rays were captured from", "Scene");
 
         // do the check for command line scenes first
         if (scenes.empty() && !s.getShortcuts().empty())
@@ -89,7 +101,12 @@ int main(int argc, char* argv[])
 
     Tracer tracer(width, height);
 
-    if (interactiveMode)
+    if (!replayFile.empty())
+    {
+        tracer.init(width, height, scenes[0]);
+        tracer.replayRays(replayFile, replayIterations);
+    }
+    else if (interactiveMode)
     {
         if (!scenes.empty())
             tracer.init(width, height, scenes[defaultScene]);
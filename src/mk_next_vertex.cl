@@ -10,6 +10,7 @@ kernel void nextVertex(
     global uchar *texData,
     global TexDescriptor *textures,
     global float *denoiserNormal, // for Optix denoiser
+    global LeafTriangle *triPos,
     global Triangle *tris,
     global GPUNode *nodes,
     global uint *indices,
@@ -36,11 +37,12 @@ kernel void nextVertex(
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX); // TODO: Max distance?
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, triPos, nodes, indices);
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
 
-    // Write hit to path state
+    // Write hit to path state, shading attributes used below
     writeHitSoA(hit, tasks, gid, numTasks);
+    interpolateHit(&hit, rayOrig, rayDir, tris, nodes, params);
 
     // Update render statistics
     global uint *len = &ReadU32(pathLen, tasks);
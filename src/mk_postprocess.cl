@@ -1,6 +1,13 @@
 #include "geom.h"
 #include "tonemap.cl"
 
+// Blue-cyan-yellow-red ramp for cost visualization, x in [0, 1]
+inline float3 heatmapRamp(float x)
+{
+    x = clamp(x, 0.0f, 1.0f);
+    return clamp((float3)(1.5f - fabs(4.0f * x - 3.0f), 1.5f - fabs(4.0f * x - 2.0f), 1.5f - fabs(4.0f * x - 1.0f)), 0.0f, 1.0f);
+}
+
 
 // Performs post processing, e.g. tone mapping
 // Restult is shown on the screen by OpenGL or written into a file for exporting
@@ -12,6 +19,7 @@ kernel void process(
     global float *denoiserAlbedoGL, // GL-CL shared
     global float *denoiserNormalGL, // GL-CL shared
     global RenderParams *params,
+    global uint *traversalStats,    // node visits, triangle tests per pixel
     uint numTasks)
 {
     // PixelPreview is as big as the render resolution
@@ -26,6 +34,18 @@ kernel void process(
     
     PostProcessParams par = params->ppParams;
 
+#ifdef TRAVERSAL_STATS
+    // Average traversal cost per sample instead of radiance
+    if (par.heatmap > 0)
+    {
+        const float count = (float)traversalStats[2 * gid + min(par.heatmap, 2u) - 1];
+        const float cost = (color.w > 0.0f) ? count / color.w : 0.0f;
+        color = (float4)(heatmapRamp(cost / par.heatmapScale), 1.0f);
+        vstore4(color, gid, pixelsPreview);
+        return;
+    }
+#endif
+
     // Divide accumulated radiance with number of samples
     if (color.w > 0.0)
         color = color / color.w;
@@ -18,6 +18,7 @@ kernel void sampleBsdf(
     global float *probTable,
     global int *aliasTable,
     global float *pdfTable,
+    global LeafTriangle *triPos,
     global Triangle *tris,
     global GPUNode *nodes,
     global uint *indices,
@@ -43,6 +44,7 @@ kernel void sampleBsdf(
 
     // Read hit from path state
     Hit hit = readHitSoA(tasks, gid, numTasks);
+    interpolateHit(&hit, rayOrig, rayDir, tris, nodes, params);
     Material mat = materials[hit.matId];
 
     // Apply potential normal map
@@ -89,7 +91,7 @@ kernel void sampleBsdf(
             // TODO: BAD! Collect all shadow ray casts together (in queue, i.e. buffer of gids + atomic counter)!
             Hit hitL = EMPTY_HIT(lenL);
             if (params->useAreaLight) intersectLight(&hitL, &rLight, params);
-            bool occluded = (hitL.i > -1) || bvh_occluded(&rLight, &lenL, tris, nodes, indices);
+            bool occluded = (hitL.i > -1) || bvh_occluded(&rLight, &lenL, triPos, nodes, indices);
             atomic_inc(&stats->shadowRays);
 
             // Compute contribution
@@ -124,7 +126,7 @@ kernel void sampleBsdf(
             Ray rLight = { orig, L };
 
             // TODO: BAD! Collect all shadow ray casts together (in queue, i.e. buffer of gids + atomic counter)!
-            bool occluded = bvh_occluded(&rLight, &lenL, tris, nodes, indices);
+            bool occluded = bvh_occluded(&rLight, &lenL, triPos, nodes, indices);
             atomic_inc(&stats->shadowRays);
 
             // Calculate direct lighting
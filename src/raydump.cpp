@@ -0,0 +1,79 @@
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "raydump.hpp"
+#include "mappedfile.hpp"
+
+static const char RayDumpMagic[8] = { 'F', 'L', 'U', 'C', 'T', 'R', 'A', 'Y' };
+static const cl_uint RayDumpVersion = 1;
+
+struct RayDumpHeader
+{
+    char magic[8];
+    cl_uint version;
+    cl_uint recordSize;
+    U64 sceneHash;
+    U64 numRays;
+};
+
+size_t RayDump::count(RayKind kind) const
+{
+    return std::count_if(rays.begin(), rays.end(), [kind](const RayRecord &r) { return r.kind == kind; });
+}
+
+bool RayDump::exportTo(const std::string filename) const
+{
+    RayDumpHeader h;
+    std::memset(&h, 0, sizeof(RayDumpHeader));
+    std::memcpy(h.magic, RayDumpMagic, sizeof(RayDumpMagic));
+    h.version = RayDumpVersion;
+    h.recordSize = sizeof(RayRecord);
+    h.sceneHash = sceneHash;
+    h.numRays = rays.size();
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.good())
+    {
+        std::cout << "Could not create ray dump " << filename << std::endl;
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char*>(&h), sizeof(RayDumpHeader));
+    out.write(reinterpret_cast<const char*>(rays.data()), rays.size() * sizeof(RayRecord));
+    return out.good();
+}
+
+bool RayDump::importFrom(const std::string filename)
+{
+    MappedFile file(filename);
+    if (!file.isOpen() || file.size() < sizeof(RayDumpHeader))
+    {
+        std::cout << "Could not map ray dump " << filename << std::endl;
+        return false;
+    }
+
+    RayDumpHeader h;
+    std::memcpy(&h, file.data(), sizeof(RayDumpHeader));
+
+    std::string error;
+    if (std::memcmp(h.magic, RayDumpMagic, sizeof(RayDumpMagic)) != 0)
+        error = "unknown format";
+    else if (h.version != RayDumpVersion)
+        error = "version " + std::to_string(h.version) + ", expected " + std::to_string(RayDumpVersion);
+    else if (h.recordSize != sizeof(RayRecord))
+        error = "record size " + std::to_string(h.recordSize) + ", expected " + std::to_string(sizeof(RayRecord));
+    else if (sizeof(RayDumpHeader) + h.numRays * sizeof(RayRecord) > file.size())
+        error = "truncated";
+
+    if (!error.empty())
+    {
+        std::cout << "Ignoring ray dump " << filename << ": " << error << std::endl;
+        return false;
+    }
+
+    const RayRecord *records = reinterpret_cast<const RayRecord*>(file.data() + sizeof(RayDumpHeader));
+    sceneHash = h.sceneHash;
+    rays.assign(records, records + h.numRays);
+    return true;
+}
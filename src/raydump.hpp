@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "rtutil.hpp"
+
+// Ray batches captured from the wavefront task buffers, replayed through
+// traceExtension / traceShadow in isolation for traversal benchmarks
+
+enum class RayKind : cl_uint
+{
+    Primary = 0,   // extension ray of a new path
+    Secondary = 1, // extension ray of a continued path
+    Shadow = 2
+};
+
+struct RayRecord
+{
+    cl_float orig[3];
+    cl_float dir[3];
+    cl_float tMax;     // FLT_MAX for extension rays
+    RayKind kind;
+};
+
+struct RayDump
+{
+    U64 sceneHash = 0; // rays only make sense for the scene they were captured from
+    std::vector<RayRecord> rays;
+
+    size_t count(RayKind kind) const;
+    bool exportTo(const std::string filename) const;
+    bool importFrom(const std::string filename);
+};
+
+// Kernel time and result checksum of one ray kind
+struct RayReplayResult
+{
+    RayKind kind;
+    cl_uint numRays = 0;
+    cl_uint numHits = 0;    // closest hits found, or occluded shadow rays
+    double kernelMs = 0.0;  // per iteration, sum over batches
+    U64 checksum = 0;       // over hit triangle IDs / occlusion flags, equal across traversal variants
+    double sumT = 0.0;      // sum of hit distances, extension rays only
+
+    double MRaysPerSecond() const { return (kernelMs > 0.0) ? numRays / (kernelMs * 1000.0) : 0.0; }
+};
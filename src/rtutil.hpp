@@ -6,6 +6,13 @@
 #include <iostream>
 #include <cfloat>
 
+// SSE box operations for the builders' inner loops, define RT_NO_SIMD for the scalar path.
+// Both produce bit-identical boxes: same min/max operand order, same summation order in area().
+#if !defined(RT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RT_SIMD_SSE
+#include <emmintrin.h>
+#endif
+
 namespace fr = FireRays;
 
 // TODO: remove these!
@@ -13,21 +20,67 @@ typedef cl_uint U32;
 typedef cl_int S32;
 typedef cl_float F32;
 typedef cl_uchar U8;
+typedef cl_ulong U64;
 
 enum class SplitMode {
 	SpatialMedian,
 	ObjectMedian,
-	SAH
+	SAH,
+	BinnedSAH,
+	PresortedSAH	// same tree as SAH, references sorted once per axis
+};
+
+inline const char* splitModeName(SplitMode mode)
+{
+	switch (mode)
+	{
+	case SplitMode::SpatialMedian: return "Spatial Median";
+	case SplitMode::ObjectMedian: return "Object Median";
+	case SplitMode::SAH: return "SAH";
+	case SplitMode::BinnedSAH: return "Binned SAH";
+	case SplitMode::PresortedSAH: return "Presorted SAH";
+	default: return "Unknown";
+	}
+}
+
+// Hierarchy built on the OpenCL device instead of the host
+enum class DeviceBuildMode {
+	None,
+	LBVH,
+	PLOC
+};
+
+// Ray-triangle test used by the traversal kernels
+enum class TriangleTest {
+	MollerTrumbore, // edges and cross products computed per test
+	Woop,           // precomputed affine transform into unit triangle space
+	Watertight      // Woop, Benthin & Wald 2013, no gaps between adjacent triangles
+};
+
+// Order of binary nodes in memory
+enum class NodeLayout {
+	DepthFirst,   // left child at current + 1
+	VanEmdeBoas,  // recursive top/bottom subtree blocks
+	Clustered     // page-sized treelets grown by surface area
 };
 
 struct AABB_t {
     fr::float3 min, max;
     inline AABB_t() : min(FLT_MAX), max(-FLT_MAX) {}
     inline AABB_t(const fr::float3& min, const fr::float3& max) : min(min), max(max) {}
+#ifdef RT_SIMD_SSE
+	inline F32 area() const {
+		const __m128 d = _mm_sub_ps(_mm_loadu_ps(&max.x), _mm_loadu_ps(&min.x));
+		const __m128 p = _mm_mul_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(3, 0, 2, 1))); // xy, yz, zx
+		const __m128 s = _mm_add_ss(_mm_add_ss(p, _mm_movehl_ps(p, p)), _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+		return 2 * _mm_cvtss_f32(s);
+	}
+#else
 	inline F32 area() const {
         fr::float3 d(max - min);
         return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
     }
+#endif
 	inline U32 maxDim() const {
 		U32 axis = 0; // index of longest axis, assume x
         fr::float3 d = max - min;
@@ -38,6 +91,31 @@ struct AABB_t {
 	inline fr::float3 centroid() {
 		return 0.5f * (min + max);
 	}
+#ifdef RT_SIMD_SSE
+	inline void expand(const RTTriangle &t) {
+		merge(t.min(), t.max());
+	}
+	inline void expand(const AABB_t &box) {
+		merge(box.min, box.max);
+	}
+	inline void expand(const fr::float3 &p) {
+		merge(p, p);
+	}
+	inline void intersect(const AABB_t &box) {
+		// _mm_max_ps(a, b) = a > b ? a : b, matches std::max(b, a)
+		store(min, _mm_max_ps(_mm_loadu_ps(&box.min.x), _mm_loadu_ps(&min.x)));
+		store(max, _mm_min_ps(_mm_loadu_ps(&box.max.x), _mm_loadu_ps(&max.x)));
+	}
+private:
+	inline void merge(const fr::float3 &lo, const fr::float3 &hi) {
+		store(min, _mm_min_ps(_mm_loadu_ps(&lo.x), _mm_loadu_ps(&min.x)));
+		store(max, _mm_max_ps(_mm_loadu_ps(&hi.x), _mm_loadu_ps(&max.x)));
+	}
+	static inline void store(fr::float3 &dst, __m128 v) {
+		// w = 0 like vmin/vmax, keeps exported nodes byte-identical
+		_mm_storeu_ps(&dst.x, _mm_and_ps(v, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))));
+	}
+#else
 	inline void expand(const RTTriangle &t) {
 		min = vmin(min, t.min());
 		max = vmax(max, t.max());
@@ -54,6 +132,7 @@ struct AABB_t {
 		min = vmax(min, box.min);
 		max = vmin(max, box.max);
 	}
+#endif
 };
 
 inline std::ostream& operator<<(std::ostream& os, const fr::float4& v) {
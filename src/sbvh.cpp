@@ -1,40 +1,49 @@
 #include "sbvh.hpp"
 #include "progressview.hpp"
+#include <future>
 
-SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progressView)
+SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progressView, U32 numThreads)
 {
 	m_triangles = tris;
 	progress = progressView;
+	setBuildThreads(numThreads);
 
 	NodeSpec rootSpec;
 	rootSpec.refs = tris->size();
 
 	// Setup references. New ones are added (splitting)
 	// and removed (leaf node creation) during building
-	m_refs.resize(rootSpec.refs);
+	BuildState root;
+	root.isMain = true;
+	reserveState(root, rootSpec.refs);
+	root.refs.resize(rootSpec.refs);
 	
 	size_t tris_sz = m_triangles->size();
 	
 	for (size_t i = 0; i < tris_sz; i++)
 	{
-		m_refs[i] = TriRef(i, (*m_triangles)[i]);
-		rootSpec.box.expand(m_refs[i].box);
+		root.refs[i] = TriRef(i, (*m_triangles)[i]);
+		rootSpec.box.expand(root.refs[i].box);
 	}
 
-	// Shared vector to avoid reallocations
-	rightBoxes.resize(std::max(tris_sz, (size_t)NumSpatialBins) - 1);
 	minOverlap = rootSpec.box.area() * splitAlpha;
 
 	// Perform building
-	SBVHNode* root = build(rootSpec, 0, 0.0f, 1.0f);
+	S32 rootNode = build(root, rootSpec, 0, 0.0f, 1.0f);
+	metrics = root.metrics;
+	std::vector<TriRef>().swap(root.refs);
+	std::vector<AABB_t>().swap(root.rightBoxes);
+	m_indices = std::move(root.indices);
+	m_indices.shrink_to_fit();
 	printf("\rSBVH builder: progress 100%% (%.2f%% duplicates)\n", metrics.duplicates * 100.0f / tris_sz);
 
 	// Indices relative to LAST triangle => reverse
 	std::reverse(m_indices.begin(), m_indices.end());
 
 	// Convert tree structure to small node vector
-	convertTree(root, -1);
-	root->deleteTree();
+	m_nodes.reserve(root.nodes.size());
+	convertTree(root.nodes, rootNode, -1);
+	std::vector<SBVHNode>().swap(root.nodes);
 	assert(metrics.depth <= MaxDepth);
 	assert(m_indices.size() >= m_triangles->size());
 
@@ -43,7 +52,7 @@ SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress
 	
 	std::cout
 		<< "======================" << std::endl
-		<< "SBVH" << std::endl
+		<< "SBVH (" << maxTasks << " threads)" << std::endl
 		<< "Splits: " << metrics.splits << " (" << int(metrics.bad_splits / float(metrics.splits) * 100.0f) << "% bad)" << std::endl
 		<< "Depth: " << metrics.depth << std::endl
 		<< "Leaves: " << metrics.splits + 1 << std::endl
@@ -51,72 +60,89 @@ SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress
 		<< "======================" << std::endl;
 }
 
-// Convert pointer tree to linear node vector
-void SBVH::convertTree(SBVHNode *node, S32 parentId)
+// Size buffers for the expected duplication, so that the stacks rarely reallocate while building
+void SBVH::reserveState(BuildState &st, size_t numRefs) const
 {
+	const size_t budget = numRefs + (size_t)(numRefs * duplicationBudget);
+	st.refs.reserve(budget);
+	st.indices.reserve(budget);
+	st.nodes.reserve(2 * budget);
+	st.rightBoxes.resize(std::max(numRefs, (size_t)NumSpatialBins) - 1);
+}
+
+// Convert pooled tree to linear node vector
+void SBVH::convertTree(const std::vector<SBVHNode> &pool, S32 nodeId, S32 parentId)
+{
+	const SBVHNode &node = pool[nodeId];
 	U32 ind = m_nodes.size();
 	m_nodes.push_back(Node());
-	m_nodes[ind].box = node->box;
+	m_nodes[ind].box = node.box;
 	m_nodes[ind].parent = parentId;
+	m_nodes[ind].leftChild = ind + 1;
 
-	if (node->isLeaf())
+	if (node.isLeaf())
 	{
-		m_nodes[ind].iStart = m_indices.size() - node->hi;
-		U32 sp = node->spannedTris();
+		m_nodes[ind].iStart = m_indices.size() - node.hi;
+		U32 sp = node.spannedTris();
 		if (sp > std::numeric_limits<U8>::max())
 			throw std::runtime_error("Too many prims to fit into U8!");
 		m_nodes[ind].nPrims = (U8)(sp);
 	}
 	else
 	{
-		convertTree(node->leftChild, ind);
+		convertTree(pool, node.leftChild, ind);
 		m_nodes[ind].rightChild = m_nodes.size(); // save current vector size
-		convertTree(node->rightChild, ind);
+		convertTree(pool, node.rightChild, ind);
 	}
 }
 
 // Too frequent printing is actually a bottleneck!
-void SBVH::lazyPrintBuildStatus(F32 progress)
+void SBVH::lazyPrintBuildStatus(const BuildState &st, F32 progress)
 {
+	if (!st.isMain)
+		return;
+
 	S32 percentage = S32(ceil(progress * 100.0f));
 	if (percentage > buildPercentage)
 	{
 		buildPercentage = percentage;
-		F32 duplicates = metrics.duplicates * 100.0f / m_triangles->size();
+		F32 duplicates = st.metrics.duplicates * 100.0f / m_triangles->size();
 		printf("\rSBVH builder: progress %d%% (%.2f%% duplicates)", percentage, duplicates);
-		this->progress->showMessage("Building SBVH", percentage / 100.0f);
+		if (this->progress) // none for background builds
+			this->progress->showMessage("Building SBVH", percentage / 100.0f);
 	}
 }
 
 // Create leaf node. References are removed from stack.
 // Index list will be reversed after building to fix indexing.
-SBVHNode* SBVH::createLeaf(const NodeSpec& spec)
+S32 SBVH::createLeaf(BuildState &st, const NodeSpec& spec)
 {
 	for (int i = 0; i < spec.refs; i++)
 	{
-		TriRef last = m_refs.back();
-		m_refs.pop_back();
-		m_indices.push_back(last.ind);
+		TriRef last = st.refs.back();
+		st.refs.pop_back();
+		st.indices.push_back(last.ind);
 	}
 
-	int start = m_indices.size() - spec.refs;
-	int end = m_indices.size();
-	return new SBVHNode(spec.box, start, end);
+	U32 start = st.indices.size() - spec.refs;
+	U32 end = st.indices.size();
+	st.nodes.emplace_back(spec.box, start, end);
+	return (S32)st.nodes.size() - 1;
 }
 
 // SBVH construction algorithm, in line with Stich et al. chapter 4.1
-SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd)
+S32 SBVH::build(BuildState &st, NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd)
 {
-	lazyPrintBuildStatus(progressStart);
-	metrics.depth = std::max(metrics.depth, (U32)depth);
+	lazyPrintBuildStatus(st, progressStart);
+	st.metrics.depth = std::max(st.metrics.depth, (U32)depth);
 
 	if (spec.refs <= MinLeafElems || depth >= MaxDepth)
-		return createLeaf(spec);
+		return createLeaf(st, spec);
 
 	// 1. Find object split candidate using full SAH search
 	F32 parentArea = spec.box.area();
 	F32 nodeSAH = parentArea + parentArea;
-	SplitInfo objectSplit = sahSplit(spec, nodeSAH);
+	SplitInfo objectSplit = sahSplit(st, spec, nodeSAH);
 
 	// 2. Find spatial split candidate using chopped binning
 	SplitInfo spatialSplit;
@@ -125,7 +151,7 @@ SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progress
 		AABB_t overlap = objectSplit.leftBounds;
 		overlap.intersect(objectSplit.rightBounds);
 		if (overlap.area() >= minOverlap)
-			spatialSplit = binSplit(spec, nodeSAH);
+			spatialSplit = binSplit(st, spec, nodeSAH);
 	}
 
 	// 3. Select the winner candidate
@@ -136,43 +162,97 @@ SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progress
 	if (minCost == parentCost && spec.refs <= MaxLeafElems)
 	{
 		assert(spec.refs <= std::numeric_limits<U8>::max());
-		return createLeaf(spec);
+		return createLeaf(st, spec);
 	}
 
 	// Perform partitioning
 	NodeSpec left, right;
 	if (minCost == spatialSplit.cost)
-		partitionSpatial(left, right, spec, spatialSplit);
+		partitionSpatial(st, left, right, spec, spatialSplit);
 	if (!left.refs || !right.refs)
-		partitionObject(left, right, spec, objectSplit);
+		partitionObject(st, left, right, spec, objectSplit);
 
-	metrics.splits++;
+	st.metrics.splits++;
 
 	// Create inner node.
-	metrics.duplicates += left.refs + right.refs - spec.refs;
+	st.metrics.duplicates += left.refs + right.refs - spec.refs;
 	F32 progressMid = lerp(progressStart, progressEnd, (F32)right.refs / (F32)(left.refs + right.refs));
 
+	// Large left subtree => build it concurrently on a private stack
+	if (left.refs >= ParallelMinElems && tryAcquireTask())
+		return buildParallel(st, spec, left, right, depth, progressStart, progressMid, progressEnd);
+
 	// Built from right to left (so that duplicates can be added to end of ref list)
-	SBVHNode* rightNode = build(right, depth + 1, progressStart, progressMid);
-	SBVHNode* leftNode = build(left, depth + 1, progressMid, progressEnd);
+	S32 rightNode = build(st, right, depth + 1, progressStart, progressMid);
+	S32 leftNode = build(st, left, depth + 1, progressMid, progressEnd);
 
-	return new SBVHNode(spec.box, leftNode, rightNode);
+	st.nodes.emplace_back(spec.box, leftNode, rightNode);
+	return (S32)st.nodes.size() - 1;
 }
 
-BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
+// The left references sit directly below the right ones on the stack.
+// They are moved to a new task, the right subtree is built on the current stack.
+// The task's indices are appended after the right subtree's, which gives
+// the same index order as a serial build.
+S32 SBVH::buildParallel(BuildState &st, const NodeSpec &spec, NodeSpec &left, NodeSpec &right, int depth, F32 progressStart, F32 progressMid, F32 progressEnd)
+{
+	BuildState leftState;
+	reserveState(leftState, left.refs);
+	auto leftEnd = st.refs.end() - right.refs;
+	auto leftBegin = leftEnd - left.refs;
+	leftState.refs.assign(leftBegin, leftEnd);
+	st.refs.erase(leftBegin, leftEnd);
+
+	S32 leftNode = -1;
+	std::future<void> leftTask = std::async(std::launch::async, [&]()
+	{
+		leftNode = build(leftState, left, depth + 1, progressMid, progressEnd);
+		releaseTask();
+	});
+
+	S32 rightNode = build(st, right, depth + 1, progressStart, progressMid);
+	leftTask.get();
+
+	// The task's pool holds exactly the left subtree => append with offset leaf ranges and child indices
+	const U32 indexOffset = (U32)st.indices.size();
+	const S32 nodeOffset = (S32)st.nodes.size();
+	for (SBVHNode &n : leftState.nodes)
+	{
+		if (n.isLeaf())
+		{
+			n.lo += indexOffset;
+			n.hi += indexOffset;
+		}
+		else
+		{
+			n.leftChild += nodeOffset;
+			n.rightChild += nodeOffset;
+		}
+	}
+	leftNode += nodeOffset;
+
+	st.nodes.insert(st.nodes.end(), leftState.nodes.begin(), leftState.nodes.end());
+	st.indices.insert(st.indices.end(), leftState.indices.begin(), leftState.indices.end());
+	st.metrics.merge(leftState.metrics);
+
+	st.nodes.emplace_back(spec.box, leftNode, rightNode);
+	return (S32)st.nodes.size() - 1;
+}
+
+BVH::SplitInfo SBVH::sahSplit(BuildState &st, const NodeSpec& spec, F32 nodeSAH)
 {
 	F32 bestTieBreak = FLT_MAX;
 	SplitInfo info;
 
 	// Rightmost N references
-	int start = m_refs.size() - spec.refs;
-	int end = m_refs.size() - 1;
+	int start = st.refs.size() - spec.refs;
+	int end = st.refs.size() - 1;
 
 	// Loop over all three axes to find best split
 	for (U32 dim = 0; dim < 3; dim++)
 	{
 		// Sort along axis
-		sortReferences(start, end, dim);
+		sortReferences(st.refs, start, end, dim);
 
 		// Create AABB lookup
 		//buildBoxLookup(n);
@@ -180,8 +260,8 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 		AABB_t rightBounds;
 		for (int i = spec.refs - 1; i > 0; i--)
 		{
-			rightBounds.expand(m_refs[start + i].box);
-			rightBoxes[i - 1] = rightBounds; // use relative indexing (doesn't grow too large)
+			rightBounds.expand(st.refs[start + i].box);
+			st.rightBoxes[i - 1] = rightBounds; // use relative indexing (doesn't grow too large)
 		}
 
 		AABB_t leftBox;
@@ -190,10 +270,10 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 		// Try different split points along axis
 		for (int i = 1; i < spec.refs; i++) // exclude first and last
 		{
-			leftBox.expand(m_refs[start + i - 1].box);
+			leftBox.expand(st.refs[start + i - 1].box);
 			leftCount++;
 
-			AABB_t &rightBox = rightBoxes[i - 1];
+			AABB_t &rightBox = st.rightBoxes[i - 1];
 			F32 areaRight = rightBox.area();
 			F32 areaLeft = leftBox.area();
 
@@ -227,13 +307,13 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 }
 
 // Object split cheapest => just sort triangles, update reference ranges
-void SBVH::partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& info)
+void SBVH::partitionObject(BuildState &st, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& info)
 {
 	assert(info.dim > -1);
 	
-	int start = m_refs.size() - spec.refs;
-	int end = m_refs.size() - 1;
-	sortReferences(start, end, info.dim);
+	int start = st.refs.size() - spec.refs;
+	int end = st.refs.size() - 1;
+	sortReferences(st.refs, start, end, info.dim);
 
 	left.refs = info.i;
 	left.box = info.leftBounds;
@@ -241,19 +321,11 @@ void SBVH::partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec
 	right.box = info.rightBounds;
 }
 
-// Find cheapest spatial split using binned SAH
-// 1. Chop triangles into bins, update bin bounds + triangle counts
-// 2. Build area lookup (per bin boundary), calculate SAH, keep cheapest
-SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
+void SBVH::SpatialBins::clear()
 {
-    fr::float3 origin = spec.box.min;
-    fr::float3 binSize = (spec.box.max - origin) * (1.0f / (F32)NumSpatialBins);
-    fr::float3 invBinSize = 1.0f / binSize;
-
-	// Init bins
 	for (int dim = 0; dim < 3; dim++)
 	{
-		for (int i = 0; i < NumSpatialBins; i++) 
+		for (int i = 0; i < NumSpatialBins; i++)
 		{
 			Bin& bin = bins[dim][i];
 			bin.bounds = AABB_t();
@@ -261,11 +333,30 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 			bin.exiting = 0;
 		}
 	}
+}
 
-	// Perform chopped binning on spanned triangles
-	for (int refIdx = m_refs.size() - spec.refs; refIdx < m_refs.size(); refIdx++)
+void SBVH::SpatialBins::merge(const SpatialBins &other)
+{
+	for (int dim = 0; dim < 3; dim++)
 	{
-		const TriRef& ref = m_refs[refIdx];
+		for (int i = 0; i < NumSpatialBins; i++)
+		{
+			bins[dim][i].bounds.expand(other.bins[dim][i].bounds);
+			bins[dim][i].entering += other.bins[dim][i].entering;
+			bins[dim][i].exiting += other.bins[dim][i].exiting;
+		}
+	}
+}
+
+// Chop references into bins, update bin bounds + entering/exiting counts
+void SBVH::binReferences(SpatialBins &spatialBins, const TriRef *refs, int numRefs, const fr::float3 &origin, const fr::float3 &binSize, const fr::float3 &invBinSize) const
+{
+	Bin (&bins)[3][NumSpatialBins] = spatialBins.bins;
+	spatialBins.clear();
+
+	for (int refIdx = 0; refIdx < numRefs; refIdx++)
+	{
+		const TriRef& ref = refs[refIdx];
 
 		// Find bins that AABB overlaps
         fr::int3 firstBin = vclamp(fr::int3((ref.box.min - origin) * invBinSize), 0, NumSpatialBins - 1);
@@ -289,6 +380,49 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 			bins[dim][lastBin[dim]].exiting++;
 		}
 	}
+}
+
+// Find cheapest spatial split using binned SAH
+// 1. Chop triangles into bins (binReferences)
+// 2. Build area lookup (per bin boundary), calculate SAH, keep cheapest
+SBVH::SplitInfo SBVH::binSplit(BuildState &st, const NodeSpec& spec, F32 nodeSAH)
+{
+    fr::float3 origin = spec.box.min;
+    fr::float3 binSize = (spec.box.max - origin) * (1.0f / (F32)NumSpatialBins);
+    fr::float3 invBinSize = 1.0f / binSize;
+
+	// Perform chopped binning on spanned triangles.
+	// Large nodes are binned in chunks by several tasks, partial bins are merged
+	// in a fixed order (results don't depend on the number of threads).
+	const TriRef *refs = st.refs.data() + st.refs.size() - spec.refs;
+	const int chunkSize = ParallelMinElems;
+	std::vector<SpatialBins> partialBins;
+	std::vector<std::future<void>> tasks;
+	for (int begin = chunkSize; begin < spec.refs && tryAcquireTask(); begin += chunkSize)
+		partialBins.emplace_back();
+
+	const int numChunks = (int)partialBins.size() + 1;
+	const int perChunk = (spec.refs + numChunks - 1) / numChunks;
+	for (int c = 1; c < numChunks; c++)
+	{
+		tasks.push_back(std::async(std::launch::async, [&, c]()
+		{
+			int begin = c * perChunk;
+			int count = std::min(perChunk, spec.refs - begin);
+			binReferences(partialBins[c - 1], refs + begin, count, origin, binSize, invBinSize);
+			releaseTask();
+		}));
+	}
+
+	SpatialBins &spatialBins = st.spatialBins;
+	binReferences(spatialBins, refs, std::min(perChunk, spec.refs), origin, binSize, invBinSize);
+	for (int c = 1; c < numChunks; c++)
+	{
+		tasks[c - 1].get();
+		spatialBins.merge(partialBins[c - 1]);
+	}
+
+	const Bin (&bins)[3][NumSpatialBins] = spatialBins.bins;
 
 	// Select best split plane
 	SplitInfo split;
@@ -299,7 +433,7 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 		for (int i = NumSpatialBins - 1; i > 0; i--)
 		{
 			rightBounds.expand(bins[dim][i].bounds);
-			rightBoxes[i - 1] = rightBounds;
+			st.rightBoxes[i - 1] = rightBounds;
 		}
 
 		// Sweep left to right and select lowest SAH
@@ -314,7 +448,7 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 			rightNum -= bins[dim][i - 1].exiting;
 
 			F32 leftArea = leftBounds.area();
-			F32 rightArea = rightBoxes[i - 1].area();
+			F32 rightArea = st.rightBoxes[i - 1].area();
 			F32 sah = nodeSAH + leftArea * (leftNum) * 1 + rightArea * (rightNum) * 1;
 			if (sah < split.cost)
 			{
@@ -329,18 +463,18 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 
 // Spatial split was cheapest => distribute references (while potentially splitting)
 // Only chosen cheapest split dimension is considered
-void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split)
+void SBVH::partitionSpatial(BuildState &st, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split)
 {
 	// Left-hand side:      [leftStart, leftEnd[
 	// Uncategorized/split: [leftEnd, rightStart[
-	// Right-hand side:     [rightStart, m_refs.size()[
+	// Right-hand side:     [rightStart, st.refs.size()[
 
-	// The size of m_refs grows (adding duplicates) and shrinks
+	// The size of st.refs grows (adding duplicates) and shrinks
 	// (creating leaf nodes) dynamically during building
 
-	int leftStart = m_refs.size() - spec.refs;
+	int leftStart = st.refs.size() - spec.refs;
 	int leftEnd = leftStart;
-	int rightStart = m_refs.size();
+	int rightStart = st.refs.size();
 	left.box = right.box = AABB_t();
 
 	// Scan refs, swap non-intersecting tris to their corresponding sides
@@ -348,16 +482,16 @@ void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spe
 	for (int i = leftEnd; i < rightStart; i++)
 	{
 		// Entirely on the left-hand side?
-		if (m_refs[i].box.max[split.dim] <= split.pos)
+		if (st.refs[i].box.max[split.dim] <= split.pos)
 		{
-			left.box.expand(m_refs[i].box);
-			std::swap(m_refs[i], m_refs[leftEnd++]);
+			left.box.expand(st.refs[i].box);
+			std::swap(st.refs[i], st.refs[leftEnd++]);
 		}
 		// Entirely on the right-hand side?
-		else if (m_refs[i].box.min[split.dim] >= split.pos)
+		else if (st.refs[i].box.min[split.dim] >= split.pos)
 		{
-			right.box.expand(m_refs[i].box);
-			std::swap(m_refs[i--], m_refs[--rightStart]);
+			right.box.expand(st.refs[i].box);
+			std::swap(st.refs[i--], st.refs[--rightStart]);
 		}
 	}
 
@@ -365,22 +499,22 @@ void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spe
 	while (leftEnd < rightStart)
 	{
 		TriRef lref, rref;
-		splitReference(lref, rref, m_refs[leftEnd], split.dim, split.pos);
+		splitReference(lref, rref, st.refs[leftEnd], split.dim, split.pos);
 
 		// Check how unsplitting / duplicating affects existing AABBs
 		AABB_t lub = left.box;  // left unsplit
 		AABB_t rub = right.box; // right unsplit
 		AABB_t ldb = left.box;  // left duplicate
 		AABB_t rdb = right.box; // right duplicate
-		lub.expand(m_refs[leftEnd].box);
-		rub.expand(m_refs[leftEnd].box);
+		lub.expand(st.refs[leftEnd].box);
+		rub.expand(st.refs[leftEnd].box);
 		ldb.expand(lref.box);
 		rdb.expand(rref.box);
 
 		F32 lac = sahParams.costTri * (leftEnd - leftStart);
-		F32 rac = sahParams.costTri * (m_refs.size() - rightStart);
+		F32 rac = sahParams.costTri * (st.refs.size() - rightStart);
 		F32 lbc = sahParams.costTri * (leftEnd - leftStart + 1);
-		F32 rbc = sahParams.costTri * (m_refs.size() - rightStart + 1);
+		F32 rbc = sahParams.costTri * (st.refs.size() - rightStart + 1);
 
 		F32 unsplitLeftSAH = lub.area() * lbc + right.box.area() * rac;
 		F32 unsplitRightSAH = left.box.area() * lac + rub.area() * rbc;
@@ -395,23 +529,23 @@ void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spe
 		else if (minSAH == unsplitRightSAH)
 		{
 			right.box = rub;
-			std::swap(m_refs[leftEnd], m_refs[--rightStart]);
+			std::swap(st.refs[leftEnd], st.refs[--rightStart]);
 		}
 		else
 		{
 			left.box = ldb;
 			right.box = rdb;
-			m_refs[leftEnd++] = lref;
-			m_refs.push_back(rref);
+			st.refs[leftEnd++] = lref;
+			st.refs.push_back(rref);
 		}
 	}
 
 	left.refs = leftEnd - leftStart;
-	right.refs = m_refs.size() - rightStart;
+	right.refs = st.refs.size() - rightStart;
 }
 
 // Split triangle (reference) into two references based on bin boundary coord
-void SBVH::splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord)
+void SBVH::splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord) const
 {
 	left.ind = right.ind = ref.ind;
 	left.box = right.box = AABB_t();
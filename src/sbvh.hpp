@@ -11,27 +11,32 @@ struct SBVHNode;
 /*
 	Split BVH (SBVH), based on "Spatial Splits in Bounding Volume Hierarchies" by Stich et al.
 	Tree built from right to left, so that duplicated refs can be pushed to end of ref stack.
+	Large left subtrees are moved onto private stacks and built concurrently.
 	Based on implementation by Aila & Laine 09.
 */
 class SBVH : public BVH
 {
 public:
-	SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress);
-	SBVH(std::vector<RTTriangle>* tris, const std::string filename) : BVH(tris, filename) {}
+	SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress, U32 numThreads = 0);
 	~SBVH() {}
 
 private:
 	struct NodeSpec;
+	struct SpatialBins;
+	struct BuildState;
 
-	SBVHNode* build(NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd);
-	SBVHNode* createLeaf(const NodeSpec& spec);
-	SplitInfo binSplit(const NodeSpec& spec, F32 nodeSAH);
-	SplitInfo sahSplit(const NodeSpec& spec, F32 nodeSAH);
-	void partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
-	void partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
-	void splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord);
-	void lazyPrintBuildStatus(F32 progress);
-	void convertTree(SBVHNode *node, S32 parentId);
+	S32 build(BuildState &st, NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd);
+	S32 buildParallel(BuildState &st, const NodeSpec &spec, NodeSpec &left, NodeSpec &right, int depth, F32 progressStart, F32 progressMid, F32 progressEnd);
+	S32 createLeaf(BuildState &st, const NodeSpec& spec);
+	SplitInfo binSplit(BuildState &st, const NodeSpec& spec, F32 nodeSAH);
+	SplitInfo sahSplit(BuildState &st, const NodeSpec& spec, F32 nodeSAH);
+	void binReferences(SpatialBins &bins, const TriRef *refs, int numRefs, const fr::float3 &origin, const fr::float3 &binSize, const fr::float3 &invBinSize) const;
+	void partitionObject(BuildState &st, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
+	void partitionSpatial(BuildState &st, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
+	void splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord) const;
+	void lazyPrintBuildStatus(const BuildState &st, F32 progress);
+	void convertTree(const std::vector<SBVHNode> &pool, S32 node, S32 parentId);
+	void reserveState(BuildState &st, size_t numRefs) const;
 
 	enum
 	{
@@ -42,12 +47,20 @@ private:
 		NumSpatialBins = 128
 	};
 
-	struct
+	struct Metrics
 	{
 		U32 depth = 0;
 		U32 bad_splits = 0;
 		U32 splits = 0;
 		U32 duplicates = 0;
+
+		void merge(const Metrics &other)
+		{
+			depth = std::max(depth, other.depth);
+			bad_splits += other.bad_splits;
+			splits += other.splits;
+			duplicates += other.duplicates;
+		}
 	} metrics;
 
 	struct NodeSpec
@@ -64,9 +77,30 @@ private:
 		S32 exiting;
 	};
 
+	struct SpatialBins
+	{
+		Bin bins[3][NumSpatialBins];
+
+		void clear();
+		void merge(const SpatialBins &other);
+	};
+
+	// Each build task owns a reference stack, an index list and a node pool,
+	// so that independent subtrees can be built concurrently
+	struct BuildState
+	{
+		std::vector<TriRef> refs;
+		std::vector<U32> indices;
+		std::vector<SBVHNode> nodes;
+		std::vector<AABB_t> rightBoxes;
+		SpatialBins spatialBins;
+		Metrics metrics;
+		bool isMain = false; // only the main thread may update the UI
+	};
+
 	ProgressView *progress;
 	
-	Bin bins[3][NumSpatialBins];
 	F32 splitAlpha = 1e-5f; // ~35% duplication rate
+	F32 duplicationBudget = 0.4f; // expected duplicates per triangle, for preallocation
 	F32 minOverlap;         // min area that triggers spatial split search
 };
@@ -6,9 +6,11 @@
 #include "scene.hpp"
 #include "progressview.hpp"
 #include "utils.h"
+#include "settings.hpp"
 #include "bxdf_types.h"
 
 #include <set>
+#include <map>
 
 inline float toRoughness(float shininess)
 {
@@ -85,13 +87,13 @@ void Scene::loadModel(const std::string filename, ProgressView *progress, ModelT
         std::ifstream infile(converted);
         if (!infile.good())
         {
-            progress->showMessage("Converting PBRT to binary");
+            if (progress) progress->showMessage("Converting PBRT to binary");
             std::cout << "Converting PBRT file to PBF: " << filename << std::endl;
             convertPBRTModel(filename, converted);
         }        
         
         infile.close();
-        progress->showMessage("Loading PBRT binary file");
+        if (progress) progress->showMessage("Loading PBRT binary file");
         std::cout << "Loading PBRT binary file: " << converted << std::endl;
         loadPBFModel(converted, transform);
     }
@@ -111,6 +113,10 @@ void Scene::loadModel(const std::string filename, ProgressView *progress, ModelT
     {
         this->hash = fileHash(filename);
 
+        // Flat scenes become a single instance
+        if (Settings::getInstance().getUseInstancing() && instances.empty() && !triangles.empty())
+            addMeshInstance(0, fr::matrix());
+
         // Print elapsed time
         auto time2 = std::chrono::high_resolution_clock::now();
         std::cout << "Mesh loaded in: "
@@ -154,7 +160,7 @@ void Scene::loadObjWithMaterials(const std::string filePath, ProgressView *progr
     std::string folderPath = filePath.substr(0, fileNameStart + 1);
     std::string meshName = filePath.substr(fileNameStart + 1);
 
-    progress->showMessage("Loading mesh", meshName);
+    if (progress) progress->showMessage("Loading mesh", meshName);
     bool ret = tinyobj::LoadObj(&attrib, &shapesVec, &materialsVec, &warn, &err, filePath.c_str(), folderPath.c_str(), true, false);
 
     if (!warn.empty()) // `warn` may contain warning message.
@@ -198,7 +204,7 @@ void Scene::loadObjWithMaterials(const std::string filePath, ProgressView *progr
             // Progress bar
             size_t N = triangles.size();
             float done = (float)N / numTris;
-            if (N % 5000 == 0)
+            if (progress && N % 5000 == 0)
                 progress->showMessage("Converting mesh", meshName, done);
             
             VertexPNT V[3];
@@ -509,7 +515,8 @@ void Scene::loadPBFModel(const std::string filename, ModelTransform* transform)
     {
         scene = pbrt::Scene::loadFrom(filename);
         std::cout << scene->toString();
-        scene->makeSingleLevel();
+        if (!Settings::getInstance().getUseInstancing())
+            scene->makeSingleLevel();
     }
     catch (std::runtime_error e)
     {
@@ -523,14 +530,19 @@ void Scene::loadPBFModel(const std::string filename, ModelTransform* transform)
     std::string folderPath = filename.substr(0, fileNameStart + 1);
 
     auto toFloat3 = [](pbrt::vec3f v) { return fr::float3(v.x, v.y, v.z); };
+    auto toMatrix = [](const pbrt::affine3f &a)
+    {
+        return fr::matrix(a.l.vx.x, a.l.vy.x, a.l.vz.x, a.p.x,
+                          a.l.vx.y, a.l.vy.y, a.l.vz.y, a.p.y,
+                          a.l.vx.z, a.l.vy.z, a.l.vz.z, a.p.z,
+                          0, 0, 0, 1);
+    };
 
     //std::set<pbrt::Object::SP> geometries;
     std::vector<pbrt::Material::SP> pbrtMaterials;
 
-    std::function<void(pbrt::Object::SP, pbrt::affine3f xform)> traverse;
-    traverse = [&](pbrt::Object::SP object, pbrt::affine3f xform)
+    auto convertShapes = [&](pbrt::Object::SP object, pbrt::affine3f xform, ModelTransform *transform)
     {
-        //geometries.insert(object);
         for (auto shape : object->shapes)
         {
             int matId = 0;
@@ -626,6 +638,34 @@ void Scene::loadPBFModel(const std::string filename, ModelTransform* transform)
             else
                 std::cout << "unhandled geometry type : " << shape->toString() << std::endl;
         }
+    };
+
+    // Instanced: shapes of each object converted once in object space
+    const bool instancing = Settings::getInstance().getUseInstancing();
+    std::map<pbrt::Object*, cl_uint> objectMeshes;
+
+    std::function<void(pbrt::Object::SP, pbrt::affine3f xform)> traverse;
+    traverse = [&](pbrt::Object::SP object, pbrt::affine3f xform)
+    {
+        if (!instancing)
+        {
+            convertShapes(object, xform, transform);
+        }
+        else if (!object->shapes.empty())
+        {
+            auto prev = objectMeshes.find(object.get());
+            if (prev == objectMeshes.end())
+            {
+                const cl_uint first = (cl_uint)triangles.size();
+                convertShapes(object, pbrt::affine3f::identity(), nullptr);
+                meshes.push_back({ first, (cl_uint)triangles.size() - first });
+                prev = objectMeshes.insert({ object.get(), (cl_uint)meshes.size() - 1 }).first;
+            }
+
+            const fr::matrix objectToWorld = transform ? transform->toMatrix() * toMatrix(xform) : toMatrix(xform);
+            if (meshes[prev->second].count > 0)
+                instances.push_back({ prev->second, objectToWorld });
+        }
 
         for (auto inst : object->instances)
             traverse(inst->object, xform*inst->xfm);
@@ -874,10 +914,14 @@ void Scene::loadSceneFile(const std::string filename, ProgressView *progress)
     json sceneList;
     sceneStream >> sceneList;
 
+    // Instanced: repeated models reuse their meshes, untransformed instances kept per file
+    const bool instancing = Settings::getInstance().getUseInstancing();
+    std::map<std::string, std::vector<MeshInstance>> loaded;
+
     for(json sceneInfo : sceneList)
     {
         const std::string sceneFile = sceneInfo["file"].get<std::string>();
-        progress->showMessage("Loading Model " + sceneFile);
+        if (progress) progress->showMessage("Loading Model " + sceneFile);
         ModelTransform transform;
         if (json_contains(sceneInfo, "scale"))
         {
@@ -892,6 +936,40 @@ void Scene::loadSceneFile(const std::string filename, ProgressView *progress)
             }
         }
         std::string outputFolder = isAbsolutePath(sceneFile) ? sceneFile : folderPath + sceneFile;
-        loadModel(folderPath + sceneFile, progress, &transform);
+        if (!instancing)
+        {
+            loadModel(folderPath + sceneFile, progress, &transform);
+            continue;
+        }
+
+        auto prev = loaded.find(sceneFile);
+        if (prev == loaded.end())
+        {
+            const cl_uint firstTri = (cl_uint)triangles.size();
+            const size_t firstInst = instances.size();
+            ModelTransform identity;
+            loadModel(folderPath + sceneFile, progress, &identity);
+            if (instances.size() == firstInst)
+                addMeshInstance(firstTri, fr::matrix());
+
+            std::vector<MeshInstance> modelInstances(instances.begin() + firstInst, instances.end());
+            instances.resize(firstInst);
+            prev = loaded.insert({ sceneFile, modelInstances }).first;
+        }
+
+        const fr::matrix modelToWorld = transform.toMatrix();
+        for (const MeshInstance &inst : prev->second)
+            instances.push_back({ inst.mesh, modelToWorld * inst.objectToWorld });
     }
 }
+
+// Triangles from firstTri onwards form a new mesh
+void Scene::addMeshInstance(cl_uint firstTri, const fr::matrix &objectToWorld)
+{
+    const cl_uint count = (cl_uint)triangles.size() - firstTri;
+    if (count == 0)
+        return;
+
+    meshes.push_back({ firstTri, count });
+    instances.push_back({ (cl_uint)meshes.size() - 1, objectToWorld });
+}
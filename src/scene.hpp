@@ -13,6 +13,7 @@
 #include "envmap.hpp"
 #include "triangle.hpp"
 #include "geom.h"
+#include "math/matrix.hpp"
 
 namespace fr = FireRays;
 
@@ -29,6 +30,28 @@ struct ModelTransform
     {
         return p * scale + translation;
     }
+
+    fr::matrix toMatrix() const
+    {
+        return fr::matrix(scale, 0, 0, translation.x,
+                          0, scale, 0, translation.y,
+                          0, 0, scale, translation.z,
+                          0, 0, 0, 1);
+    }
+};
+
+// Two-level scenes: each mesh is a contiguous range of object-space triangles,
+// instances place meshes into the world with an affine transform
+struct MeshRange
+{
+    cl_uint start;
+    cl_uint count;
+};
+
+struct MeshInstance
+{
+    cl_uint mesh;
+    fr::matrix objectToWorld;
 };
 
 class Scene {
@@ -38,14 +61,18 @@ public:
 
     void loadEnvMap(const std::string filename);
     void setEnvMap(std::shared_ptr<EnvironmentMap> envMapPtr);
-    void loadModel(const std::string filename, ProgressView *progress, ModelTransform* transform = nullptr); // load .obj or .ply model
+    void loadModel(const std::string filename, ProgressView *progress, ModelTransform* transform = nullptr); // load .obj or .ply model, progress may be null
 
     std::vector<RTTriangle> &getTriangles() { return triangles; }
     std::vector<Material> &getMaterials() { return materials; }
     std::vector<Texture*> &getTextures() { return textures; }
+    std::vector<MeshRange> &getMeshes() { return meshes; }
+    std::vector<MeshInstance> &getInstances() { return instances; }
+    bool isInstanced() { return !instances.empty(); }
     std::shared_ptr<EnvironmentMap> getEnvMap() { return envmap; }
 
     std::string hashString();
+    size_t getHash() { return hash; }
     unsigned int getMaterialTypes() { return materialTypes; }
 
     fr::float3 getWorldRight() { return worldRight; }
@@ -61,6 +88,7 @@ private:
     void convertPBRTModel(const std::string filenameIn, const std::string filenameOut);
     void loadPBFModel(const std::string filename, ModelTransform* transform);
     void loadSceneFile(const std::string filename, ProgressView *progress);
+    void addMeshInstance(cl_uint firstTri, const fr::matrix &objectToWorld);
 
     // With tiny_obj_loader
     void loadObjWithMaterials(const std::string filename, ProgressView *progress, ModelTransform* transform);
@@ -77,6 +105,8 @@ private:
     std::vector<RTTriangle> triangles;
     std::vector<Material> materials;
     std::vector<Texture*> textures;
+    std::vector<MeshRange> meshes;
+    std::vector<MeshInstance> instances;
     size_t hash;
   
     fr::float3 worldRight = fr::float3(1.0f, 0.0f, 0.0f);
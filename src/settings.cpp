@@ -26,6 +26,22 @@ void Settings::init()
     wfBufferSize = 1 << 20; // appropriate for dedicated GPU
     clUseBitstack = false;
     clUseSoA = true;
+    bvhWidth = 2; // binary, 4 or 8 for collapsed traversal
+    bvhQuantBits = 0; // compressed binary nodes, 0 = off, 8 or 16
+    useSBVH = true;
+    bvhSplitMode = SplitMode::SAH;
+    bvhBuildThreads = 0; // 0 = all cores
+    bvhOptimizePasses = 0; // treelet restructuring, 0 = off
+    deviceBuildMode = DeviceBuildMode::None;
+    bvhNodeLayout = NodeLayout::DepthFirst;
+    triangleTest = TriangleTest::MollerTrumbore;
+    bvhLeafOrderTris = false; // triangle positions permuted into leaf order, no index buffer
+    useInstancing = false; // two-level hierarchy, top-level tree over per-mesh trees
+    bvhProgressive = false; // render on a binned BVH while the final one is built in the background
+    traversalStats = false; // per-pixel node visit and triangle test counts (wavefront), slower kernels
+    rayReordering = false; // sort wavefront extension/shadow queues by ray direction and origin before tracing
+    persistentThreads = false; // wavefront traversal launched per compute unit, rays fetched from the queues
+    packetTraversal = false; // wavefront camera rays traced as screen-tile packets, one per work-group
     useWavefront = false;
     useRussianRoulette = false;
     useSeparateQueues = false;
@@ -96,6 +112,68 @@ void Settings::import(json j)
     if (json_contains(j, "windowHeight")) this->windowHeight = j["windowHeight"].get<int>();
     if (json_contains(j, "clUseBitstack")) this->clUseBitstack = j["clUseBitstack"].get<bool>();
     if (json_contains(j, "clUseSoA")) this->clUseSoA = j["clUseSoA"].get<bool>();
+    if (json_contains(j, "bvhWidth"))
+    {
+        const unsigned int width = j["bvhWidth"].get<unsigned int>();
+        if (width == 2 || width == 4 || width == 8) this->bvhWidth = width;
+        else std::cout << "Unsupported bvhWidth: " << width << std::endl;
+    }
+    if (json_contains(j, "bvhQuantBits"))
+    {
+        const unsigned int bits = j["bvhQuantBits"].get<unsigned int>();
+        if (bits == 0 || bits == 8 || bits == 16) this->bvhQuantBits = bits;
+        else std::cout << "Unsupported bvhQuantBits: " << bits << std::endl;
+    }
+    if (json_contains(j, "useSBVH")) this->useSBVH = j["useSBVH"].get<bool>();
+    if (json_contains(j, "bvhSplitMode"))
+    {
+        const std::string mode = j["bvhSplitMode"].get<std::string>();
+        if (mode == "sah") this->bvhSplitMode = SplitMode::SAH;
+        else if (mode == "binned_sah") this->bvhSplitMode = SplitMode::BinnedSAH;
+        else if (mode == "presorted_sah") this->bvhSplitMode = SplitMode::PresortedSAH;
+        else if (mode == "spatial_median") this->bvhSplitMode = SplitMode::SpatialMedian;
+        else if (mode == "object_median") this->bvhSplitMode = SplitMode::ObjectMedian;
+        else std::cout << "Unknown bvhSplitMode: " << mode << std::endl;
+    }
+    if (json_contains(j, "bvhBuildThreads")) this->bvhBuildThreads = j["bvhBuildThreads"].get<unsigned int>();
+    if (json_contains(j, "bvhOptimizePasses")) this->bvhOptimizePasses = j["bvhOptimizePasses"].get<unsigned int>();
+    if (json_contains(j, "deviceBvhBuilder"))
+    {
+        const std::string mode = j["deviceBvhBuilder"].get<std::string>();
+        if (mode == "none") this->deviceBuildMode = DeviceBuildMode::None;
+        else if (mode == "lbvh") this->deviceBuildMode = DeviceBuildMode::LBVH;
+        else if (mode == "ploc") this->deviceBuildMode = DeviceBuildMode::PLOC;
+        else std::cout << "Unknown deviceBvhBuilder: " << mode << std::endl;
+    }
+    if (json_contains(j, "bvhLeafOrderTris")) this->bvhLeafOrderTris = j["bvhLeafOrderTris"].get<bool>();
+    if (json_contains(j, "bvhNodeLayout"))
+    {
+        const std::string layout = j["bvhNodeLayout"].get<std::string>();
+        if (layout == "depth_first") this->bvhNodeLayout = NodeLayout::DepthFirst;
+        else if (layout == "veb") this->bvhNodeLayout = NodeLayout::VanEmdeBoas;
+        else if (layout == "clustered") this->bvhNodeLayout = NodeLayout::Clustered;
+        else std::cout << "Unknown bvhNodeLayout: " << layout << std::endl;
+    }
+    if (json_contains(j, "triangleTest"))
+    {
+        const std::string test = j["triangleTest"].get<std::string>();
+        if (test == "moller_trumbore") this->triangleTest = TriangleTest::MollerTrumbore;
+        else if (test == "woop") this->triangleTest = TriangleTest::Woop;
+        else if (test == "watertight") this->triangleTest = TriangleTest::Watertight;
+        else std::cout << "Unknown triangleTest: " << test << std::endl;
+    }
+    if (json_contains(j, "useInstancing")) this->useInstancing = j["useInstancing"].get<bool>();
+    if (json_contains(j, "bvhProgressive")) this->bvhProgressive = j["bvhProgressive"].get<bool>();
+    if (json_contains(j, "traversalStats")) this->traversalStats = j["traversalStats"].get<bool>();
+    if (json_contains(j, "rayReordering")) this->rayReordering = j["rayReordering"].get<bool>();
+    if (json_contains(j, "persistentThreads")) this->persistentThreads = j["persistentThreads"].get<bool>();
+    if (json_contains(j, "packetTraversal")) this->packetTraversal = j["packetTraversal"].get<bool>();
+    if (this->useInstancing && (this->bvhWidth != 2 || this->bvhQuantBits != 0))
+    {
+        std::cout << "Instancing requires uncompressed binary nodes, ignoring bvhWidth and bvhQuantBits" << std::endl;
+        this->bvhWidth = 2;
+        this->bvhQuantBits = 0;
+    }
     if (json_contains(j, "wfBufferSize")) this->wfBufferSize = j["wfBufferSize"].get<unsigned int>();
     if (json_contains(j, "useWavefront")) this->useWavefront = j["useWavefront"].get<bool>();
     if (json_contains(j, "useRussianRoulette")) this->useRussianRoulette = j["useRussianRoulette"].get<bool>();
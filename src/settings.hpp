@@ -4,6 +4,7 @@
 #include <map>
 #include "json.hpp"
 #include "clcontext.hpp"
+#include "rtutil.hpp"
 
 typedef struct {
     vfloat3 pos;
@@ -53,6 +54,22 @@ public:
     void setRenderScale(float s) { renderScale = s; }
     bool getUseBitstack() { return clUseBitstack; }
     bool getUseSoA() { return clUseSoA; }
+    unsigned int getBvhWidth() { return bvhWidth; }
+    unsigned int getBvhQuantBits() { return bvhQuantBits; }
+    bool getUseSBVH() { return useSBVH; }
+    SplitMode getBvhSplitMode() { return bvhSplitMode; }
+    unsigned int getBvhBuildThreads() { return bvhBuildThreads; }
+    unsigned int getBvhOptimizePasses() { return bvhOptimizePasses; }
+    DeviceBuildMode getDeviceBuildMode() { return deviceBuildMode; }
+    NodeLayout getBvhNodeLayout() { return bvhNodeLayout; }
+    TriangleTest getTriangleTest() { return triangleTest; }
+    bool getBvhLeafOrderTris() { return bvhLeafOrderTris; }
+    bool getUseInstancing() { return useInstancing; }
+    bool getBvhProgressive() { return bvhProgressive; }
+    bool getTraversalStats() { return traversalStats; }
+    bool getRayReordering() { return rayReordering; }
+    bool getPersistentThreads() { return persistentThreads; }
+    bool getPacketTraversal() { return packetTraversal; }
     unsigned int getWfBufferSize() { return wfBufferSize; }
     bool getUseWavefront() { return useWavefront; }
     bool getUseRussianRoulette() { return useRussianRoulette; }
@@ -84,6 +101,22 @@ private:
     unsigned int wfBufferSize;
     bool clUseBitstack;
     bool clUseSoA;
+    unsigned int bvhWidth;
+    unsigned int bvhQuantBits;
+    bool useSBVH;
+    SplitMode bvhSplitMode;
+    unsigned int bvhBuildThreads;
+    unsigned int bvhOptimizePasses;
+    DeviceBuildMode deviceBuildMode;
+    NodeLayout bvhNodeLayout;
+    TriangleTest triangleTest;
+    bool bvhLeafOrderTris;
+    bool useInstancing;
+    bool bvhProgressive;
+    bool traversalStats;
+    bool rayReordering;
+    bool persistentThreads;
+    bool packetTraversal;
     int windowWidth;
     int windowHeight;
     float renderScale;
@@ -3,6 +3,8 @@
 
 #include "window.hpp"
 #include "progressview.hpp"
+#include "treelet.hpp"
+#include "twolevelbvh.hpp"
 #include "clcontext.hpp"
 #include "settings.hpp"
 #include "utils.h"
@@ -69,21 +71,49 @@ void Tracer::init(int width, int height, std::string sceneFile)
 {
     resetParams(width, height);
 
+    // Background build reads the old scene's triangles, finish it before they are freed
+    dropPendingHierarchy();
+    delete bvh;
+    bvh = nullptr;
+
     window->showMessage("Loading scene");
     selectScene(sceneFile);
     loadState();
     window->showMessage("Creating BVH");
-    initHierarchy();
+    AABB_t bounds;
+    // Device builder emits single-level uncompressed binary nodes only
+    const DeviceBuildMode deviceMode = (Settings::getInstance().getBvhWidth() == 2 && Settings::getInstance().getBvhQuantBits() == 0 && !scene->isInstanced()) ?
+        Settings::getInstance().getDeviceBuildMode() : DeviceBuildMode::None;
+    if (deviceMode != DeviceBuildMode::None && clctx->buildDeviceHierarchy(scene.get(), deviceMode, bounds))
+    {
+        // Geometry uploaded, hierarchy built in device memory
+        m_triangles = &scene->getTriangles();
+        params.n_tris = (cl_uint)m_triangles->size();
+    }
+    else
+    {
+        if (deviceMode != DeviceBuildMode::None)
+            std::cout << "Device BVH builder not supported, building on host" << std::endl;
 
-    // Diagonal gives maximum ray length within the scene
-    const AABB_t bounds = bvh->getSceneBounds();
-    params.worldRadius = cl_float(length(bounds.max - bounds.min) * 0.5f);
+        initHierarchy();
+        bounds = bvh->getSceneBounds();
 
-    window->showMessage("Uploading scene data");
-    clctx->uploadSceneData(bvh, scene.get());
+        window->showMessage("Uploading scene data");
+        clctx->uploadSceneData(bvh, scene.get());
 
-    // Data uploaded to GPU => no longer needed
-    delete bvh;
+        // Data uploaded to GPU => no longer needed,
+        // except for refitting layouts derived on the host
+        if (Settings::getInstance().getBvhWidth() == 2 && Settings::getInstance().getBvhQuantBits() == 0)
+        {
+            delete bvh;
+            bvh = nullptr;
+        }
+    }
+
+    // Diagonal gives maximum ray length within the scene
+    params.worldRadius = cl_float(length(bounds.max - bounds.min) * 0.5f);
+    params.worldMin = vfloat3(bounds.min.x, bounds.min.y, bounds.min.z);
+    params.worldMax = vfloat3(bounds.max.x, bounds.max.y, bounds.max.z);
 
     // Setup GUI sliders with correct values
     updateGUI();
@@ -212,6 +242,10 @@ void Tracer::update()
 
     glFinish(); // locks execution to refresh rate of display (GL)
 
+    // Background build finished, swap between frames
+    if (pendingHierarchy.valid() && pendingHierarchy.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        swapPendingHierarchy();
+
     // Update RenderParams in GPU memory if needed
     if(paramsUpdatePending)
     {
@@ -278,6 +312,8 @@ void Tracer::update()
             clctx->enqueueWfRaygenKernel(params);
             clctx->enqueueWfMaterialKernels(params);
             clctx->enqueueGetCounters(&cnt); // the subsequent kernels don't grow the queues
+            if (rayCapturePending)
+                clctx->captureRays(rayDump);
             clctx->enqueueWfExtRayKernel(params);
             clctx->enqueueWfShadowRayKernel(params);
 
@@ -285,6 +321,19 @@ void Tracer::update()
             clctx->enqueueClearWfQueues();
         }
 
+        if (rayCapturePending)
+        {
+            const std::string fileName = "rays_" + std::to_string(std::time(nullptr)) + ".bin";
+            rayDump.sceneHash = scene->getHash();
+            if (rayDump.exportTo(fileName))
+            {
+                std::cout << "Captured " << rayDump.count(RayKind::Primary) << " primary, " << rayDump.count(RayKind::Secondary)
+                    << " secondary and " << rayDump.count(RayKind::Shadow) << " shadow rays to " << fileName << std::endl;
+            }
+            rayDump.rays.clear();
+            rayCapturePending = false;
+        }
+
         // Reset bounces
         if (iteration == 0)
         {
@@ -807,6 +856,8 @@ void Tracer::runBenchmarkFromFile(std::string filename)
         std::string outputFile = outputFolder + sceneJson["outputFile"].get<std::string>();
         clctx->saveImage(outputFile + ".png", params);
         clctx->saveImage(outputFile + ".hdr", params);
+        if (Settings::getInstance().getTraversalStats())
+            clctx->saveTraversalStats(outputFile + "_traversal.hdr", params);
 
         // Process statistics for current scene
         logStats(currentTime - startTime, currentTime - lastLogTime);
@@ -881,6 +932,7 @@ void Tracer::selectScene(std::string file)
         file = (!selected.empty()) ? selected : "assets/egyptcat/egyptcat.obj";
     }
 
+    sceneFile = file;
     scene.reset(new Scene());
     scene->loadModel(file, window->getProgressView());
 	
@@ -930,29 +982,144 @@ void Tracer::initEnvMap()
     }
 }
 
+// Binary nodes are refitted in device memory, wide and compressed
+// nodes are derived again from the refitted host hierarchy
+void Tracer::refitHierarchy()
+{
+    if (scene->isInstanced())
+    {
+        std::cout << "Refit not supported for two-level hierarchies" << std::endl;
+        return;
+    }
+
+    // Background build saw the old positions
+    dropPendingHierarchy();
+
+    window->showMessage("Refitting BVH");
+    float degradation;
+    if (bvh)
+    {
+        degradation = bvh->refit();
+        clctx->uploadSceneData(bvh, scene.get());
+    }
+    else
+    {
+        degradation = clctx->refitDeviceHierarchy(scene.get());
+    }
+    std::cout << "BVH refit, SAH cost " << degradation << "x of original" << std::endl;
+
+    paramsUpdatePending = true;
+    window->hideMessage();
+}
+
+// Scene file edited on disk: same triangle count => positions copied in place and refitted,
+// otherwise the scene is reloaded with a full build
+void Tracer::reloadGeometry()
+{
+    if (sceneFile.empty())
+        return;
+
+    window->showMessage("Reloading geometry");
+    Scene fresh;
+    fresh.loadModel(sceneFile, nullptr);
+
+    std::vector<RTTriangle> &tris = scene->getTriangles();
+    if (scene->isInstanced() || fresh.getTriangles().size() != tris.size())
+    {
+        std::cout << "Scene topology changed, rebuilding BVH" << std::endl;
+        init(params.width, params.height, sceneFile);
+        return;
+    }
+
+    // Background build must not read the triangles while they change
+    dropPendingHierarchy();
+
+    // In place, hierarchy keeps pointing to the same storage
+    std::copy(fresh.getTriangles().begin(), fresh.getTriangles().end(), tris.begin());
+    refitHierarchy();
+}
+
 // Check if old hierarchy can be reused
 void Tracer::initHierarchy()
 {
-    const std::string hashFile = "data/hierarchies/hierarchy_" + sceneHash + ".bin";
+    auto& s = Settings::getInstance();
+    const SplitMode splitMode = s.getBvhSplitMode();
+    std::string builderTag = (s.getUseSBVH() ? "sbvh" : "bvh") + std::to_string((int)splitMode);
+
+    if (s.getBvhOptimizePasses() > 0) builderTag += "_opt" + std::to_string(s.getBvhOptimizePasses());
+
+    // Bottom-level trees cached per mesh, keyed on their own contents.
+    // The top-level tree is cheap and always rebuilt.
+    if (scene->isInstanced())
+    {
+        m_triangles = &scene->getTriangles();
+        params.n_tris = (cl_uint)m_triangles->size();
+        const U32 builderMode = (s.getUseSBVH() ? 0x100U : 0U) | (U32)splitMode | (s.getBvhOptimizePasses() << 16);
+        bvh = new TwoLevelBVH(scene.get(), splitMode, s.getUseSBVH(), window->getProgressView(), s.getBvhBuildThreads(),
+            s.getBvhOptimizePasses(), "data/hierarchies/mesh_" + builderTag, builderMode);
+        return;
+    }
+    const std::string hashFile = "data/hierarchies/hierarchy_" + sceneHash + "_" + builderTag + ".bin";
     const std::ifstream input(hashFile, std::ios::in);
 
-    if (input.good())
+    // Stored in the file header, a mismatch triggers a rebuild
+    const U32 builderMode = (s.getUseSBVH() ? 0x100U : 0U) | (U32)splitMode | (s.getBvhOptimizePasses() << 16);
+
+    std::cout << "Trinagles: " << scene->getTriangles().size() << std::endl;
+    if (input.good() && loadHierarchy(hashFile, scene->getTriangles(), builderMode))
+    {
+        std::cout << "Reused BVH" << std::endl;
+    }
+    else if (s.getBvhProgressive() && (s.getUseSBVH() || splitMode != SplitMode::BinnedSAH || s.getBvhOptimizePasses() > 0))
     {
-		std::cout << "Trinagles: " << scene->getTriangles().size() << std::endl;
-        std::cout << "Reusing BVH..." << std::endl;
-        loadHierarchy(hashFile, scene->getTriangles());
+        // Render on a binned hierarchy right away, final one replaces it when done
+        std::cout << "Building preview BVH..." << std::endl;
+        m_triangles = &scene->getTriangles();
+        params.n_tris = (cl_uint)m_triangles->size();
+        bvh = new BVH(m_triangles, SplitMode::BinnedSAH, s.getBvhBuildThreads());
+
+        std::vector<RTTriangle> *triangles = m_triangles;
+        const U64 sourceHash = scene->getHash();
+        pendingHierarchy = std::async(std::launch::async, [=]()
+        {
+            BVH *result = buildHierarchy(triangles, splitMode, nullptr);
+            result->exportTo(hashFile, sourceHash, builderMode);
+            return result;
+        });
     }
     else
     {
-		std::cout << "Trinagles: " << scene->getTriangles().size() << std::endl;
         std::cout << "Building BVH..." << std::endl;
-        constructHierarchy(scene->getTriangles(), SplitMode::SAH, window->getProgressView());
-        saveHierarchy(hashFile);
+        constructHierarchy(scene->getTriangles(), splitMode, window->getProgressView());
+        saveHierarchy(hashFile, builderMode);
     }
 }
 
+void Tracer::swapPendingHierarchy()
+{
+    BVH *result = pendingHierarchy.get();
+    clctx->swapHierarchy(result, scene.get());
+    std::cout << "Switched to final BVH" << std::endl;
+
+    // Host copy only kept for refitting layouts derived on the host
+    delete bvh;
+    bvh = nullptr;
+    if (Settings::getInstance().getBvhWidth() == 2 && Settings::getInstance().getBvhQuantBits() == 0)
+        delete result;
+    else
+        bvh = result;
+}
+
+// Builders cannot be interrupted, wait for the result and discard it
+void Tracer::dropPendingHierarchy()
+{
+    if (pendingHierarchy.valid())
+        delete pendingHierarchy.get();
+}
+
 Tracer::~Tracer()
 {
+    dropPendingHierarchy();
     delete window;
     delete clctx;
 }
@@ -1103,25 +1270,92 @@ void Tracer::saveImage()
         denoiser.denoise();
 #endif
     clctx->saveImage(fileName, params);
+    if (Settings::getInstance().getTraversalStats())
+        clctx->saveTraversalStats("traversal_" + std::to_string(epoch) + ".hdr", params);
+}
+
+void Tracer::captureRays()
+{
+    if (!useWavefront)
+    {
+        std::cout << "Ray capture requires the wavefront integrator" << std::endl;
+        return;
+    }
+    rayCapturePending = true;
+}
+
+// Traces captured rays through the packet, extension and shadow kernels without shading,
+// e.g. for comparing traversal variants and builders on identical input
+void Tracer::replayRays(std::string filename, unsigned int iterations)
+{
+    RayDump dump;
+    if (!dump.importFrom(filename))
+        return;
+
+    if (dump.sceneHash != scene->getHash())
+    {
+        std::cout << "Ray dump " << filename << " was captured from a different scene, aborting replay..." << std::endl;
+        return;
+    }
+
+    iterations = std::max(1u, iterations);
+    std::vector<RayReplayResult> results = clctx->replayRays(dump, iterations);
+
+    const char *kindNames[] = { "Primary", "Secondary", "Shadow" };
+    std::cout << std::endl << "Ray replay: " << filename << " (" << iterations << " iterations)" << std::endl;
+    for (const RayReplayResult &r : results)
+    {
+        printf("%-10s %9u rays, %9u %s, %8.3f ms, %8.2f MRays/s, checksum %016llx",
+            kindNames[(int)r.kind], r.numRays, r.numHits, (r.kind == RayKind::Shadow) ? "occluded" : "hits",
+            r.kernelMs, r.MRaysPerSecond(), (unsigned long long)r.checksum);
+        if (r.kind != RayKind::Shadow)
+            printf(", sum t %.6e", r.sumT);
+        printf("\n");
+    }
+
+    // Path state was overwritten
+    paramsUpdatePending = true;
 }
 
-void Tracer::loadHierarchy(const std::string filename, std::vector<RTTriangle>& triangles)
+bool Tracer::loadHierarchy(const std::string filename, std::vector<RTTriangle>& triangles, U32 builderMode)
 {
     m_triangles = &triangles;
     params.n_tris = (cl_uint)m_triangles->size();
-    bvh = new SBVH(m_triangles, filename);
+    bvh = new BVH(m_triangles);
+    if (bvh->importFrom(filename, scene->getHash(), builderMode))
+        return true;
+
+    delete bvh;
+    bvh = nullptr;
+    return false;
 }
 
-void Tracer::saveHierarchy(const std::string filename)
+void Tracer::saveHierarchy(const std::string filename, U32 builderMode)
 {
-    bvh->exportTo(filename);
+    bvh->exportTo(filename, scene->getHash(), builderMode);
 }
 
 void Tracer::constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode, ProgressView *progress)
 {
     m_triangles = &triangles;
     params.n_tris = (cl_uint)m_triangles->size();
-    bvh = new SBVH(m_triangles, splitMode, progress);
+    bvh = buildHierarchy(m_triangles, splitMode, progress);
+}
+
+// Final hierarchy as configured, safe to run off the main thread without progress view
+BVH *Tracer::buildHierarchy(std::vector<RTTriangle> *triangles, SplitMode splitMode, ProgressView *progress)
+{
+    auto& s = Settings::getInstance();
+    BVH *result;
+    if (s.getUseSBVH())
+        result = new SBVH(triangles, splitMode, progress, s.getBvhBuildThreads());
+    else
+        result = new BVH(triangles, splitMode, s.getBvhBuildThreads());
+
+    if (s.getBvhOptimizePasses() > 0)
+        TreeletOptimizer(*result, s.getBvhBuildThreads()).optimize(s.getBvhOptimizePasses());
+
+    return result;
 }
 
 void Tracer::initCamera()
@@ -1150,6 +1384,8 @@ void Tracer::initPostProcessing()
     PostProcessParams p;
     p.exposure = 1.0f;
     p.tmOperator = Settings::getInstance().getTonemap();
+    p.heatmap = 0;
+    p.heatmapScale = 100.0f;
 
     params.ppParams = p;
     paramsUpdatePending = true;
@@ -1341,6 +1577,7 @@ void Tracer::handleKeypress(int key, int scancode, int action, int mods)
         matchInit(GLFW_KEY_7,           toggleRenderer());
         matchInit(GLFW_KEY_F1,          initCamera());
         matchInit(GLFW_KEY_F3,          loadState());
+        matchInit(GLFW_KEY_F4,          reloadGeometry());
         matchInit(GLFW_KEY_SPACE,       updateAreaLight());
         matchInit(GLFW_KEY_I,           params.maxBounces += 1);
         matchInit(GLFW_KEY_K,           params.maxBounces = std::max(1u, params.maxBounces) - 1);
@@ -1351,6 +1588,7 @@ void Tracer::handleKeypress(int key, int scancode, int action, int mods)
         matchKeep(GLFW_KEY_F2,          saveState());
         matchKeep(GLFW_KEY_F5,          saveImage());
         matchKeep(GLFW_KEY_F6,          toggleDenoiserVisibility(););
+        matchKeep(GLFW_KEY_F7,          captureRays());
         matchKeep(GLFW_KEY_U,           toggleGUI());
         matchKeep(GLFW_KEY_P,           printDebug());
     }
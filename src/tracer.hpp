@@ -5,12 +5,14 @@
 #include <nanogui/nanogui.h>
 #include <string>
 #include <map>
+#include <future>
 #include "sbvh.hpp"
 #include "scene.hpp"
 #include "math/float2.hpp"
 #include "math/float3.hpp"
 #include "math/matrix.hpp"
 #include "geom.h"
+#include "raydump.hpp"
 
 #ifdef WITH_OPTIX
 #include "denoiser/OptixDenoiser.hpp"
@@ -34,6 +36,12 @@ public:
     // Load given scene (or open selector)
     void init(int width, int height, std::string sceneFile = "");
 
+    // Scene triangles moved in place, keeps the hierarchy topology
+    void refitHierarchy();
+
+    // Re-read current scene file, refit if only positions changed
+    void reloadGeometry();
+
     // Two modes of operation
     void renderInteractive();
     void renderSingle(int spp, bool denoise = false);
@@ -42,6 +50,7 @@ public:
     void update();
     void runBenchmark();
     void runBenchmarkFromFile(std::string filename);
+    void replayRays(std::string filename, unsigned int iterations); // traversal-only benchmark on captured rays
     void resizeBuffers(int w, int h);
     void handleMouseButton(int key, int action, int mods);
     void handleCursorPos(double x, double y);
@@ -80,9 +89,12 @@ private:
 private:
     // Create/load/export BVH
     void initHierarchy();
-    void loadHierarchy(const std::string filename, std::vector<RTTriangle> &triangles);
-    void saveHierarchy(const std::string filename);
+    bool loadHierarchy(const std::string filename, std::vector<RTTriangle> &triangles, U32 builderMode);
+    void saveHierarchy(const std::string filename, U32 builderMode);
     void constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode, ProgressView* progress);
+    static BVH *buildHierarchy(std::vector<RTTriangle> *triangles, SplitMode splitMode, ProgressView *progress);
+    void swapPendingHierarchy(); // finished background build => device
+    void dropPendingHierarchy();
 
     void printDebug();
 
@@ -93,6 +105,7 @@ private:
     void initPostProcessing();
     void initAreaLight();
     void saveImage();
+    void captureRays(); // rays of the next wavefront iteration => file
 
     // Shoot single picking ray through cursor
     Hit pickSingle();
@@ -128,12 +141,16 @@ private:
     float cameraSpeed = 1.0f;
     bool mouseButtonState[3] = { false, false, false };
     bool paramsUpdatePending = true; // force initial param update
+    bool rayCapturePending = false;
+    RayDump rayDump;
 
     std::shared_ptr<Scene> scene;
     std::shared_ptr<EnvironmentMap> envMap;
     BVH *bvh = nullptr;
+    std::future<BVH*> pendingHierarchy; // progressive mode, final hierarchy built in the background
     std::vector<RTTriangle>* m_triangles;
     std::string sceneHash;
+    std::string sceneFile; // currently loaded, for geometry reloads
     cl_uint iteration;
     int frontBuffer = 0;
     bool hasEnvMap = false;
@@ -366,6 +366,28 @@ void Tracer::addTonemapSettings(Widget *parent)
     });
     opBox->setSelectedIndex(2);
 
+    // Traversal cost view, counters only exist in stats builds
+    if (Settings::getInstance().getTraversalStats())
+    {
+        Widget *hmWidget = new Widget(tmPopup);
+        hmWidget->setLayout(new BoxLayout(Orientation::Horizontal));
+        auto hmLabel = new Label(hmWidget, "Heatmap");
+        hmLabel->setFixedWidth(60);
+        auto hmBox = new ComboBox(hmWidget, { "Off", "Node visits", "Triangle tests" });
+        hmBox->setFixedWidth(172);
+        hmBox->setCallback([&](int idx) {
+            params.ppParams.heatmap = idx;
+            clctx->updateParams(params);
+        });
+
+        FloatWidget* scaleWidget = addFloatWidget(tmPopup, "Heat max", "HEATMAP_SCALE", 1.0f, 500.0f, [this](float val) {
+            params.ppParams.heatmapScale = val;
+            clctx->updateParams(params);
+        });
+        scaleWidget->slider->setValue(params.ppParams.heatmapScale);
+        scaleWidget->box->setValue(params.ppParams.heatmapScale);
+    }
+
     // Reset
     Button *resetButton = new Button(tmPopup, "Reset");
     resetButton->setCallback([expWidget, opBox, this]() {
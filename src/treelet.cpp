@@ -0,0 +1,334 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include "treelet.hpp"
+
+TreeletOptimizer::TreeletOptimizer(BVH &bvh, U32 numThreads) : bvh(bvh)
+{
+	this->numThreads = (numThreads > 0) ? numThreads : std::max(1U, std::thread::hardware_concurrency());
+}
+
+F32 TreeletOptimizer::optimize(U32 passes)
+{
+	if (bvh.m_nodes.size() < 3 || passes == 0)
+		return 0.0f;
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	importNodes();
+	const F32 costBefore = totalCost();
+
+	// Disjoint subtrees below taskDepth are processed in parallel, the top of the tree serially
+	const U32 taskDepth = (numThreads > 1) ? (U32)std::ceil(std::log2(numThreads * 8.0f)) : 0;
+
+	for (U32 pass = 0; pass < passes; pass++)
+	{
+		printf("\rTreelet optimizer: pass %u/%u", pass + 1, passes);
+
+		std::vector<S32> roots;
+		std::vector<std::pair<S32, U32>> stack = { { 0, 0 } };
+		while (!stack.empty())
+		{
+			const std::pair<S32, U32> e = stack.back();
+			stack.pop_back();
+			const OptNode &n = nodes[e.first];
+			if (n.isLeaf())
+				continue;
+			if (e.second == taskDepth)
+			{
+				roots.push_back(e.first);
+				continue;
+			}
+			stack.push_back({ n.left, e.second + 1 });
+			stack.push_back({ n.right, e.second + 1 });
+		}
+
+		std::atomic<U32> next{ 0 };
+		auto worker = [&]()
+		{
+			for (U32 i = next++; i < roots.size(); i = next++)
+				optimizeSubtree(roots[i], 0, ~0U);
+		};
+
+		std::vector<std::thread> workers;
+		for (U32 t = 1; t < std::min(numThreads, (U32)roots.size()); t++)
+			workers.emplace_back(worker);
+		worker();
+		for (std::thread &t : workers)
+			t.join();
+
+		optimizeSubtree(0, 0, taskDepth);
+	}
+
+	const F32 costAfter = totalCost();
+	const U32 depth = maxDepth();
+	exportNodes();
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	const F32 reduction = 1.0f - costAfter / costBefore;
+
+	std::cout
+		<< std::endl
+		<< "======================" << std::endl
+		<< "Treelet optimization (" << numThreads << " threads)" << std::endl
+		<< "Passes: " << passes << std::endl
+		<< "Restructured: " << restructured.load() << std::endl
+		<< "SAH cost: " << costBefore << " -> " << costAfter << " (-" << reduction * 100.0f << "%)" << std::endl
+		<< "Depth: " << depth << std::endl
+		<< "Time: " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl
+		<< "======================" << std::endl;
+
+	if (depth > BVH::MaxDepth)
+		std::cout << "WARN: optimized BVH might not fit traversal stack! (" << depth << " > " << BVH::MaxDepth << ")" << std::endl;
+
+	return reduction;
+}
+
+void TreeletOptimizer::importNodes()
+{
+	const std::vector<Node> &src = bvh.m_nodes;
+	nodes.clear();
+	nodes.resize(src.size());
+
+	for (size_t i = 0; i < src.size(); i++)
+	{
+		OptNode &n = nodes[i];
+		n.box = src[i].box;
+		n.parent = src[i].parent;
+		if (src[i].nPrims > 0)
+		{
+			n.iStart = src[i].iStart;
+			n.nPrims = src[i].nPrims;
+		}
+		else
+		{
+			n.left = (S32)src[i].leftChild;
+			n.right = (S32)src[i].rightChild;
+		}
+	}
+
+	// Children are always stored after their parent
+	for (size_t i = src.size(); i-- > 0;)
+		updateCost((S32)i);
+}
+
+// Depth-first layout, left child at current + 1
+void TreeletOptimizer::exportNodes()
+{
+	struct Entry
+	{
+		S32 node;
+		S32 parent;
+		bool isRight;
+	};
+
+	std::vector<Node> out;
+	out.reserve(nodes.size());
+	std::vector<Entry> stack = { { 0, -1, false } };
+
+	while (!stack.empty())
+	{
+		const Entry e = stack.back();
+		stack.pop_back();
+
+		const OptNode &src = nodes[e.node];
+		const S32 idx = (S32)out.size();
+		if (e.isRight)
+			out[e.parent].rightChild = (U32)idx;
+
+		Node n;
+		n.box = src.box;
+		n.parent = e.parent;
+		n.leftChild = (U32)idx + 1;
+		if (src.isLeaf())
+		{
+			n.iStart = src.iStart;
+			n.nPrims = src.nPrims;
+		}
+		else
+		{
+			n.rightChild = 0; // patched when right subtree is emitted
+			stack.push_back({ src.right, idx, true });
+			stack.push_back({ src.left, idx, false });
+		}
+		out.push_back(n);
+	}
+
+	bvh.m_nodes.swap(out);
+	nodes.clear();
+	nodes.shrink_to_fit();
+}
+
+// Post-order: subtrees are optimized before the treelet rooted at their parent
+void TreeletOptimizer::optimizeSubtree(S32 node, U32 depth, U32 stopDepth)
+{
+	if (nodes[node].isLeaf() || depth == stopDepth)
+		return;
+
+	optimizeSubtree(nodes[node].left, depth + 1, stopDepth);
+	optimizeSubtree(nodes[node].right, depth + 1, stopDepth);
+	updateCost(node);
+
+	if (restructure(node))
+		restructured++;
+}
+
+inline U32 singleIndex(U32 set)
+{
+	U32 i = 0;
+	while (!((set >> i) & 1U))
+		i++;
+	return i;
+}
+
+bool TreeletOptimizer::restructure(S32 root)
+{
+	// Grow treelet by expanding the largest subtree
+	S32 leaves[MaxTreeletLeaves];
+	S32 inner[MaxTreeletLeaves - 1];
+	U32 numLeaves = 2, numInner = 1;
+	leaves[0] = nodes[root].left;
+	leaves[1] = nodes[root].right;
+	inner[0] = root;
+
+	while (numLeaves < MaxTreeletLeaves)
+	{
+		S32 largest = -1;
+		F32 largestArea = -1.0f;
+		for (U32 i = 0; i < numLeaves; i++)
+		{
+			const OptNode &n = nodes[leaves[i]];
+			if (!n.isLeaf() && n.box.area() > largestArea)
+			{
+				largest = (S32)i;
+				largestArea = n.box.area();
+			}
+		}
+		if (largest == -1)
+			break;
+
+		const S32 expanded = leaves[largest];
+		inner[numInner++] = expanded;
+		leaves[largest] = nodes[expanded].left;
+		leaves[numLeaves++] = nodes[expanded].right;
+	}
+
+	if (numLeaves < 3)
+		return false; // only one possible topology
+
+	// Optimal cost of every leaf subset
+	const U32 full = (1U << numLeaves) - 1;
+	AABB_t boxes[MaxSubsets];
+	F32 costs[MaxSubsets];
+	U8 splits[MaxSubsets];
+
+	for (U32 s = 1; s <= full; s++)
+	{
+		const U32 low = s & (~s + 1); // lowest set bit
+		if (s == low)
+		{
+			const OptNode &leaf = nodes[leaves[singleIndex(s)]];
+			boxes[s] = leaf.box;
+			costs[s] = leaf.cost;
+			continue;
+		}
+
+		boxes[s] = boxes[low];
+		boxes[s].expand(boxes[s ^ low]);
+
+		// Partitions containing the lowest leaf => each split visited once
+		F32 bestCost = FLT_MAX;
+		U32 bestSplit = 0;
+		for (U32 p = (s - 1) & s; p > 0; p = (p - 1) & s)
+		{
+			if (!(p & low))
+				continue;
+			const F32 c = costs[p] + costs[s ^ p];
+			if (c < bestCost)
+			{
+				bestCost = c;
+				bestSplit = p;
+			}
+		}
+		costs[s] = bvh.sahParams.costBox * boxes[s].area() + bestCost;
+		splits[s] = (U8)bestSplit;
+	}
+
+	// Root keeps its own (possibly larger) box
+	const OptNode &r = nodes[root];
+	const F32 newCost = costs[full] + bvh.sahParams.costBox * (r.box.area() - boxes[full].area());
+	if (newCost >= r.cost * (1.0f - 1e-5f))
+		return false;
+
+	// Rebuild with the same inner node slots, root keeps its index and parent
+	struct Item { U32 set; S32 node; };
+	Item stack[MaxTreeletLeaves];
+	S32 order[MaxTreeletLeaves - 1];
+	U32 top = 0, numOrdered = 0, nextSlot = 1;
+	stack[top++] = { full, root };
+
+	while (top > 0)
+	{
+		const Item it = stack[--top];
+		order[numOrdered++] = it.node;
+
+		const U32 sets[2] = { splits[it.set], it.set ^ splits[it.set] };
+		S32 children[2];
+		for (int c = 0; c < 2; c++)
+		{
+			if ((sets[c] & (sets[c] - 1)) == 0)
+			{
+				children[c] = leaves[singleIndex(sets[c])];
+			}
+			else
+			{
+				children[c] = inner[nextSlot++];
+				nodes[children[c]].box = boxes[sets[c]];
+				stack[top++] = { sets[c], children[c] };
+			}
+			nodes[children[c]].parent = it.node;
+		}
+		nodes[it.node].left = children[0];
+		nodes[it.node].right = children[1];
+	}
+
+	for (U32 i = numOrdered; i-- > 0;)
+		updateCost(order[i]);
+
+	return true;
+}
+
+void TreeletOptimizer::updateCost(S32 i)
+{
+	OptNode &n = nodes[i];
+	if (n.isLeaf())
+		n.cost = bvh.sahParams.costTri * n.nPrims * n.box.area();
+	else
+		n.cost = bvh.sahParams.costBox * n.box.area() + nodes[n.left].cost + nodes[n.right].cost;
+}
+
+// Normalized by root area
+F32 TreeletOptimizer::totalCost() const
+{
+	return nodes[0].cost / nodes[0].box.area();
+}
+
+U32 TreeletOptimizer::maxDepth() const
+{
+	U32 depth = 0;
+	std::vector<std::pair<S32, U32>> stack = { { 0, 0 } };
+	while (!stack.empty())
+	{
+		const std::pair<S32, U32> e = stack.back();
+		stack.pop_back();
+		depth = std::max(depth, e.second);
+		const OptNode &n = nodes[e.first];
+		if (!n.isLeaf())
+		{
+			stack.push_back({ n.left, e.second + 1 });
+			stack.push_back({ n.right, e.second + 1 });
+		}
+	}
+	return depth;
+}
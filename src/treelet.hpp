@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include "bvh.hpp"
+
+/*
+ * Post-build quality pass (Karras & Aila 2013, "Fast Parallel Construction of
+ * High-Quality Bounding Volume Hierarchies"): every inner node grows a treelet of
+ * up to MaxTreeletLeaves subtrees and replaces it with the SAH-optimal topology.
+ * Leaf contents and the index list are left untouched, only inner nodes move.
+ */
+class TreeletOptimizer
+{
+public:
+	TreeletOptimizer(BVH &bvh, U32 numThreads = 0);
+
+	// Rewrites bvh.m_nodes in depth-first order, returns relative SAH reduction
+	F32 optimize(U32 passes);
+
+private:
+	struct OptNode
+	{
+		AABB_t box;
+		F32 cost = 0.0f;  // SAH cost of subtree (unnormalized)
+		S32 parent = -1;
+		S32 left = -1;    // -1 for leaves
+		S32 right = -1;
+		U32 iStart = 0;
+		U8 nPrims = 0;
+		inline bool isLeaf() const { return left == -1; }
+	};
+
+	enum
+	{
+		MaxTreeletLeaves = 7,
+		MaxSubsets = 1 << MaxTreeletLeaves
+	};
+
+	void importNodes();
+	void exportNodes();
+	void optimizeSubtree(S32 node, U32 depth, U32 stopDepth);
+	bool restructure(S32 root);
+	void updateCost(S32 node);
+	F32 totalCost() const;
+	U32 maxDepth() const;
+
+	BVH &bvh;
+	std::vector<OptNode> nodes;
+	U32 numThreads;
+	std::atomic<U32> restructured{ 0 };
+};
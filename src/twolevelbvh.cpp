@@ -0,0 +1,238 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include "twolevelbvh.hpp"
+#include "sbvh.hpp"
+#include "treelet.hpp"
+#include "scene.hpp"
+#include "utils.h"
+
+static_assert(sizeof(GPUInstance) == sizeof(Node), "Instance records must fit one node slot");
+
+// World-space box of a transformed object-space box
+static AABB_t transformBox(const AABB_t &box, const fr::matrix &m)
+{
+	AABB_t res;
+	for (U32 c = 0; c < 8; c++)
+	{
+		const fr::float3 p((c & 1) ? box.max.x : box.min.x, (c & 2) ? box.max.y : box.min.y, (c & 4) ? box.max.z : box.min.z);
+		const fr::float3 w = m * p + fr::float3(m.m03, m.m13, m.m23);
+		res.min = vmin(res.min, w);
+		res.max = vmax(res.max, w);
+	}
+	return res;
+}
+
+TwoLevelBVH::TwoLevelBVH(Scene *scene, SplitMode mode, bool useSBVH, ProgressView *progress, U32 numThreads,
+	U32 optimizePasses, const std::string cachePrefix, U32 builderMode)
+	: m_useSBVH(useSBVH), m_progress(progress), m_numThreads(numThreads), m_optimizePasses(optimizePasses),
+	  m_cachePrefix(cachePrefix), m_builderMode(builderMode)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	m_triangles = &scene->getTriangles();
+	m_mode = mode;
+	const std::vector<MeshRange> &meshes = scene->getMeshes();
+	const std::vector<MeshInstance> &instances = scene->getInstances();
+	if (instances.empty())
+		throw std::runtime_error("Two-level BVH needs at least one instance");
+
+	const U32 numInstances = (U32)instances.size();
+	m_numTopNodes = 2 * numInstances - 1;
+
+	// Bottom level, unreferenced meshes are skipped
+	std::vector<bool> used(meshes.size(), false);
+	for (const MeshInstance &inst : instances)
+		used[inst.mesh] = true;
+
+	std::vector<Node> blasNodes;
+	std::vector<AABB_t> meshBoxes(meshes.size());
+	m_blasRoots.assign(meshes.size(), 0);
+	const U32 blasBase = m_numTopNodes + numInstances;
+	U32 numBuilt = 0, numCached = 0;
+
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		if (!used[m])
+			continue;
+
+		const MeshRange &range = meshes[m];
+		std::vector<RTTriangle> meshTris(m_triangles->begin() + range.start, m_triangles->begin() + range.start + range.count);
+		bool cached = false;
+		BVH *blas = buildBottomLevel(meshTris, cached);
+		(cached ? numCached : numBuilt)++;
+
+		const U32 nodeBase = blasBase + (U32)blasNodes.size();
+		const U32 indexBase = (U32)m_indices.size();
+		for (Node n : blas->m_nodes)
+		{
+			if (n.parent != -1)
+				n.parent += (S32)nodeBase;
+			if (n.nPrims > 0)
+			{
+				n.iStart += indexBase;
+			}
+			else
+			{
+				n.leftChild += nodeBase;
+				n.rightChild += nodeBase;
+			}
+			blasNodes.push_back(n);
+		}
+		for (U32 i : blas->m_indices)
+			m_indices.push_back(i + range.start);
+
+		m_blasRoots[m] = nodeBase;
+		meshBoxes[m] = blas->getSceneBounds();
+		delete blas;
+	}
+
+	// Top level over world-space instance boxes
+	std::vector<AABB_t> instBoxes(numInstances);
+	std::vector<U32> ids(numInstances);
+	m_instanceMesh.resize(numInstances);
+	for (U32 i = 0; i < numInstances; i++)
+	{
+		instBoxes[i] = transformBox(meshBoxes[instances[i].mesh], instances[i].objectToWorld);
+		m_instanceMesh[i] = instances[i].mesh;
+		ids[i] = i;
+	}
+
+	m_nodes.clear();
+	m_nodes.reserve(blasBase + blasNodes.size());
+	buildTopLevel(ids, instBoxes, 0, numInstances, -1);
+
+	// Instance records
+	for (U32 i = 0; i < numInstances; i++)
+	{
+		const fr::matrix w2o = inverse(instances[i].objectToWorld);
+		GPUInstance rec;
+		for (U32 r = 0; r < 3; r++)
+			for (U32 c = 0; c < 4; c++)
+				rec.worldToObject[r * 4 + c] = w2o.m[r][c];
+
+		Node slot;
+		std::memcpy(&slot, &rec, sizeof(Node));
+		m_nodes.push_back(slot);
+	}
+
+	m_nodes.insert(m_nodes.end(), blasNodes.begin(), blasNodes.end());
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	std::cout
+		<< "======================" << std::endl
+		<< "Two-level BVH" << std::endl
+		<< "Meshes: " << meshes.size() << " (" << numBuilt << " built, " << numCached << " cached)" << std::endl
+		<< "Instances: " << numInstances << std::endl
+		<< "Nodes: " << m_numTopNodes << " top, " << blasNodes.size() << " bottom" << std::endl
+		<< "Time: " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl
+		<< "======================" << std::endl;
+}
+
+// Cached trees are keyed on the object-space positions, shading attributes do not matter
+BVH *TwoLevelBVH::buildBottomLevel(std::vector<RTTriangle> &meshTris, bool &cached)
+{
+	std::string filename;
+	U64 meshHash = 0;
+	if (!m_cachePrefix.empty())
+	{
+		std::vector<F32> positions;
+		positions.reserve(meshTris.size() * 9);
+		for (const RTTriangle &t : meshTris)
+			for (const fr::float3 &p : { t.v0.p, t.v1.p, t.v2.p })
+				positions.insert(positions.end(), { p.x, p.y, p.z });
+
+		meshHash = (U64)computeHash(positions.data(), positions.size() * sizeof(F32));
+		std::stringstream ss;
+		ss << m_cachePrefix << "_" << std::hex << meshHash << ".bin";
+		filename = ss.str();
+
+		BVH *blas = new BVH(&meshTris);
+		if (std::ifstream(filename).good() && blas->importFrom(filename, meshHash, m_builderMode))
+		{
+			cached = true;
+			return blas;
+		}
+		delete blas;
+	}
+
+	BVH *blas = m_useSBVH ? (BVH*)new SBVH(&meshTris, m_mode, m_progress, m_numThreads) : new BVH(&meshTris, m_mode, m_numThreads);
+	if (m_optimizePasses > 0)
+		TreeletOptimizer(*blas, m_numThreads).optimize(m_optimizePasses);
+	if (!filename.empty())
+		blas->exportTo(filename, meshHash, m_builderMode);
+
+	return blas;
+}
+
+// Full SAH sweep over instance centroids, one instance per leaf. Depth-first layout.
+U32 TwoLevelBVH::buildTopLevel(std::vector<U32> &ids, const std::vector<AABB_t> &boxes, U32 begin, U32 end, S32 parent)
+{
+	const U32 idx = (U32)m_nodes.size();
+	m_nodes.emplace_back();
+
+	Node n;
+	n.parent = parent;
+	n.leftChild = idx + 1;
+	for (U32 i = begin; i < end; i++)
+		n.box.expand(boxes[ids[i]]);
+
+	if (end - begin == 1)
+	{
+		n.iStart = m_numTopNodes + ids[begin];
+		n.leftChild = m_blasRoots[m_instanceMesh[ids[begin]]];
+		n.nPrims = 1;
+		m_nodes[idx] = n;
+		return idx;
+	}
+
+	const U32 count = end - begin;
+	std::vector<F32> rightAreas(count);
+	F32 bestCost = FLT_MAX;
+	U32 bestSplit = begin + count / 2;
+	std::vector<U32> bestOrder;
+
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		auto byCentroid = [&](U32 a, U32 b)
+		{
+			return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+		};
+		std::sort(ids.begin() + begin, ids.begin() + end, byCentroid);
+
+		AABB_t right;
+		for (U32 i = count; i-- > 1;)
+		{
+			right.expand(boxes[ids[begin + i]]);
+			rightAreas[i] = right.area();
+		}
+
+		AABB_t left;
+		bool improved = false;
+		for (U32 i = 1; i < count; i++)
+		{
+			left.expand(boxes[ids[begin + i - 1]]);
+			const F32 cost = left.area() * i + rightAreas[i] * (count - i);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = begin + i;
+				improved = true;
+			}
+		}
+
+		// Exact order that was costed, re-sorting could reorder ties
+		if (improved)
+			bestOrder.assign(ids.begin() + begin, ids.begin() + end);
+	}
+
+	if (!bestOrder.empty())
+		std::copy(bestOrder.begin(), bestOrder.end(), ids.begin() + begin);
+
+	buildTopLevel(ids, boxes, begin, bestSplit, (S32)idx);
+	n.rightChild = buildTopLevel(ids, boxes, bestSplit, end, (S32)idx);
+	m_nodes[idx] = n;
+	return idx;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include "bvh.hpp"
+
+class Scene;
+class ProgressView;
+
+/*
+	Two-level hierarchy over the meshes and instances of a Scene.
+	Every mesh gets one bottom-level BVH, built once no matter how often it is instanced,
+	and a top-level BVH is built over the world-space boxes of the instances.
+	m_nodes: [top-level nodes | instance records | bottom-level nodes], see GPUInstance.
+	m_indices holds scene triangle indices, bottom-level trees are in object space.
+	With a cache prefix, bottom-level trees are stored per mesh under the hash of its
+	object-space positions, so moving or adding models only rebuilds what changed.
+*/
+class TwoLevelBVH : public BVH
+{
+public:
+	TwoLevelBVH(Scene *scene, SplitMode mode, bool useSBVH, ProgressView *progress, U32 numThreads = 0,
+		U32 optimizePasses = 0, const std::string cachePrefix = "", U32 builderMode = 0);
+	~TwoLevelBVH() {}
+
+private:
+	BVH *buildBottomLevel(std::vector<RTTriangle> &meshTris, bool &cached);
+	U32 buildTopLevel(std::vector<U32> &ids, const std::vector<AABB_t> &boxes, U32 begin, U32 end, S32 parent);
+
+	std::vector<U32> m_instanceMesh;	// mesh of each instance
+	std::vector<U32> m_blasRoots;		// root node of each mesh, final position
+	U32 m_numTopNodes = 0;
+
+	bool m_useSBVH;
+	ProgressView *m_progress;
+	U32 m_numThreads;
+	U32 m_optimizePasses;	// treelet passes per bottom-level tree
+	std::string m_cachePrefix;
+	U32 m_builderMode;
+};
@@ -224,30 +224,79 @@ inline float pdfAtoW(const float pdf, const float dist, const float cosine)
     return pdf * (dist * dist) / fabs(cosine);
 }
 
+// Only the compact record is stored, see interpolateHit
 inline void writeHitSoA(Hit hit, global GPUTaskState *tasks, const size_t gid, const uint numTasks)
 {
-	WriteFloat3(P, tasks, hit.P);
-	WriteFloat3(N, tasks, hit.N);
-	WriteFloat2(uvTex, tasks, hit.uvTex);
+	WriteFloat2(bary, tasks, hit.bary);
 	WriteF32(t, tasks, hit.t);
 	WriteI32(i, tasks, hit.i);
 	WriteI32(areaLightHit, tasks, hit.areaLightHit);
-	WriteI32(matId, tasks, hit.matId);
+	WriteU32(inst, tasks, hit.inst);
 }
 
 inline Hit readHitSoA(global GPUTaskState *tasks, const size_t gid, const uint numTasks)
 {
-	Hit hit;
-	hit.P = ReadFloat3(P, tasks);
-	hit.N = ReadFloat3(N, tasks);
-	hit.uvTex = ReadFloat2(uvTex, tasks);
+	Hit hit = EMPTY_HIT(0.0f);
+	hit.bary = ReadFloat2(bary, tasks);
 	hit.t = ReadF32(t, tasks);
 	hit.i = ReadI32(i, tasks);
 	hit.areaLightHit = ReadI32(areaLightHit, tasks);
-	hit.matId = ReadI32(matId, tasks);
+	hit.inst = ReadU32(inst, tasks);
 	return hit;
 }
 
+#if defined(USE_INSTANCING)
+inline global GPUInstance *instanceRecord(global GPUNode *nodes, uint slot)
+{
+    return (global GPUInstance*)&nodes[slot];
+}
+
+// Inverse transpose of the object-to-world transform = transpose of world-to-object
+inline float3 normalToWorld(float3 n, global GPUInstance *inst)
+{
+    const float4 r0 = vload4(0, inst->worldToObject);
+    const float4 r1 = vload4(1, inst->worldToObject);
+    const float4 r2 = vload4(2, inst->worldToObject);
+    return normalize(r0.xyz * n.x + r1.xyz * n.y + r2.xyz * n.z);
+}
+#endif
+
+// Shading attributes of a hit record, computed by the kernels that shade it.
+// Position from the world-space ray, so that t is shared by both hierarchy levels.
+inline void interpolateHit(Hit *hit, float3 orig, float3 dir, global Triangle *tris, global GPUNode *nodes, global RenderParams *params)
+{
+    if (hit->i < 0)
+        return;
+
+    hit->P = orig + hit->t * dir;
+    if (hit->areaLightHit)
+    {
+        hit->N = params->areaLight.N;
+        hit->uvTex = (float2)(0.0f);
+        hit->matId = 0; // default material (always available)
+        return;
+    }
+
+    global Triangle *tri = &tris[hit->i];
+    hit->matId = tri->matId;
+    hit->N = normalize(lerp(hit->bary.x, hit->bary.y, tri->v0.n, tri->v1.n, tri->v2.n));
+    hit->uvTex = lerp(hit->bary.x, hit->bary.y, tri->v0.t, tri->v1.t, tri->v2.t).xy;
+#if defined(USE_INSTANCING)
+    hit->N = normalToWorld(hit->N, instanceRecord(nodes, hit->inst));
+#endif
+}
+
+// Hit of a path as shaded by the logic kernel: interpolated from the ray in the
+// path state, with the normal mapped and flipped normal the logic kernel stored
+inline Hit readShadingHit(global GPUTaskState *tasks, global Triangle *tris, global GPUNode *nodes,
+    global RenderParams *params, const size_t gid, const uint numTasks)
+{
+    Hit hit = readHitSoA(tasks, gid, numTasks);
+    interpolateHit(&hit, ReadFloat3(orig, tasks), ReadFloat3(dir, tasks), tris, nodes, params);
+    hit.N = ReadFloat3(shadingN, tasks);
+    return hit;
+}
+
 inline void sampleAreaLight(AreaLight light, float *pdf, float3 *p, uint *seed)
 {
 	*pdf = native_recip (4.0f * light.size.x * light.size.y);
@@ -382,4 +431,4 @@ inline void atomicIncCounter(global uint* ctr)
 #endif
 }
 
-#endif
\ No newline at end of file
+#endif
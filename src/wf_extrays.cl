@@ -1,22 +1,18 @@
 #include "geom.h"
 #include "bvh.cl"
 
-// Trace extension ray for all paths in queue
-kernel void traceExtension(
+inline void traceExtensionRay(
     global GPUTaskState* tasks,
-    global QueueCounters* queueLens,
     global uint* extensionQueue,
-    global Triangle* tris,
+    global LeafTriangle* triPos,
     global GPUNode* nodes,
     global uint* indices,
     global RenderParams* params,
+    global uint* traversalStats,
+    const uint gid_direct,
     const uint numTasks
 )
 {
-    uint gid_direct = get_global_id(0);
-    if (gid_direct >= queueLens->extensionQueue)
-        return;
-
     const uint gid = extensionQueue[gid_direct];
 
     const float3 rayOrig = ReadFloat3(orig, tasks);
@@ -25,7 +21,10 @@ kernel void traceExtension(
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX);
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, triPos, nodes, indices);
+#ifdef TRAVERSAL_STATS
+    recordTraversalStats(&r, traversalStats, ReadU32(pixelIndex, tasks));
+#endif
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
     
     global uint *len = &ReadU32(pathLen, tasks);
@@ -33,4 +32,45 @@ kernel void traceExtension(
 
     // Write hit to path state
     writeHitSoA(hit, tasks, gid, numTasks);
+}
+
+// Trace extension ray for all paths in queue
+kernel void traceExtension(
+    global GPUTaskState* tasks,
+    global QueueCounters* queueLens,
+    global uint* extensionQueue,
+    global LeafTriangle* triPos,
+    global GPUNode* nodes,
+    global uint* indices,
+    global RenderParams* params,
+    global uint* traversalStats,
+    const uint numTasks
+)
+{
+#ifdef PERSISTENT_THREADS
+    // Launch sized to the device, groups fetch batches until the queue is drained (Aila & Laine 2009)
+    local uint batchStart;
+    const uint queueLen = queueLens->extensionQueue;
+    while (true)
+    {
+        if (get_local_id(0) == 0)
+            batchStart = atomic_add(&queueLens->extensionFetch, (uint)get_local_size(0));
+        barrier(CLK_LOCAL_MEM_FENCE);
+        const uint first = batchStart;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (first >= queueLen)
+            return;
+
+        const uint gid_direct = first + get_local_id(0);
+        if (gid_direct < queueLen)
+            traceExtensionRay(tasks, extensionQueue, triPos, nodes, indices, params, traversalStats, gid_direct, numTasks);
+    }
+#else
+    uint gid_direct = get_global_id(0);
+    if (gid_direct >= queueLens->extensionQueue)
+        return;
+
+    traceExtensionRay(tasks, extensionQueue, triPos, nodes, indices, params, traversalStats, gid_direct, numTasks);
+#endif
 }
\ No newline at end of file
@@ -52,11 +52,14 @@ kernel void logic(
     uint seed = ReadU32(seed, tasks);
     uint len = ReadU32(pathLen, tasks);
     
-    Hit hit = readHitSoA(tasks, gid, numTasks);
     const float3 rayOrig = ReadFloat3(orig, tasks);
     const float3 rayDir = ReadFloat3(dir, tasks);
     Ray r = { rayOrig, rayDir };
 
+    // Traversal stores the compact hit only
+    Hit hit = readHitSoA(tasks, gid, numTasks);
+    interpolateHit(&hit, rayOrig, rayDir, tris, nodes, params);
+
     float3 T = ReadFloat3(T, tasks);
 
     // Russian roulette
@@ -236,8 +239,8 @@ kernel void logic(
     }
 #endif
 
-    // Update updated hit struct
-    writeHitSoA(hit, tasks, gid, numTasks);
+    // Material kernels redo the interpolation but reuse the shading normal, see readShadingHit
+    WriteFloat3(shadingN, tasks, hit.N);
     WriteU32(backfaceHit, tasks, backface);
     
 #ifdef SAMPLE_EXPLICIT
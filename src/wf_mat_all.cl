@@ -10,6 +10,8 @@ kernel void wavefrontAllMaterials(
     global Material *materials,
     global uchar *texData,
     global TexDescriptor *textures,
+    global Triangle *tris,
+    global GPUNode *nodes,
     global RenderParams *params,
     uint numTasks
 )
@@ -21,7 +23,7 @@ kernel void wavefrontAllMaterials(
     uint gid = materialQueue[gid_direct];
     uint seed = ReadU32(seed, tasks);
 
-    Hit hit = readHitSoA(tasks, gid, numTasks);
+    Hit hit = readShadingHit(tasks, tris, nodes, params, gid, numTasks);
     Material mat = materials[hit.matId];
     bool backface = (bool)ReadU32(backfaceHit, tasks);
 
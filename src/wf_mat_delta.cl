@@ -13,6 +13,8 @@ kernel void wavefrontDelta(
     global Material *materials,
     global uchar *texData,
     global TexDescriptor *textures,
+    global Triangle *tris,
+    global GPUNode *nodes,
     global RenderParams *params,
     uint numTasks
 )
@@ -24,7 +26,7 @@ kernel void wavefrontDelta(
     uint gid = deltaQueue[gid_direct];
     uint seed = ReadU32(seed, tasks);
 
-    Hit hit = readHitSoA(tasks, gid, numTasks);
+    Hit hit = readShadingHit(tasks, tris, nodes, params, gid, numTasks);
     Material mat = materials[hit.matId];
     bool backface = (bool)ReadU32(backfaceHit, tasks);
 
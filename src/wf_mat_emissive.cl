@@ -12,6 +12,8 @@ kernel void wavefrontEmissive(
     global Material *materials,
     global uchar *texData,
     global TexDescriptor *textures,
+    global Triangle *tris,
+    global GPUNode *nodes,
     global RenderParams *params,
     uint numTasks
 )
@@ -23,7 +25,7 @@ kernel void wavefrontEmissive(
     uint gid = materialQueue[gid_direct];
     uint seed = ReadU32(seed, tasks);
 
-    Hit hit = readHitSoA(tasks, gid, numTasks);
+    Hit hit = readShadingHit(tasks, tris, nodes, params, gid, numTasks);
     Material mat = materials[hit.matId];
     bool backface = (bool)ReadU32(backfaceHit, tasks);
 
@@ -0,0 +1,261 @@
+#include "geom.h"
+#include "bvh.cl"
+
+// Camera rays of one screen tile traced as a packet by one work-group.
+// genRays orders pixels in PACKET_TILE-high bands (see tilePixelIndex), so
+// consecutive raygen queue entries cover a compact tile.
+
+#define PACKET_SIZE (PACKET_TILE * PACKET_TILE)
+#define PACKET_DONE 0xFFFFFFFF
+#define PACKET_STACK_SIZE 64
+
+#if !defined(USE_INSTANCING) && !defined(USE_WIDE_BVH) && !defined(USE_QUANTIZED_BVH) && !defined(USE_BITSTACK)
+#define PACKET_BVH
+#endif
+
+#ifdef PACKET_BVH
+// Ranges of origins and inverse directions over the rays of the packet
+typedef struct
+{
+    float3 omin, omax;
+    float3 imin, imax;
+} PacketFrustum;
+
+// Work-group state, declared at kernel scope as OpenCL requires
+typedef struct
+{
+    float4 scratch[PACKET_SIZE];
+    uint stack[PACKET_STACK_SIZE];
+    int stackptr;
+    uint current;
+    uint overflow; // stack full, rays finish individually
+    uint votes[4]; // left, right, both, right closer
+} PacketShared;
+
+// Work-group min and max of v, inactive rays excluded
+inline void packetRange(float3 v, bool active, local float4 *scratch, float3 *vmin, float3 *vmax)
+{
+    const uint lid = get_local_id(0);
+
+    scratch[lid] = (float4)(active ? v : (float3)(FLT_MAX), 0.0f);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = PACKET_SIZE / 2; s > 0; s >>= 1)
+    {
+        if (lid < s) scratch[lid] = fmin(scratch[lid], scratch[lid + s]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    *vmin = scratch[0].xyz;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    scratch[lid] = (float4)(active ? v : (float3)(-FLT_MAX), 0.0f);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = PACKET_SIZE / 2; s > 0; s >>= 1)
+    {
+        if (lid < s) scratch[lid] = fmax(scratch[lid], scratch[lid + s]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    *vmax = scratch[0].xyz;
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Interval arithmetic slab test: true if the box is missed by every ray of the packet.
+// Axes where directions change sign give no bound.
+inline bool packetMissesBox(global AABB *box, const PacketFrustum *f)
+{
+    const float3 a0 = box->min - f->omax, a1 = box->min - f->omin;
+    const float3 b0 = box->max - f->omax, b1 = box->max - f->omin;
+    const float3 ta0 = a0 * f->imin, ta1 = a0 * f->imax, ta2 = a1 * f->imin, ta3 = a1 * f->imax;
+    const float3 tb0 = b0 * f->imin, tb1 = b0 * f->imax, tb2 = b1 * f->imin, tb3 = b1 * f->imax;
+
+    float3 entry = fmin(fmin(fmin(ta0, ta1), fmin(ta2, ta3)), fmin(fmin(tb0, tb1), fmin(tb2, tb3)));
+    float3 exit = fmax(fmax(fmax(ta0, ta1), fmax(ta2, ta3)), fmax(fmax(tb0, tb1), fmax(tb2, tb3)));
+    const int3 mixed = (f->imin < 0.0f) & (f->imax > 0.0f);
+    entry = select(entry, (float3)(-FLT_MAX), mixed);
+    exit = select(exit, (float3)(FLT_MAX), mixed);
+
+    const float tEntry = fmax(fmax(entry.x, entry.y), entry.z);
+    const float tExit = fmin(fmin(exit.x, exit.y), exit.z);
+    return tExit < 0.0f || tEntry > tExit;
+}
+
+// Shared-stack traversal: the group visits the union of the nodes hit by its rays,
+// children ordered by majority vote. Rays outside a leaf's box skip its triangles.
+// Trees too deep for the shared stack are finished with per-ray traversal.
+inline void packet_intersect(Ray *r, Hit *hit, bool active, local PacketShared *sh, global LeafTriangle *triPos, global GPUNode *nodes, global uint *indices)
+{
+    const uint lid = get_local_id(0);
+    float2 hitUV = (float2)(0.0f);
+    bool found = false;
+    float lnear, lfar, rnear, rfar; // AABB limits
+
+    PacketFrustum f;
+    packetRange(r->orig, active, sh->scratch, &f.omin, &f.omax);
+    packetRange(native_recip(r->dir), active, sh->scratch, &f.imin, &f.imax);
+
+    if (lid == 0)
+    {
+        sh->stack[0] = 0;
+        sh->stackptr = 0;
+        sh->overflow = 0;
+    }
+
+    while (true)
+    {
+        if (lid == 0)
+        {
+            sh->current = (sh->stackptr >= 0) ? sh->stack[sh->stackptr--] : PACKET_DONE;
+            sh->votes[0] = sh->votes[1] = sh->votes[2] = sh->votes[3] = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        const uint ni = sh->current;
+        if (ni == PACKET_DONE)
+            break;
+
+        const GPUNode n = nodes[ni];
+        TRAVERSAL_NODE(r);
+
+        if (n.nPrims != 0) // Leaf node
+        {
+            if (active && intersectAABB(r, &(nodes[ni].box), &lnear, &lfar, hit->t))
+            {
+                float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
+                int imin = -1;
+                for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+                {
+                    float t, u, v;
+                    TRAVERSAL_TRI(r);
+                    if (intersectTriangle(r, LEAF_TRI(i), &t, &u, &v))
+                    {
+                        if (t > 0.0f && t < tmin)
+                        {
+                            imin = i;
+                            tmin = t;
+                            umin = u;
+                            vmin = v;
+                        }
+                    }
+                }
+                if (imin != -1 && tmin < hit->t)
+                {
+                    hit->i = LEAF_TRI_ID(imin);
+                    hit->t = tmin;
+                    hitUV = (float2)(umin, vmin);
+                    found = true;
+                }
+            }
+        }
+        else // Internal node
+        {
+            // Frustum culling decides for the whole group, no divergence
+            const bool leftCulled = packetMissesBox(&(nodes[n.leftChild].box), &f);
+            const bool rightCulled = packetMissesBox(&(nodes[n.rightChild].box), &f);
+
+            const bool leftWasHit = active && !leftCulled && intersectAABB(r, &(nodes[n.leftChild].box), &lnear, &lfar, hit->t);
+            const bool rightWasHit = active && !rightCulled && intersectAABB(r, &(nodes[n.rightChild].box), &rnear, &rfar, hit->t);
+
+            if (leftWasHit) atomic_inc(&sh->votes[0]);
+            if (rightWasHit) atomic_inc(&sh->votes[1]);
+            if (leftWasHit && rightWasHit)
+            {
+                atomic_inc(&sh->votes[2]);
+                if (rnear < lnear) atomic_inc(&sh->votes[3]);
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (lid == 0)
+            {
+                uint closer = n.leftChild;
+                uint farther = n.rightChild;
+
+                // Right child was closer for most rays -> swap
+                if (2 * sh->votes[3] > sh->votes[2]) swap_m(closer, farther, uint);
+
+                // No room for two children => abandon the packet traversal
+                if (sh->stackptr + 2 >= PACKET_STACK_SIZE)
+                {
+                    sh->overflow = 1;
+                    sh->stackptr = -1;
+                }
+                // Farther node pushed first
+                else if (sh->votes[0] > 0 && sh->votes[1] > 0)
+                {
+                    sh->stack[++sh->stackptr] = farther;
+                    sh->stack[++sh->stackptr] = closer;
+                }
+                else if (sh->votes[0] > 0)
+                {
+                    sh->stack[++sh->stackptr] = n.leftChild;
+                }
+                else if (sh->votes[1] > 0)
+                {
+                    sh->stack[++sh->stackptr] = n.rightChild;
+                }
+            }
+        }
+
+        // Current node read by all before the next pop
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Compact hit record, shading attributes interpolated on use
+    if (found)
+        hit->bary = hitUV;
+
+    // Closest hit so far bounds the restart
+    if (sh->overflow && active)
+        bvh_intersect(r, hit, triPos, nodes, indices);
+}
+#endif
+
+// Trace camera rays of all regenerated paths
+kernel __attribute__((reqd_work_group_size(PACKET_SIZE, 1, 1)))
+void tracePrimary(
+    global GPUTaskState* tasks,
+    global QueueCounters* queueLens,
+    global uint* raygenQueue,
+    global LeafTriangle* triPos,
+    global GPUNode* nodes,
+    global uint* indices,
+    global RenderParams* params,
+    global uint* traversalStats,
+    const uint numTasks
+)
+{
+    // No early exit, the whole group takes part in the traversal
+    const uint gid_direct = get_global_id(0);
+    const bool active = gid_direct < queueLens->raygenQueue;
+    const uint gid = active ? raygenQueue[gid_direct] : 0;
+
+    Ray r = { (float3)(0.0f), (float3)(0.0f, 0.0f, 1.0f) };
+    if (active)
+    {
+        r.orig = ReadFloat3(orig, tasks);
+        r.dir = ReadFloat3(dir, tasks);
+    }
+
+    // Trace ray
+    Hit hit = EMPTY_HIT(FLT_MAX);
+#ifdef PACKET_BVH
+    local PacketShared shared;
+    packet_intersect(&r, &hit, active, &shared, triPos, nodes, indices);
+#else
+    // Other node layouts: packet kernel launch, rays traced individually
+    if (active)
+        bvh_intersect(&r, &hit, triPos, nodes, indices);
+#endif
+
+    if (!active)
+        return;
+
+#ifdef TRAVERSAL_STATS
+    recordTraversalStats(&r, traversalStats, ReadU32(pixelIndex, tasks));
+#endif
+    if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
+
+    global uint *len = &ReadU32(pathLen, tasks);
+    *len += 1;
+
+    // Write hit to path state
+    writeHitSoA(hit, tasks, gid, numTasks);
+}
@@ -1,6 +1,19 @@
 #include "geom.h"
 #include "utils.cl"
 
+#ifdef PACKET_TRAVERSAL
+// Sample index => pixel, column by column within PACKET_TILE-high bands.
+// Consecutive samples then fill screen tiles instead of scanlines.
+inline uint tilePixelIndex(uint s, uint width, uint height)
+{
+    const uint band = s / (width * PACKET_TILE);
+    const uint y0 = band * PACKET_TILE;
+    const uint bandHeight = min((uint)PACKET_TILE, height - y0);
+    const uint i = s - y0 * width;
+    return (y0 + i % bandHeight) * width + i / bandHeight;
+}
+#endif
+
 kernel void genRays(
     global GPUTaskState* tasks,
     global RenderParams* params,
@@ -23,6 +36,9 @@ kernel void genRays(
     // Calculate pixel coordinates
     uint numPixels = params->width * params->height;
     uint pixelIdx = (*currPixelIdx + gid_direct) % numPixels; // TODO: use gid_local + currentPixelIdx update on host
+#ifdef PACKET_TRAVERSAL
+    pixelIdx = tilePixelIndex(pixelIdx, params->width, params->height);
+#endif
     WriteU32(pixelIndex, tasks, pixelIdx);
 
     // Camera plane is 1 unit away, by convention
@@ -68,9 +84,12 @@ kernel void genRays(
     WriteFloat3(orig, tasks, rayOrig);
     WriteFloat3(dir, tasks, rayDirection);
 
+#ifndef PACKET_TRAVERSAL
     // Add paths to extension queue
+    // (packet mode: traced by tracePrimary straight from the raygen queue)
     uint extIdx = atomicIncAll(&queueLens->extensionQueue);
     extensionQueue[extIdx] = gid;
+#endif
 
     // TODO: pixel pointer has to be updated on HOST
     // ALSO: reset queue sizes to zero
@@ -11,6 +11,7 @@ kernel void reset(
     global uint* raygenQueue,
     global RenderParams* params,
     global uint* samplesPerPixel,
+    global uint* traversalStats,
     uint numTasks
 )
 {
@@ -24,6 +25,9 @@ kernel void reset(
         // default value for direct emission (not updated in logic kernel)
         vstore4((float4)(0.1f, 0.1f, 0.1f, 0.0f), gid, denoiserAlbedo);
         vstore(0, gid, samplesPerPixel);
+#ifdef TRAVERSAL_STATS
+        vstore2((uint2)(0), gid, traversalStats);
+#endif
     }
     
     // Clear path data
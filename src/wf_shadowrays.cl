@@ -2,22 +2,18 @@
 #include "bvh.cl"
 #include "intersect.cl"
 
-// Trace shadow ray for all paths in queue
-kernel void traceShadow(
+inline void traceShadowRay(
     global GPUTaskState* tasks,
-    global QueueCounters* queueLens,
     global uint* shadowQueue,
-    global Triangle* tris,
+    global LeafTriangle* triPos,
     global GPUNode* nodes,
     global uint* indices,
     global RenderParams* params,
-    uint numTasks
+    global uint* traversalStats,
+    const uint gid_direct,
+    const uint numTasks
 )
 {
-    uint gid_direct = get_global_id(0);
-    if (gid_direct >= queueLens->shadowQueue)
-        return;
-
     const uint gid = shadowQueue[gid_direct];
 
     const float3 rayOrig = ReadFloat3(shadowOrig, tasks);
@@ -30,10 +26,54 @@ kernel void traceShadow(
     
     // TEST: area light not occluding
     if (params->useAreaLight) intersectLight(&hitL, &r, params);
-    bool occluded = (hitL.i > -1) || bvh_occluded(&r, &lenL, tris, nodes, indices);
+    bool occluded = (hitL.i > -1) || bvh_occluded(&r, &lenL, triPos, nodes, indices);
+#ifdef TRAVERSAL_STATS
+    recordTraversalStats(&r, traversalStats, ReadU32(pixelIndex, tasks));
+#endif
 
     // Write hit to path state
     WriteU32(shadowRayBlocked, tasks, occluded);
+}
+
+// Trace shadow ray for all paths in queue
+kernel void traceShadow(
+    global GPUTaskState* tasks,
+    global QueueCounters* queueLens,
+    global uint* shadowQueue,
+    global LeafTriangle* triPos,
+    global GPUNode* nodes,
+    global uint* indices,
+    global RenderParams* params,
+    global uint* traversalStats,
+    uint numTasks
+)
+{
+#ifdef PERSISTENT_THREADS
+    // Same batch fetching as traceExtension
+    local uint batchStart;
+    const uint queueLen = queueLens->shadowQueue;
+    while (true)
+    {
+        if (get_local_id(0) == 0)
+            batchStart = atomic_add(&queueLens->shadowFetch, (uint)get_local_size(0));
+        barrier(CLK_LOCAL_MEM_FENCE);
+        const uint first = batchStart;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (first >= queueLen)
+            return;
+
+        const uint gid_direct = first + get_local_id(0);
+        if (gid_direct < queueLen)
+            traceShadowRay(tasks, shadowQueue, triPos, nodes, indices, params, traversalStats, gid_direct, numTasks);
+    }
+#else
+    uint gid_direct = get_global_id(0);
+    if (gid_direct >= queueLens->shadowQueue)
+        return;
+
+    traceShadowRay(tasks, shadowQueue, triPos, nodes, indices, params, traversalStats, gid_direct, numTasks);
+#endif
 
     // Clear queue on HOST
 }
\ No newline at end of file
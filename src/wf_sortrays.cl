@@ -0,0 +1,46 @@
+#include "geom.h"
+
+// Spread lower 10 bits over 30 bits (as in lbvh.cl)
+inline uint expandBits(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Direction octant in bits 27-29 above a 27-bit Morton code of the origin within the scene bounds
+inline uint rayKey(float3 orig, float3 dir, global RenderParams *params)
+{
+    const float3 extent = fmax(params->worldMax - params->worldMin, (float3)(1e-20f));
+    const float3 c = (orig - params->worldMin) / extent;
+    const uint3 q = convert_uint3(clamp(c * 512.0f, (float3)(0.0f), (float3)(511.0f)));
+    const uint octant = (dir.x < 0.0f ? 4u : 0u) | (dir.y < 0.0f ? 2u : 0u) | (dir.z < 0.0f ? 1u : 0u);
+    return (octant << 27) | (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+}
+
+// Sort keys for the extension or shadow queue, radix sorted on the device afterwards.
+// Launched over the queue length read by the host, only queued entries are keyed.
+kernel void rayKeys(
+    global GPUTaskState* tasks,
+    global QueueCounters* queueLens,
+    global uint* queue,
+    global uint* keys,
+    global uint* values,
+    global RenderParams* params,
+    uint shadowRays
+)
+{
+    const uint gid_direct = get_global_id(0);
+    const uint len = (shadowRays) ? queueLens->shadowQueue : queueLens->extensionQueue;
+    if (gid_direct >= len)
+        return;
+
+    const uint gid = queue[gid_direct];
+    if (shadowRays)
+        keys[gid_direct] = rayKey(ReadFloat3(shadowOrig, tasks), ReadFloat3(shadowDir, tasks), params);
+    else
+        keys[gid_direct] = rayKey(ReadFloat3(orig, tasks), ReadFloat3(dir, tasks), params);
+    values[gid_direct] = gid;
+}